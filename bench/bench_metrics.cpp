@@ -0,0 +1,314 @@
+#include "algorithm"
+#include "atomic"
+#include "chrono"
+#include "cstdlib"
+#include "iomanip"
+#include "sstream"
+
+#include "metrics/common.h"
+#include "metrics/kernels.h"
+#include "metrics/scheduler.h"
+#include "metrics/thread_budget.h"
+
+#include "args/args.hxx"
+
+#include "synthetic_mesh.h"
+
+// Offline benchmark of the metric kernels and of the batch pipeline on
+// generated meshes. Nothing is written besides the temporary batch folder.
+
+struct BenchCase {
+  std::string name;
+  SyntheticMeshOptions options;
+};
+
+// Median wall time of repeat runs of work.
+template <typename Work> double medianSeconds(size_t repeat, Work work) {
+  std::vector<double> seconds;
+  for (size_t i = 0; i < std::max<size_t>(1, repeat); ++i) {
+    auto start = std::chrono::steady_clock::now();
+    work();
+    seconds.push_back(std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count());
+  }
+  std::sort(seconds.begin(), seconds.end());
+  return seconds[seconds.size() / 2];
+}
+
+void printRow(const std::string &benchCase, const std::string &stage,
+              size_t threads, double seconds, double faces, double meshes) {
+  std::cout << std::left << std::setw(14) << benchCase << std::setw(20)
+            << stage << std::right << std::setw(8) << threads << std::fixed
+            << std::setprecision(4) << std::setw(12) << seconds
+            << std::setprecision(2) << std::setw(14) << faces / seconds / 1e6;
+  if (meshes > 0) {
+    std::cout << std::setw(12) << meshes / seconds;
+  }
+  std::cout << std::endl;
+}
+
+// Whether the BVH engine flags the same faces as CGAL. An exact ratio
+// outside the confidence interval of the sampled estimate is reported but
+// passes.
+bool checkSelfIntersection(const std::string &benchCase, size_t threads,
+                           const SelfIntersectionResult &sir,
+                           const std::vector<uint8_t> &cgalFaces,
+                           const std::vector<uint8_t> &bvhFaces,
+                           const SelfIntersectionResult &sampled) {
+  bool ok = true;
+  size_t differing = 0;
+  for (size_t f = 0; f < std::max(cgalFaces.size(), bvhFaces.size()); ++f) {
+    bool cgal = f < cgalFaces.size() && cgalFaces[f];
+    bool bvh = f < bvhFaces.size() && bvhFaces[f];
+    differing += cgal != bvh;
+  }
+  if (differing > 0) {
+    std::cerr << "Error: " << benchCase << ", " << threads
+              << " threads: the BVH engine and CGAL disagree on " << differing
+              << " faces" << std::endl;
+    ok = false;
+  }
+  double ratio = 0.0;
+  if (sir.faces_num > 0) {
+    ratio = static_cast<double>(sir.self_intersect_faces_num) / sir.faces_num;
+  }
+  // A 95% interval misses about one mesh in twenty by design, so a miss is
+  // only reported.
+  if (ratio < sampled.ratio_low || ratio > sampled.ratio_high) {
+    std::cerr << "Warning: " << benchCase << ", " << threads
+              << " threads: SIR " << ratio
+              << " is outside the sampled interval [" << sampled.ratio_low
+              << ", " << sampled.ratio_high << "]" << std::endl;
+  }
+  return ok;
+}
+
+// Returns false when the engines of checkSelfIntersection() disagree.
+bool benchKernels(const BenchCase &benchCase,
+                  const std::vector<size_t> &threadCounts, size_t repeat,
+                  bool selfIntersection) {
+  bool ok = true;
+  FlatMesh mesh = generateSyntheticMesh(benchCase.options);
+  const double faces = static_cast<double>(mesh.numTriangles());
+  const MeshView view = mesh.view();
+
+  for (size_t threads : threadCounts) {
+    size_t segments = 0;
+    double seconds = medianSeconds(repeat, [&]() {
+      segments = computeComponents(view, false, threads).count;
+    });
+    printRow(benchCase.name, "segment", threads, seconds, faces, 0);
+
+    double dangling = 0.0;
+    seconds = medianSeconds(repeat, [&]() {
+      dangling = computeDanglingEdgeLength(view, threads);
+    });
+    printRow(benchCase.name, "dangling", threads, seconds, faces, 0);
+
+    double flux = 0.0;
+    seconds = medianSeconds(repeat, [&]() {
+      flux = computeFluxEnclosureError(view, threads);
+    });
+    printRow(benchCase.name, "flux", threads, seconds, faces, 0);
+
+    if (selfIntersection) {
+      Mesh cmesh;
+      seconds = medianSeconds(repeat, [&]() {
+        cmesh.clear();
+        buildSurfaceMesh(view, cmesh);
+      });
+      printRow(benchCase.name, "build", threads, seconds, faces, 0);
+
+      SelfIntersectionResult sir;
+      std::vector<uint8_t> cgalFaces;
+      seconds = medianSeconds(repeat, [&]() {
+        sir = runWithThreads(threads, [&cmesh, &cgalFaces](auto tag) {
+          return computeSelfIntersectionRatio(cmesh, tag, &cgalFaces);
+        });
+      });
+      printRow(benchCase.name, "self_intersection", threads, seconds, faces,
+               0);
+
+      SelfIntersectionResult bvh;
+      std::vector<uint8_t> bvhFaces;
+      seconds = medianSeconds(repeat, [&]() {
+        bvh = computeSelfIntersectionRatioBvh(cmesh, threads, &bvhFaces);
+      });
+      printRow(benchCase.name, "self_intersection_bvh", threads, seconds,
+               faces, 0);
+      SelfIntersectionResult sampled;
+      seconds = medianSeconds(repeat, [&]() {
+        sampled = estimateSelfIntersectionRatio(cmesh, kSirInitialSamples,
+                                                0.0, threads);
+      });
+      printRow(benchCase.name, "self_intersection_sampled", threads, seconds,
+               faces, 0);
+      ok &= checkSelfIntersection(benchCase.name, threads, sir, cgalFaces,
+                                  bvhFaces, sampled);
+    }
+    if (threads == threadCounts.front()) {
+      std::cout << "# " << benchCase.name << ": " << mesh.numTriangles()
+                << " faces, SegE " << segments << ", DangEL " << dangling
+                << ", FluxEE " << flux << std::endl;
+    }
+  }
+  return ok;
+}
+
+// The cad_metrics worker loop without the outputs: schedule, load and run
+// the flat kernels (and SIR) on every file of the batch folder.
+void benchPipeline(const std::string &batchDir,
+                   const std::vector<size_t> &threadCounts, size_t repeat,
+                   bool selfIntersection) {
+  std::vector<std::string> files = list_mesh_files(batchDir);
+  for (size_t threads : threadCounts) {
+    std::atomic<size_t> faces(0);
+    double seconds = medianSeconds(repeat, [&]() {
+      faces = 0;
+      FileScheduler scheduler(files, true);
+      ThreadBudget budget(threads);
+      runWorkers(threads, [&](size_t) {
+        Workspace workspace;
+        size_t iter;
+        while (scheduler.next(iter)) {
+          workspace.trim();
+          FlatMesh &mesh = workspace.mesh;
+          if (!loadFlatMesh(files[iter], mesh, WeldOptions(), &workspace)) {
+            continue;
+          }
+          faces += mesh.numTriangles();
+          {
+            ThreadGrant grant(budget, scheduler.remaining());
+            computeComponents(mesh.view(), false, grant.threads(),
+                              &workspace);
+            computeDanglingEdgeLength(mesh.view(), grant.threads(),
+                                      &workspace);
+            computeFluxEnclosureError(mesh.view(), grant.threads());
+          }
+          if (selfIntersection) {
+            Mesh cmesh;
+            buildSurfaceMesh(mesh.view(), cmesh);
+            ThreadGrant grant(budget, scheduler.remaining(),
+                              kCgalParallelAvailable);
+            runWithThreads(grant.threads(), [&cmesh](auto tag) {
+              return computeSelfIntersectionRatio(cmesh, tag);
+            });
+          }
+        }
+        budget.retire();
+      });
+    });
+    printRow("batch", "pipeline", threads, seconds,
+             static_cast<double>(faces.load()),
+             static_cast<double>(files.size()));
+  }
+}
+
+bool parseThreadCounts(const std::string &list, std::vector<size_t> &counts) {
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    size_t count = std::strtoul(item.c_str(), nullptr, 10);
+    if (count == 0) {
+      std::cerr << "Invalid thread count: " << item << std::endl;
+      return false;
+    }
+    counts.push_back(count);
+  }
+  return !counts.empty();
+}
+
+int main(int argc, char **argv) {
+
+  // Configure the argument parser
+  args::ArgumentParser parser("Benchmark of the metric kernels on generated "
+                              "CAD-like meshes");
+  args::ValueFlag<size_t> facesFlag(
+      parser, "faces", "Triangles of each kernel benchmark mesh.",
+      {"faces"}, 1000000);
+  args::ValueFlag<std::string> threadsFlag(
+      parser, "threads", "Comma separated thread counts (default: 1,all).",
+      {'j', "threads"}, "1," + std::to_string(defaultThreadCount()));
+  args::ValueFlag<size_t> repeatFlag(
+      parser, "repeat", "Runs per measurement, the median is reported.",
+      {"repeat"}, 3);
+  args::ValueFlag<size_t> batchFlag(
+      parser, "batch", "Meshes of the batch pipeline benchmark.", {"batch"},
+      64);
+  args::ValueFlag<size_t> batchFacesFlag(
+      parser, "batch-faces", "Triangles of each batch mesh.", {"batch-faces"},
+      20000);
+  args::Flag noSelfIntersection(parser, "no-sir",
+                                "Skip the self intersection kernel.",
+                                {"no-sir"});
+
+  // Parse args
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (args::Help &h) {
+    std::cout << parser;
+    return 0;
+  } catch (args::ParseError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return 1;
+  }
+
+  std::vector<size_t> threadCounts;
+  if (!parseThreadCounts(args::get(threadsFlag), threadCounts)) {
+    std::cerr << parser;
+    return EXIT_FAILURE;
+  }
+  size_t faces = args::get(facesFlag);
+  size_t repeat = args::get(repeatFlag);
+  bool selfIntersection = !args::get(noSelfIntersection);
+
+  std::vector<BenchCase> cases(4);
+  cases[0].name = "closed";
+  cases[1].name = "shells";
+  cases[1].options.shells = 512;
+  cases[2].name = "open";
+  cases[2].options.openFraction = 0.05;
+  cases[3].name = "intersecting";
+  cases[3].options.shells = 64;
+  cases[3].options.intersecting = true;
+
+  std::cout << std::left << std::setw(14) << "case" << std::setw(20)
+            << "stage" << std::right << std::setw(8) << "threads"
+            << std::setw(12) << "seconds" << std::setw(14) << "Mfaces/s"
+            << std::setw(12) << "meshes/s" << std::endl;
+  bool checked = true;
+  for (BenchCase &benchCase : cases) {
+    benchCase.options.faces = faces;
+    checked &= benchKernels(benchCase, threadCounts, repeat, selfIntersection);
+  }
+
+  // Batch of small meshes with every pathology, written as binary PLY.
+  char batchDir[] = "/tmp/bench_metrics_XXXXXX";
+  if (mkdtemp(batchDir) == nullptr) {
+    std::cerr << "Error: Could not create a temporary folder" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::vector<std::string> written;
+  for (size_t i = 0; i < args::get(batchFlag); ++i) {
+    SyntheticMeshOptions options;
+    options.faces = args::get(batchFacesFlag);
+    options.seed = static_cast<uint32_t>(i + 1);
+    options.shells = 1 + i % 8;
+    options.openFraction = i % 3 == 1 ? 0.02 : 0.0;
+    options.intersecting = i % 4 == 3;
+    std::string path =
+        std::string(batchDir) + "/mesh" + std::to_string(i) + ".ply";
+    if (writeBinaryPly(path, generateSyntheticMesh(options))) {
+      written.push_back(path);
+    }
+  }
+  benchPipeline(batchDir, threadCounts, repeat, selfIntersection);
+
+  for (const std::string &path : written) {
+    std::remove(path.c_str());
+  }
+  rmdir(batchDir);
+  return checked ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "algorithm"
+#include "cmath"
+#include "cstdint"
+#include "cstdio"
+#include "random"
+#include "string"
+#include "unordered_map"
+#include "vector"
+
+#include "metrics/flat_mesh.h"
+
+// Procedural CAD-like test meshes: tessellated boxes with controllable size
+// and the pathologies the metrics look for.
+struct SyntheticMeshOptions {
+  // Approximate number of triangles of the whole mesh.
+  size_t faces = 100000;
+  // Closed boxes, each its own connected component (SegE = shells).
+  size_t shells = 1;
+  // Fraction of triangles removed at random, which opens boundaries
+  // (DangEL > 0, FluxEE != 0).
+  double openFraction = 0.0;
+  // Overlap the shells with random rotations so that they cut through each
+  // other (SIR > 0). Otherwise they sit apart on a grid.
+  bool intersecting = false;
+  uint32_t seed = 1;
+};
+
+namespace synthetic_detail {
+
+// Append the surface of the unit cube split into n x n quads per side, two
+// triangles per quad, outward oriented. Grid points on the cube edges are
+// shared between sides, so the box is closed and manifold.
+inline void appendGridBox(FlatMesh &mesh, size_t n, const double rotation[9],
+                          const double offset[3]) {
+  std::unordered_map<uint64_t, uint32_t> index;
+  auto vertex = [&](size_t i, size_t j, size_t k) {
+    uint64_t key = (static_cast<uint64_t>(i) << 42) |
+                   (static_cast<uint64_t>(j) << 21) | k;
+    auto found = index.find(key);
+    if (found != index.end()) {
+      return found->second;
+    }
+    double p[3] = {static_cast<double>(i) / n - 0.5,
+                   static_cast<double>(j) / n - 0.5,
+                   static_cast<double>(k) / n - 0.5};
+    double q[3];
+    for (int r = 0; r < 3; ++r) {
+      q[r] = rotation[3 * r] * p[0] + rotation[3 * r + 1] * p[1] +
+             rotation[3 * r + 2] * p[2] + offset[r];
+    }
+    uint32_t v = static_cast<uint32_t>(mesh.numVertices());
+    mesh.addVertex(q[0], q[1], q[2]);
+    index.emplace(key, v);
+    return v;
+  };
+
+  for (int axis = 0; axis < 3; ++axis) {
+    // (u, v, axis) is a right handed frame, so u x v points along +axis.
+    int u = (axis + 1) % 3;
+    int w = (axis + 2) % 3;
+    for (int side = 0; side < 2; ++side) {
+      for (size_t a = 0; a < n; ++a) {
+        for (size_t b = 0; b < n; ++b) {
+          uint32_t quad[4];
+          size_t corners[4][2] = {{a, b}, {a + 1, b}, {a + 1, b + 1},
+                                  {a, b + 1}};
+          for (int c = 0; c < 4; ++c) {
+            size_t coord[3];
+            coord[axis] = side == 0 ? 0 : n;
+            coord[u] = corners[c][0];
+            coord[w] = corners[c][1];
+            quad[c] = vertex(coord[0], coord[1], coord[2]);
+          }
+          // The -axis side runs the other way round to face outwards.
+          if (side == 0) {
+            std::swap(quad[1], quad[3]);
+          }
+          uint32_t tris[6] = {quad[0], quad[1], quad[2],
+                              quad[0], quad[2], quad[3]};
+          mesh.triangles.insert(mesh.triangles.end(), tris, tris + 6);
+        }
+      }
+    }
+  }
+}
+
+inline void randomRotation(std::mt19937 &rng, double rotation[9]) {
+  std::uniform_real_distribution<double> angle(0.0, 2.0 * M_PI);
+  double a = angle(rng), b = angle(rng), c = angle(rng);
+  double ca = std::cos(a), sa = std::sin(a);
+  double cb = std::cos(b), sb = std::sin(b);
+  double cc = std::cos(c), sc = std::sin(c);
+  // Rz(a) * Ry(b) * Rx(c)
+  double r[9] = {ca * cb, ca * sb * sc - sa * cc, ca * sb * cc + sa * sc,
+                 sa * cb, sa * sb * sc + ca * cc, sa * sb * cc - ca * sc,
+                 -sb,     cb * sc,                cb * cc};
+  std::copy(r, r + 9, rotation);
+}
+
+} // namespace synthetic_detail
+
+inline FlatMesh generateSyntheticMesh(const SyntheticMeshOptions &options) {
+  using namespace synthetic_detail;
+  std::mt19937 rng(options.seed);
+  size_t shells = std::max<size_t>(1, options.shells);
+  // 12 n^2 triangles per box.
+  size_t perShell = std::max<size_t>(12, options.faces / shells);
+  size_t n = std::max<size_t>(
+      1, static_cast<size_t>(std::sqrt(perShell / 12.0) + 0.5));
+
+  FlatMesh mesh;
+  mesh.reserve(shells * (6 * n * n + 2), shells * 12 * n * n);
+  size_t gridSide =
+      static_cast<size_t>(std::ceil(std::cbrt(static_cast<double>(shells))));
+  std::uniform_real_distribution<double> jitter(-0.3, 0.3);
+  for (size_t s = 0; s < shells; ++s) {
+    double rotation[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    double offset[3] = {static_cast<double>(s % gridSide),
+                        static_cast<double>(s / gridSide % gridSide),
+                        static_cast<double>(s / gridSide / gridSide)};
+    if (options.intersecting) {
+      // Half the spacing and a random pose: neighbours cut each other.
+      randomRotation(rng, rotation);
+      for (int d = 0; d < 3; ++d) {
+        offset[d] = 0.5 * offset[d] + jitter(rng);
+      }
+    } else {
+      for (int d = 0; d < 3; ++d) {
+        offset[d] *= 1.5;
+      }
+    }
+    appendGridBox(mesh, n, rotation, offset);
+  }
+
+  if (options.openFraction > 0.0) {
+    std::bernoulli_distribution drop(std::min(1.0, options.openFraction));
+    size_t kept = 0;
+    for (size_t t = 0; t < mesh.numTriangles(); ++t) {
+      if (!drop(rng)) {
+        std::copy(mesh.triangles.begin() + 3 * t,
+                  mesh.triangles.begin() + 3 * t + 3,
+                  mesh.triangles.begin() + 3 * kept);
+        kept += 1;
+      }
+    }
+    mesh.triangles.resize(3 * kept);
+  }
+  return mesh;
+}
+
+// Binary little endian PLY with float coordinates, as the loaders read them.
+inline bool writeBinaryPly(const std::string &path, const FlatMesh &mesh) {
+  std::FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  std::fprintf(file,
+               "ply\nformat binary_little_endian 1.0\n"
+               "element vertex %zu\nproperty float x\nproperty float y\n"
+               "property float z\nelement face %zu\n"
+               "property list uchar int vertex_indices\nend_header\n",
+               mesh.numVertices(), mesh.numTriangles());
+  std::vector<char> buffer;
+  buffer.reserve(12 * mesh.numVertices() + 13 * mesh.numTriangles());
+  auto put = [&buffer](const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    buffer.insert(buffer.end(), bytes, bytes + size);
+  };
+  for (size_t v = 0; v < mesh.numVertices(); ++v) {
+    float p[3] = {static_cast<float>(mesh.x[v]), static_cast<float>(mesh.y[v]),
+                  static_cast<float>(mesh.z[v])};
+    put(p, sizeof(p));
+  }
+  for (size_t t = 0; t < mesh.numTriangles(); ++t) {
+    unsigned char count = 3;
+    int32_t corners[3] = {static_cast<int32_t>(mesh.triangles[3 * t]),
+                          static_cast<int32_t>(mesh.triangles[3 * t + 1]),
+                          static_cast<int32_t>(mesh.triangles[3 * t + 2])};
+    put(&count, 1);
+    put(corners, sizeof(corners));
+  }
+  bool ok = std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+  return std::fclose(file) == 0 && ok;
+}
@@ -1,14 +1,14 @@
 #!/bin/bash
 
 if [ -z "$1" ]; then
-	echo "Usage: ./eval.sh /path/to/your/folder"
+	echo "Usage: ./eval.sh /path/to/your/folder [/path/to/gt/folder]"
 	exit 1
 fi
 
 FOLDER_PATH="$1"
 
-python3 ./scripts/ply2stl.py "$FOLDER_PATH"
-./build/bin/mesh_segment "$FOLDER_PATH"
-./build/bin/dangling_edge "$FOLDER_PATH"
-./build/bin/flux_enclosure_error "$FOLDER_PATH"
-./build/bin/self_intersection "$FOLDER_PATH"
+if [ -n "$2" ]; then
+	./build/bin/cad_metrics --gt "$2" "$FOLDER_PATH"
+else
+	./build/bin/cad_metrics "$FOLDER_PATH"
+fi
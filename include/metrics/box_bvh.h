@@ -0,0 +1,248 @@
+#pragma once
+
+#include "algorithm"
+#include "atomic"
+#include "cstdint"
+#include "thread"
+#include "vector"
+
+#include "metrics/edge_count.h"
+
+// Broad phase of the BVH self intersection engine (--sir-engine bvh) and of
+// the sampled SIR estimate (--sir-samples).
+//
+// A linear BVH over closed axis aligned boxes: the items are sorted by the
+// Morton code of their box centers, cut into leaves of kBvhLeafSize
+// consecutive items, and every level above merges two neighbouring nodes.
+// The tree is implicit, so a level is one flat array of boxes and a node
+// needs no child pointers. Each item queries the tree only for the items
+// after it in Morton order, which reports every overlapping pair once. A
+// single box can be tested against all items as well (anyOverlap()).
+
+struct Box3 {
+  double min[3];
+  double max[3];
+};
+
+// Closed boxes: touching boxes overlap, like CGAL's box intersection.
+inline bool boxesOverlap(const Box3 &a, const Box3 &b) {
+  return a.min[0] <= b.max[0] && b.min[0] <= a.max[0] &&
+         a.min[1] <= b.max[1] && b.min[1] <= a.max[1] &&
+         a.min[2] <= b.max[2] && b.min[2] <= a.max[2];
+}
+
+inline Box3 mergeBoxes(const Box3 &a, const Box3 &b) {
+  Box3 box;
+  for (int dim = 0; dim < 3; ++dim) {
+    box.min[dim] = std::min(a.min[dim], b.min[dim]);
+    box.max[dim] = std::max(a.max[dim], b.max[dim]);
+  }
+  return box;
+}
+
+// Items per leaf.
+static const size_t kBvhLeafSize = 4;
+// Items a thread takes from the query queue at once.
+static const size_t kBvhQueryBlock = 256;
+
+// Spread the low 10 bits of v to every third bit.
+inline uint32_t spreadMortonBits(uint32_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+class BoxBvh {
+public:
+  // Build the tree over boxes[item] for the given items.
+  BoxBvh(const std::vector<Box3> &boxes, const std::vector<uint32_t> &items,
+         size_t numThreads)
+      : boxes_(boxes) {
+    const size_t n = items.size();
+    if (n == 0) {
+      return;
+    }
+    // Morton codes of the box centers on a 1024^3 grid over their bounds.
+    double low[3], high[3];
+    for (int dim = 0; dim < 3; ++dim) {
+      low[dim] = high[dim] = center(boxes[items[0]], dim);
+    }
+    for (uint32_t item : items) {
+      for (int dim = 0; dim < 3; ++dim) {
+        low[dim] = std::min(low[dim], center(boxes[item], dim));
+        high[dim] = std::max(high[dim], center(boxes[item], dim));
+      }
+    }
+    double scale[3];
+    for (int dim = 0; dim < 3; ++dim) {
+      double extent = high[dim] - low[dim];
+      scale[dim] = extent > 0.0 ? 1023.0 / extent : 0.0;
+    }
+    std::vector<uint64_t> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t code = 0;
+      for (int dim = 0; dim < 3; ++dim) {
+        double cell = (center(boxes[items[i]], dim) - low[dim]) * scale[dim];
+        // NaN and infinite coordinates end up in cell 0.
+        uint32_t bits = cell >= 0.0 && cell <= 1023.0
+                            ? static_cast<uint32_t>(cell)
+                            : 0;
+        code |= spreadMortonBits(bits) << dim;
+      }
+      keys[i] = (static_cast<uint64_t>(code) << 32) | items[i];
+    }
+    std::vector<uint64_t> scratch;
+    radixSortKeys(keys, scratch, numThreads, 4);
+    order_.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      order_[i] = static_cast<uint32_t>(keys[i] & 0xffffffffu);
+    }
+
+    // Leaves, then each level above until a single root.
+    std::vector<Box3> level((n + kBvhLeafSize - 1) / kBvhLeafSize);
+    for (size_t leaf = 0; leaf < level.size(); ++leaf) {
+      size_t begin = leaf * kBvhLeafSize;
+      size_t end = std::min(n, begin + kBvhLeafSize);
+      Box3 box = boxes[order_[begin]];
+      for (size_t i = begin + 1; i < end; ++i) {
+        box = mergeBoxes(box, boxes[order_[i]]);
+      }
+      level[leaf] = box;
+    }
+    levels_.push_back(std::move(level));
+    while (levels_.back().size() > 1) {
+      const std::vector<Box3> &below = levels_.back();
+      std::vector<Box3> above((below.size() + 1) / 2);
+      for (size_t node = 0; node < above.size(); ++node) {
+        above[node] = 2 * node + 1 < below.size()
+                          ? mergeBoxes(below[2 * node], below[2 * node + 1])
+                          : below[2 * node];
+      }
+      levels_.push_back(std::move(above));
+    }
+  }
+
+  BoxBvh(const BoxBvh &) = delete;
+  BoxBvh &operator=(const BoxBvh &) = delete;
+
+  // Call pair(thread, a, b) for every pair of items whose boxes overlap,
+  // each pair once, from numThreads threads.
+  template <typename Pair>
+  void forEachOverlap(size_t numThreads, const Pair &pair) const {
+    const size_t n = order_.size();
+    numThreads = std::max<size_t>(1, std::min(numThreads, n / 1024 + 1));
+    std::atomic<size_t> cursor(0);
+    auto work = [&](size_t thread) {
+      std::vector<std::pair<size_t, size_t>> stack;
+      while (true) {
+        size_t begin = cursor.fetch_add(kBvhQueryBlock);
+        if (begin >= n) {
+          return;
+        }
+        size_t end = std::min(n, begin + kBvhQueryBlock);
+        for (size_t position = begin; position < end; ++position) {
+          query(thread, position, stack, pair);
+        }
+      }
+    };
+    if (numThreads == 1) {
+      work(0);
+      return;
+    }
+    std::vector<std::thread> workers;
+    for (size_t thread = 0; thread < numThreads; ++thread) {
+      workers.push_back(std::thread(work, thread));
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+  // Items in Morton order: neighbours in it are close in space.
+  const std::vector<uint32_t> &order() const { return order_; }
+
+  // Whether test(item) holds for an item whose box overlaps box. Stops at
+  // the first such item.
+  template <typename Test>
+  bool anyOverlap(const Box3 &box, const Test &test) const {
+    if (order_.empty()) {
+      return false;
+    }
+    const size_t n = order_.size();
+    std::vector<std::pair<size_t, size_t>> stack;
+    stack.emplace_back(levels_.size() - 1, 0);
+    while (!stack.empty()) {
+      size_t level = stack.back().first;
+      size_t node = stack.back().second;
+      stack.pop_back();
+      if (!boxesOverlap(box, levels_[level][node])) {
+        continue;
+      }
+      if (level == 0) {
+        size_t end = std::min(n, (node + 1) * kBvhLeafSize);
+        for (size_t i = node * kBvhLeafSize; i < end; ++i) {
+          if (boxesOverlap(box, boxes_[order_[i]]) && test(order_[i])) {
+            return true;
+          }
+        }
+        continue;
+      }
+      for (size_t child = 2 * node; child < 2 * node + 2; ++child) {
+        if (child < levels_[level - 1].size()) {
+          stack.emplace_back(level - 1, child);
+        }
+      }
+    }
+    return false;
+  }
+
+private:
+  static double center(const Box3 &box, int dim) {
+    return 0.5 * (box.min[dim] + box.max[dim]);
+  }
+
+  // Report the items after position in Morton order that overlap its box.
+  template <typename Pair>
+  void query(size_t thread, size_t position,
+             std::vector<std::pair<size_t, size_t>> &stack,
+             const Pair &pair) const {
+    const size_t n = order_.size();
+    const uint32_t item = order_[position];
+    const Box3 &box = boxes_[item];
+    stack.clear();
+    stack.emplace_back(levels_.size() - 1, 0);
+    while (!stack.empty()) {
+      size_t level = stack.back().first;
+      size_t node = stack.back().second;
+      stack.pop_back();
+      // Items [first, last) below the node.
+      size_t span = kBvhLeafSize << level;
+      size_t last = std::min(n, (node + 1) * span);
+      if (last <= position + 1 || !boxesOverlap(box, levels_[level][node])) {
+        continue;
+      }
+      if (level == 0) {
+        for (size_t i = std::max(node * span, position + 1); i < last; ++i) {
+          if (boxesOverlap(box, boxes_[order_[i]])) {
+            pair(thread, item, order_[i]);
+          }
+        }
+        continue;
+      }
+      for (size_t child = 2 * node; child < 2 * node + 2; ++child) {
+        if (child < levels_[level - 1].size()) {
+          stack.emplace_back(level - 1, child);
+        }
+      }
+    }
+  }
+
+  const std::vector<Box3> &boxes_;
+  // Items in Morton order.
+  std::vector<uint32_t> order_;
+  // levels_[0] holds the leaf boxes, levels_.back() the root.
+  std::vector<std::vector<Box3>> levels_;
+};
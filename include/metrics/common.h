@@ -0,0 +1,208 @@
+#pragma once
+
+#include "array"
+#include "cstdio"
+#include "exception"
+#include "fstream"
+#include "iterator"
+#include "iostream"
+#include "sstream"
+#include "string"
+#include "sys/stat.h"
+#include "sys/types.h"
+#include "unistd.h"
+#include "vector"
+
+#include "CGAL/Exact_predicates_inexact_constructions_kernel.h"
+#include "CGAL/Polygon_mesh_processing/IO/polygon_mesh_io.h"
+#include "CGAL/Polygon_mesh_processing/orient_polygon_soup.h"
+#include "CGAL/Polygon_mesh_processing/polygon_soup_to_polygon_mesh.h"
+#include "CGAL/Polygon_mesh_processing/repair_polygon_soup.h"
+#include "CGAL/Surface_mesh.h"
+
+#include "metrics/mesh_loader.h"
+#include "metrics/paths.h"
+#include "metrics/workspace.h"
+
+typedef CGAL::Exact_predicates_inexact_constructions_kernel K;
+typedef CGAL::Surface_mesh<K::Point_3> Mesh;
+typedef boost::graph_traits<Mesh>::face_descriptor face_descriptor;
+namespace PMP = CGAL::Polygon_mesh_processing;
+
+// Build the halfedge mesh from the flat mesh the same way read_polygon_mesh()
+// does: repair and orient the soup, which also splits non-manifold vertices,
+// then convert it. Returns false when the soup still is no polygon mesh.
+// Only the SIR path needs it.
+inline bool buildSurfaceMesh(const MeshView &mesh, Mesh &cmesh) {
+  std::vector<K::Point_3> points;
+  points.reserve(mesh.numVertices);
+  for (size_t v = 0; v < mesh.numVertices; ++v) {
+    points.emplace_back(mesh.px(v), mesh.py(v), mesh.pz(v));
+  }
+  std::vector<std::array<size_t, 3>> polygons(mesh.numTriangles);
+  for (size_t t = 0; t < polygons.size(); ++t) {
+    for (size_t k = 0; k < 3; ++k) {
+      polygons[t][k] = mesh.corner(t, k);
+    }
+  }
+  PMP::repair_polygon_soup(points, polygons);
+  // False means the soup was not orientable or vertices were duplicated;
+  // read_polygon_mesh() goes on either way and so do we. Whether the result
+  // can be converted is checked next.
+  PMP::orient_polygon_soup(points, polygons);
+  cmesh.clear();
+  // A precondition of the conversion that is only asserted in debug builds.
+  if (!PMP::is_polygon_soup_a_polygon_mesh(polygons)) {
+    return false;
+  }
+  PMP::polygon_soup_to_polygon_mesh(points, polygons, cmesh);
+  return CGAL::is_triangle_mesh(cmesh);
+}
+
+namespace common_detail {
+
+inline bool loadFlatMesh(const std::string &inputFilename, FlatMesh &mesh,
+                         const WeldOptions &weld, Workspace *workspace) {
+  mesh.clear();
+  if (isPlyFile(inputFilename) || isStlFile(inputFilename)) {
+    if (!readFlatMesh(inputFilename, mesh, weld, workspace)) {
+      std::cerr << "Invalid data." << std::endl;
+      return false;
+    }
+    return true;
+  }
+  Mesh cmesh;
+  if (!PMP::IO::read_polygon_mesh(inputFilename, cmesh) ||
+      !CGAL::is_triangle_mesh(cmesh)) {
+    std::cerr << "Invalid data." << std::endl;
+    return false;
+  }
+  // A freshly read mesh has no removed elements, indices are contiguous.
+  mesh.reserve(cmesh.number_of_vertices(), cmesh.number_of_faces());
+  for (Mesh::Vertex_index v : cmesh.vertices()) {
+    const K::Point_3 &p = cmesh.point(v);
+    mesh.addVertex(p.x(), p.y(), p.z());
+  }
+  for (Mesh::Face_index f : cmesh.faces()) {
+    for (Mesh::Halfedge_index h :
+         halfedges_around_face(cmesh.halfedge(f), cmesh)) {
+      mesh.triangles.push_back(static_cast<uint32_t>(cmesh.target(h).idx()));
+    }
+  }
+  // CGAL already repaired and oriented the soup.
+  if (weld.tolerance > 0.0 && !cleanFlatMesh(mesh, weld, workspace)) {
+    std::cerr << "Invalid data." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+} // namespace common_detail
+
+// Load a triangle mesh into flat arrays. .ply and .stl go through the memory
+// mapped reader, other formats through CGAL. Either way the vertices are
+// welded with the given options, in the arrays of workspace when one is
+// given. A file that can not be loaded, including one too large for memory,
+// returns false.
+inline bool loadFlatMesh(const std::string &inputFilename, FlatMesh &mesh,
+                         const WeldOptions &weld = WeldOptions(),
+                         Workspace *workspace = nullptr) {
+  try {
+    return common_detail::loadFlatMesh(inputFilename, mesh, weld, workspace);
+  } catch (const std::exception &e) {
+    std::cerr << "Error: Could not read " << inputFilename << ": "
+              << e.what() << std::endl;
+    mesh.clear();
+    return false;
+  }
+}
+
+// Load a triangle mesh as a CGAL halfedge mesh. The flat mesh it is built
+// from is the one of workspace when one is given.
+inline bool loadMesh(const std::string &inputFilename, Mesh &cmesh,
+                     const WeldOptions &weld = WeldOptions(),
+                     Workspace *workspace = nullptr) {
+  Workspace local;
+  Workspace &ws = workspace != nullptr ? *workspace : local;
+  FlatMesh &mesh = ws.mesh;
+  if (!loadFlatMesh(inputFilename, mesh, weld, &ws)) {
+    return false;
+  }
+  if (!buildSurfaceMesh(mesh.view(), cmesh)) {
+    std::cerr << "Invalid data." << std::endl;
+    return false;
+  }
+  return true;
+}
+// <parent>_<metric>/<name>.txt for an input mesh <parent>/<name>.<ext>
+inline std::string metricOutputPath(const std::string &inputPath,
+                                    const std::string &suffix) {
+  return get_parent_path(inputPath) + suffix + "/" +
+         replace_extension(get_filename(inputPath), ".txt");
+}
+
+// <dir>_metric_cache.tsv for the mesh folder <dir>, or "" when disabled.
+inline std::string metricCachePath(std::string dirPath, bool enabled) {
+  if (!enabled) {
+    return "";
+  }
+  while (dirPath.size() > 1 && dirPath.back() == '/') {
+    dirPath.pop_back();
+  }
+  return dirPath + kMetricCacheSuffix;
+}
+
+// <dir>_journal.tsv for the mesh folder <dir>.
+inline std::string runJournalPath(std::string dirPath) {
+  while (dirPath.size() > 1 && dirPath.back() == '/') {
+    dirPath.pop_back();
+  }
+  return dirPath + kRunJournalSuffix;
+}
+
+inline bool writeMetricOutput(const std::string &inputPath,
+                              const std::string &suffix,
+                              const std::string &content,
+                              const std::string &label) {
+  std::string outputDir = get_parent_path(inputPath) + suffix;
+  std::string outputFilename = metricOutputPath(inputPath, suffix);
+
+  // Create output directory if it doesn't exist
+  create_directories(outputDir);
+
+  // Written next to the output and renamed over it, so a crash never
+  // leaves a partial output behind.
+  std::string tempFilename = outputFilename + ".tmp";
+  std::ofstream outFile(tempFilename);
+  if (outFile.is_open()) {
+    outFile << content;
+    outFile.close();
+    if (outFile.good() &&
+        std::rename(tempFilename.c_str(), outputFilename.c_str()) == 0) {
+      std::cout << label << " saved to: " << outputFilename << std::endl;
+      return true;
+    }
+    std::remove(tempFilename.c_str());
+  }
+  std::cerr << "Error: Could not open file " << outputFilename
+            << " for writing." << std::endl;
+  return false;
+}
+
+// Write a cached result to the output file unless the file already holds it.
+inline bool restoreMetricOutput(const std::string &inputPath,
+                                const std::string &suffix,
+                                const std::string &content,
+                                const std::string &label) {
+  std::string outputFilename = metricOutputPath(inputPath, suffix);
+  std::ifstream inFile(outputFilename);
+  if (inFile.is_open()) {
+    std::string existing((std::istreambuf_iterator<char>(inFile)),
+                         std::istreambuf_iterator<char>());
+    if (existing == content) {
+      std::cout << label << " cached in: " << outputFilename << std::endl;
+      return true;
+    }
+  }
+  return writeMetricOutput(inputPath, suffix, content, label);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "cmath"
+
+// Running sum with Neumaier's compensation.
+struct CompensatedSum {
+  double sum = 0.0;
+  double compensation = 0.0;
+
+  void add(double value) {
+    double t = sum + value;
+    if (std::abs(sum) >= std::abs(value)) {
+      compensation += (sum - t) + value;
+    } else {
+      compensation += (value - t) + sum;
+    }
+    sum = t;
+  }
+
+  double value() const { return sum + compensation; }
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "algorithm"
+#include "cmath"
+#include "cstdint"
+#include "functional"
+#include "stdexcept"
+#include "thread"
+#include "utility"
+#include "vector"
+
+#include "metrics/flat_mesh.h"
+#include "metrics/workspace.h"
+
+// Undirected edge (lower, higher) packed into one 64-bit key, lower vertex in
+// the high half, so sorted keys group all uses of an edge together.
+inline uint64_t packEdgeKey(uint32_t a, uint32_t b) {
+  uint32_t lower = std::min(a, b);
+  uint32_t higher = std::max(a, b);
+  return (static_cast<uint64_t>(lower) << 32) | higher;
+}
+
+inline uint32_t edgeKeyLower(uint64_t key) {
+  return static_cast<uint32_t>(key >> 32);
+}
+
+inline uint32_t edgeKeyHigher(uint64_t key) {
+  return static_cast<uint32_t>(key & 0xffffffffu);
+}
+
+// LSD radix sort of 64-bit keys in 8-bit digits. Digits that are equal in
+// every key (the high bits of small vertex indices) are skipped. With
+// numThreads > 1 every pass counts digits per thread chunk and scatters in
+// parallel; the result is the same sorted array. The digits below
+// firstDigit are not sorted on: keys equal above them keep their order.
+inline void radixSortKeys(std::vector<uint64_t> &keys,
+                          std::vector<uint64_t> &scratch,
+                          size_t numThreads = 1, size_t firstDigit = 0) {
+  const size_t n = keys.size();
+  if (n < 2) {
+    return;
+  }
+  scratch.resize(n);
+  numThreads = std::max<size_t>(1, std::min(numThreads, n / 65536 + 1));
+  const size_t chunk = (n + numThreads - 1) / numThreads;
+
+  // histograms[thread][pass][digit]
+  std::vector<size_t> histograms(numThreads * 8 * 256, 0);
+  auto histogramPass = [&](size_t thread) {
+    size_t *h = &histograms[thread * 8 * 256];
+    size_t begin = std::min(n, thread * chunk);
+    size_t end = std::min(n, begin + chunk);
+    for (size_t i = begin; i < end; ++i) {
+      uint64_t key = keys[i];
+      for (size_t pass = 0; pass < 8; ++pass) {
+        h[pass * 256 + ((key >> (8 * pass)) & 0xff)] += 1;
+      }
+    }
+  };
+  auto runThreads = [numThreads](const std::function<void(size_t)> &job) {
+    if (numThreads == 1) {
+      job(0);
+      return;
+    }
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < numThreads; ++t) {
+      workers.push_back(std::thread(job, t));
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  };
+  runThreads(histogramPass);
+
+  uint64_t *src = keys.data();
+  uint64_t *dst = scratch.data();
+  std::vector<size_t> offsets(numThreads * 256);
+  bool moved = false;
+  for (size_t pass = firstDigit; pass < 8; ++pass) {
+    // Skip the pass when one digit value holds every key.
+    bool trivial = false;
+    for (size_t digit = 0; digit < 256 && !trivial; ++digit) {
+      size_t total = 0;
+      for (size_t t = 0; t < numThreads; ++t) {
+        total += histograms[(t * 8 + pass) * 256 + digit];
+      }
+      trivial = total == n;
+    }
+    if (trivial) {
+      continue;
+    }
+
+    const size_t shift = 8 * pass;
+    if (numThreads > 1 && moved) {
+      // Keys changed chunks in the previous scatter, so the per-thread counts
+      // of this digit have to be taken again.
+      runThreads([&](size_t thread) {
+        size_t *h = &histograms[(thread * 8 + pass) * 256];
+        std::fill(h, h + 256, 0);
+        size_t begin = std::min(n, thread * chunk);
+        size_t end = std::min(n, begin + chunk);
+        for (size_t i = begin; i < end; ++i) {
+          h[(src[i] >> shift) & 0xff] += 1;
+        }
+      });
+    }
+
+    // Keys with a smaller digit come first; within a digit the threads keep
+    // their chunk order, which keeps the sort stable.
+    size_t running = 0;
+    for (size_t digit = 0; digit < 256; ++digit) {
+      for (size_t t = 0; t < numThreads; ++t) {
+        offsets[t * 256 + digit] = running;
+        running += histograms[(t * 8 + pass) * 256 + digit];
+      }
+    }
+    runThreads([&](size_t thread) {
+      size_t *offset = &offsets[thread * 256];
+      size_t begin = std::min(n, thread * chunk);
+      size_t end = std::min(n, begin + chunk);
+      for (size_t i = begin; i < end; ++i) {
+        uint64_t key = src[i];
+        dst[offset[(key >> shift) & 0xff]++] = key;
+      }
+    });
+    std::swap(src, dst);
+    moved = true;
+  }
+  if (src != keys.data()) {
+    std::copy(src, src + n, keys.data());
+  }
+}
+
+struct DanglingEdgeResult {
+  // Sum of the lengths of the edges used by exactly one triangle.
+  double length = 0.0;
+  // Half of the largest bounding box extent.
+  double scale = 0.0;
+  size_t numBoundaryEdges = 0;
+  // Filled only when requested.
+  std::vector<std::pair<uint32_t, uint32_t>> boundaryEdges;
+
+  // DangEL: the length relative to the mesh scale.
+  double normalizedLength() const { return length / scale; }
+};
+
+// Count how many triangles use every edge by sorting the packed edge keys and
+// measuring the runs of equal keys. Edges used once are dangling. The keys
+// are sorted in the arrays of workspace when one is given.
+inline DanglingEdgeResult computeDanglingEdges(const MeshView &mesh,
+                                               bool listEdges,
+                                               size_t numThreads = 1,
+                                               Workspace *workspace = nullptr) {
+  if (mesh.numVertices == 0) {
+    throw std::runtime_error("normalized scale less than 0.");
+  }
+
+  Workspace local;
+  Workspace &ws = workspace != nullptr ? *workspace : local;
+  std::vector<uint64_t> &keys = ws.keys;
+  keys.resize(3 * mesh.numTriangles);
+  for (size_t t = 0; t < mesh.numTriangles; ++t) {
+    uint32_t a = mesh.corner(t, 0);
+    uint32_t b = mesh.corner(t, 1);
+    uint32_t c = mesh.corner(t, 2);
+    keys[3 * t] = packEdgeKey(a, b);
+    keys[3 * t + 1] = packEdgeKey(b, c);
+    keys[3 * t + 2] = packEdgeKey(c, a);
+  }
+  radixSortKeys(keys, ws.sortScratch, numThreads);
+
+  // Get the scale in case of the scale is not aligned
+  DanglingEdgeResult result;
+  result.scale = computeBoundingBox(mesh).halfExtent();
+
+  for (size_t i = 0; i < keys.size();) {
+    size_t run = i + 1;
+    while (run < keys.size() && keys[run] == keys[i]) {
+      ++run;
+    }
+    if (run - i == 1) {
+      uint32_t a = edgeKeyLower(keys[i]);
+      uint32_t b = edgeKeyHigher(keys[i]);
+      double dx = mesh.px(a) - mesh.px(b);
+      double dy = mesh.py(a) - mesh.py(b);
+      double dz = mesh.pz(a) - mesh.pz(b);
+      result.length += std::sqrt(dx * dx + dy * dy + dz * dz);
+      result.numBoundaryEdges += 1;
+      if (listEdges) {
+        result.boundaryEdges.emplace_back(a, b);
+      }
+    }
+    i = run;
+  }
+  return result;
+}
@@ -0,0 +1,487 @@
+#pragma once
+
+#include "cerrno"
+#include "cmath"
+#include "chrono"
+#include "condition_variable"
+#include "csignal"
+#include "cstdio"
+#include "cstdlib"
+#include "cstring"
+#include "deque"
+#include "exception"
+#include "functional"
+#include "iostream"
+#include "memory"
+#include "mutex"
+#include "sstream"
+#include "string"
+#include "sys/socket.h"
+#include "sys/stat.h"
+#include "sys/un.h"
+#include "thread"
+#include "unistd.h"
+#include "vector"
+
+#include "metrics/common.h"
+#include "metrics/json.h"
+#include "metrics/results_file.h"
+#include "metrics/thread_budget.h"
+
+// Evaluation daemon (cad_metrics --serve <socket>).
+//
+// Listens on a Unix domain socket and evaluates the meshes sent by its
+// clients on a pool of worker threads started once, so that a training loop
+// pays neither process startup nor thread creation per batch. Requests are
+// text lines, optionally followed by a binary payload:
+//
+//   MESH <id> <path>                  mesh file on the local filesystem
+//   DATA <id> <ply|stl> <bytes>       content of a .ply or .stl file
+//   ARRAYS <id> <vertices> <faces>    float64 x y z per vertex, then uint32
+//                                     corners per triangle, little endian
+//
+// A client may send any number of requests without waiting. Every request
+// is answered by one JSON line holding its id, so answers may arrive out of
+// order when several workers run requests of the same client:
+//
+//   {"id": "a", "faces": 1200, "seconds": 0.0123, "segment_num": 1, ...,
+//    "status": {"segment_num": "ok", ...}}
+//   {"id": "b", "error": "..."}
+//
+// The daemon stops reading from a client that has kMaxQueuedRequests
+// requests or kMaxRequestBytes of payload waiting for a worker, until the
+// workers catch up, so a client can not queue more than about twice
+// kMaxRequestBytes. Larger meshes are sent as MESH paths. The socket is only
+// accessible to the user running the daemon.
+
+// Largest payload of one DATA or ARRAYS request.
+static const size_t kMaxRequestBytes = size_t(1) << 30;
+// Requests of one client waiting for a worker.
+static const size_t kMaxQueuedRequests = 16;
+
+// One client. Answers of the workers are written under a lock, the socket
+// is closed when the last request of the client is answered.
+class EvalConnection {
+public:
+  explicit EvalConnection(int fd) : fd_(fd) {}
+  ~EvalConnection() { close(fd_); }
+
+  EvalConnection(const EvalConnection &) = delete;
+  EvalConnection &operator=(const EvalConnection &) = delete;
+
+  int fd() const { return fd_; }
+
+  // Requests of the client waiting for a worker, and their payload bytes.
+  // Guarded by the server's queue lock.
+  size_t queued = 0;
+  size_t queuedBytes = 0;
+
+  void send(const std::string &line) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t sent = 0;
+    while (sent < line.size()) {
+      ssize_t n = ::send(fd_, line.data() + sent, line.size() - sent,
+                         MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        // The client went away, drop the answer.
+        return;
+      }
+      sent += static_cast<size_t>(n);
+    }
+  }
+
+private:
+  int fd_;
+  std::mutex mutex_;
+};
+
+struct EvalRequest {
+  enum Kind { kPath, kData, kArrays };
+
+  std::shared_ptr<EvalConnection> connection;
+  std::string id;
+  Kind kind = kPath;
+  std::string path;
+  // DATA: "ply" or "stl".
+  std::string format;
+  std::string payload;
+  size_t vertices = 0;
+  size_t faces = 0;
+
+  // Name of the mesh in logs and the profile.
+  std::string name() const {
+    return kind == kPath ? path : id + (kind == kData ? "." + format : "");
+  }
+
+  // Load or decode the mesh of the request, in the arrays of workspace.
+  bool load(FlatMesh &mesh, const WeldOptions &weld,
+            Workspace *workspace = nullptr) const {
+    if (kind == kPath) {
+      return loadFlatMesh(path, mesh, weld, workspace);
+    }
+    if (kind == kData) {
+      return readFlatMeshData(payload.data(), payload.size(), name(), mesh,
+                              weld, workspace);
+    }
+    mesh.clear();
+    mesh.reserve(vertices, faces);
+    const char *p = payload.data();
+    for (size_t v = 0; v < vertices; ++v, p += 3 * sizeof(double)) {
+      double xyz[3];
+      std::memcpy(xyz, p, sizeof(xyz));
+      mesh.addVertex(xyz[0], xyz[1], xyz[2]);
+    }
+    mesh.triangles.resize(3 * faces);
+    std::memcpy(mesh.triangles.data(), p, 3 * faces * sizeof(uint32_t));
+    for (uint32_t corner : mesh.triangles) {
+      if (corner >= vertices) {
+        std::cerr << "Error: Corner index out of range in " << id
+                  << std::endl;
+        return false;
+      }
+    }
+    if (!cleanFlatMesh(mesh, weld, workspace)) {
+      std::cerr << "Error: Not a polygon mesh: " << id << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+// Buffered reads of request lines and payloads from a client socket.
+class RequestReader {
+public:
+  explicit RequestReader(int fd) : fd_(fd) {}
+
+  bool readLine(std::string &line) {
+    size_t end;
+    while ((end = buffer_.find('\n', start_)) == std::string::npos) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    line = buffer_.substr(start_, end - start_);
+    start_ = end + 1;
+    return true;
+  }
+
+  bool readBytes(size_t size, std::string &bytes) {
+    while (buffer_.size() - start_ < size) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    bytes = buffer_.substr(start_, size);
+    start_ += size;
+    return true;
+  }
+
+private:
+  bool fill() {
+    buffer_.erase(0, start_);
+    start_ = 0;
+    char chunk[65536];
+    while (true) {
+      ssize_t n = recv(fd_, chunk, sizeof(chunk), 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      buffer_.append(chunk, static_cast<size_t>(n));
+      return true;
+    }
+  }
+
+  int fd_;
+  std::string buffer_;
+  size_t start_ = 0;
+};
+
+// Socket path removed again when the daemon is stopped by a signal.
+inline char *evalServerSocketPath() {
+  static char path[sizeof(sockaddr_un::sun_path)];
+  return path;
+}
+
+inline void stopEvalServer(int) {
+  unlink(evalServerSocketPath());
+  _exit(EXIT_SUCCESS);
+}
+
+class EvalServer {
+public:
+  // Evaluates a request on worker and fills record with the faces and the
+  // value and status of the evaluated metrics.
+  typedef std::function<void(const EvalRequest &request, EvalServer &server,
+                             size_t worker, MetricRecord &record)>
+      Handler;
+
+  EvalServer(const std::string &socketPath, size_t numWorkers,
+             ThreadBudget &budget, Handler handler)
+      : socketPath_(socketPath), numWorkers_(numWorkers), budget_(budget),
+        handler_(handler) {}
+
+  EvalServer(const EvalServer &) = delete;
+  EvalServer &operator=(const EvalServer &) = delete;
+
+  // Requests queued and not picked up by a worker yet; plays the part of
+  // FileScheduler::remaining() for the thread budget.
+  size_t remaining() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+  }
+
+  // Listen on the socket and serve until the process is stopped. Returns
+  // false when the socket can not be set up.
+  bool run() {
+    int listener = listen();
+    if (listener < 0) {
+      return false;
+    }
+    std::signal(SIGINT, stopEvalServer);
+    std::signal(SIGTERM, stopEvalServer);
+    for (size_t worker = 0; worker < numWorkers_; ++worker) {
+      std::thread(&EvalServer::work, this, worker).detach();
+    }
+    std::cout << "Serving on " << socketPath_ << " with " << numWorkers_
+              << " workers" << std::endl;
+    while (true) {
+      int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno != EINTR && errno != ECONNABORTED) {
+          std::cerr << "Error: accept failed: " << std::strerror(errno)
+                    << std::endl;
+        }
+        continue;
+      }
+      std::thread(&EvalServer::readRequests, this,
+                  std::make_shared<EvalConnection>(fd))
+          .detach();
+    }
+  }
+
+private:
+  int listen() {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath_.size() >= sizeof(address.sun_path)) {
+      std::cerr << "Error: Socket path too long: " << socketPath_
+                << std::endl;
+      return -1;
+    }
+    std::strcpy(address.sun_path, socketPath_.c_str());
+    std::strcpy(evalServerSocketPath(), socketPath_.c_str());
+
+    // A socket left behind by a daemon that was killed is replaced, any
+    // other file is not.
+    struct stat st;
+    if (lstat(socketPath_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(socketPath_.c_str());
+    }
+    // The socket file gets mode 0600. No other thread runs yet, so the umask
+    // can be changed for the bind.
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t umasked = umask(0177);
+    int bound = fd < 0 ? -1
+                       : bind(fd, reinterpret_cast<sockaddr *>(&address),
+                              sizeof(address));
+    umask(umasked);
+    if (bound != 0 || ::listen(fd, SOMAXCONN) != 0) {
+      std::cerr << "Error: Could not listen on " << socketPath_ << ": "
+                << std::strerror(errno) << std::endl;
+      if (fd >= 0) {
+        close(fd);
+      }
+      return -1;
+    }
+    return fd;
+  }
+
+  // Parse the requests of one client and queue them for the workers.
+  void readRequests(std::shared_ptr<EvalConnection> connection) {
+    RequestReader reader(connection->fd());
+    std::string line;
+    while (true) {
+      waitForRoom(*connection);
+      if (!reader.readLine(line)) {
+        return;
+      }
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (line.empty()) {
+        continue;
+      }
+      EvalRequest request;
+      request.connection = connection;
+      std::string error;
+      bool lost = false;
+      if (!parseRequest(line, reader, request, error, lost)) {
+        connection->send(errorLine(request.id, error));
+        if (lost) {
+          // Where the next request starts is unknown, give up the client.
+          return;
+        }
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      connection->queued += 1;
+      connection->queuedBytes += request.payload.size();
+      queue_.push_back(std::move(request));
+      ready_.notify_one();
+    }
+  }
+
+  // Block until the client is below its share of the queue. Its requests
+  // stay unread in the socket meanwhile.
+  void waitForRoom(const EvalConnection &connection) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    drained_.wait(lock, [&]() {
+      return connection.queued < kMaxQueuedRequests &&
+             connection.queuedBytes < kMaxRequestBytes;
+    });
+  }
+
+  // Returns false with error on a malformed request, and sets lost when the
+  // payload it may carry can not be skipped.
+  static bool parseRequest(const std::string &line, RequestReader &reader,
+                           EvalRequest &request, std::string &error,
+                           bool &lost) {
+    std::istringstream fields(line);
+    std::string command;
+    fields >> command >> request.id;
+    const std::string &id = request.id;
+    if (command == "MESH") {
+      std::getline(fields >> std::ws, request.path);
+      if (id.empty() || request.path.empty()) {
+        error = "expected MESH <id> <path>";
+        return false;
+      }
+      request.kind = EvalRequest::kPath;
+      return true;
+    }
+    if (command == "DATA") {
+      size_t bytes = 0;
+      if (!(fields >> request.format >> bytes) || id.empty() ||
+          (request.format != "ply" && request.format != "stl") ||
+          bytes > kMaxRequestBytes) {
+        error = "expected DATA <id> <ply|stl> <bytes>";
+        lost = true;
+        return false;
+      }
+      request.kind = EvalRequest::kData;
+      if (!reader.readBytes(bytes, request.payload)) {
+        error = "truncated payload";
+        lost = true;
+        return false;
+      }
+      return true;
+    }
+    if (command == "ARRAYS") {
+      if (!(fields >> request.vertices >> request.faces) || id.empty() ||
+          request.vertices > kMaxRequestBytes / 24 ||
+          request.faces > kMaxRequestBytes / 12) {
+        error = "expected ARRAYS <id> <vertices> <faces>";
+        lost = true;
+        return false;
+      }
+      request.kind = EvalRequest::kArrays;
+      size_t bytes = request.vertices * 3 * sizeof(double) +
+                     request.faces * 3 * sizeof(uint32_t);
+      if (!reader.readBytes(bytes, request.payload)) {
+        error = "truncated payload";
+        lost = true;
+        return false;
+      }
+      return true;
+    }
+    error = "unknown request " + command;
+    lost = true;
+    return false;
+  }
+
+  // Worker of the pool. An idle worker gives its core back to the budget,
+  // so a lone request gets the whole machine for its kernels.
+  void work(size_t worker) {
+    bool retired = false;
+    while (true) {
+      EvalRequest request;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (queue_.empty() && !retired) {
+          lock.unlock();
+          retired = budget_.retire();
+          lock.lock();
+        }
+        ready_.wait(lock, [this]() { return !queue_.empty(); });
+        request = std::move(queue_.front());
+        queue_.pop_front();
+        request.connection->queued -= 1;
+        request.connection->queuedBytes -= request.payload.size();
+        drained_.notify_all();
+      }
+      if (retired) {
+        budget_.rejoin();
+        retired = false;
+      }
+      MetricRecord record;
+      auto start = std::chrono::steady_clock::now();
+      try {
+        handler_(request, *this, worker, record);
+      } catch (const std::exception &err) {
+        // The handler fails metrics itself; this keeps an exception it let
+        // through from ending the daemon.
+        std::cerr << "Error: " << err.what() << std::endl;
+        request.connection->send(errorLine(request.id, err.what()));
+        continue;
+      }
+      double seconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+      request.connection->send(resultLine(request.id, record, seconds));
+    }
+  }
+
+  static std::string errorLine(const std::string &id,
+                               const std::string &error) {
+    return "{\"id\": " + jsonString(id) + ", \"error\": " +
+           jsonString(error) + "}\n";
+  }
+
+  static std::string resultLine(const std::string &id,
+                                const MetricRecord &record, double seconds) {
+    // Microseconds are plenty for the request time.
+    std::string line = "{\"id\": " + jsonString(id) +
+                       ", \"faces\": " + std::to_string(record.faces) +
+                       ", \"seconds\": " +
+                       jsonNumber(std::round(seconds * 1e6) / 1e6);
+    std::string status;
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      if (record.status[c] == kStatusNotRun) {
+        continue;
+      }
+      line += ", \"" + std::string(kMetricColumnNames[c]) +
+              "\": " + jsonNumber(record.value[c]);
+      status += std::string(status.empty() ? "" : ", ") + "\"" +
+                kMetricColumnNames[c] + "\": \"" +
+                metricStatusName(record.status[c]) + "\"";
+    }
+    return line + ", \"status\": {" + status + "}}\n";
+  }
+
+  std::string socketPath_;
+  size_t numWorkers_;
+  ThreadBudget &budget_;
+  Handler handler_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  // Signalled when a worker takes a request off the queue.
+  std::condition_variable drained_;
+  std::deque<EvalRequest> queue_;
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "algorithm"
+#include "cstdint"
+#include "cstdlib"
+#include "vector"
+
+// Read-only indexed triangle mesh over caller owned arrays. The coordinates
+// of vertex v are x[v * stride], y[v * stride] and z[v * stride], so both the
+// structure-of-arrays FlatMesh (stride 1) and interleaved xyz buffers
+// (stride 3) can be viewed without copying.
+struct MeshView {
+  const double *x = nullptr;
+  const double *y = nullptr;
+  const double *z = nullptr;
+  size_t stride = 1;
+  const uint32_t *triangles = nullptr;  // a0 b0 c0 a1 b1 c1 ...
+  size_t numVertices = 0;
+  size_t numTriangles = 0;
+
+  double px(size_t v) const { return x[v * stride]; }
+  double py(size_t v) const { return y[v * stride]; }
+  double pz(size_t v) const { return z[v * stride]; }
+  uint32_t corner(size_t t, size_t k) const { return triangles[3 * t + k]; }
+};
+
+// Axis aligned bounding box of the vertices of a mesh.
+struct BoundingBox {
+  double min[3] = {0.0, 0.0, 0.0};
+  double max[3] = {0.0, 0.0, 0.0};
+
+  // Half of the largest extent, the scale DangEL divides by.
+  double halfExtent() const {
+    double extent = 0.0;
+    for (int dim = 0; dim < 3; ++dim) {
+      extent = std::max(extent, max[dim] - min[dim]);
+    }
+    return extent / 2.0;
+  }
+};
+
+inline BoundingBox computeBoundingBox(const MeshView &mesh) {
+  BoundingBox box;
+  if (mesh.numVertices == 0) {
+    return box;
+  }
+  box.min[0] = box.max[0] = mesh.px(0);
+  box.min[1] = box.max[1] = mesh.py(0);
+  box.min[2] = box.max[2] = mesh.pz(0);
+  for (size_t v = 1; v < mesh.numVertices; ++v) {
+    double point[3] = {mesh.px(v), mesh.py(v), mesh.pz(v)};
+    for (int dim = 0; dim < 3; ++dim) {
+      box.min[dim] = std::min(box.min[dim], point[dim]);
+      box.max[dim] = std::max(box.max[dim], point[dim]);
+    }
+  }
+  return box;
+}
+
+// Compact mesh for the metrics that need no geometric predicates (SegE,
+// DangEL, FluxEE): contiguous coordinate arrays and triangle indices, no
+// halfedge connectivity.
+struct FlatMesh {
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> z;
+  std::vector<uint32_t> triangles;  // a0 b0 c0 a1 b1 c1 ...
+
+  size_t numVertices() const { return x.size(); }
+  size_t numTriangles() const { return triangles.size() / 3; }
+
+  void addVertex(double px, double py, double pz) {
+    x.push_back(px);
+    y.push_back(py);
+    z.push_back(pz);
+  }
+
+  void resizeVertices(size_t count) {
+    x.resize(count);
+    y.resize(count);
+    z.resize(count);
+  }
+
+  void reserve(size_t numVertices, size_t numTriangles) {
+    x.reserve(numVertices);
+    y.reserve(numVertices);
+    z.reserve(numVertices);
+    triangles.reserve(3 * numTriangles);
+  }
+
+  // Keeps the capacity, so a worker can reuse the mesh for the next file.
+  void clear() {
+    x.clear();
+    y.clear();
+    z.clear();
+    triangles.clear();
+  }
+
+  MeshView view() const {
+    MeshView v;
+    v.x = x.data();
+    v.y = y.data();
+    v.z = z.data();
+    v.stride = 1;
+    v.triangles = triangles.data();
+    v.numVertices = numVertices();
+    v.numTriangles = numTriangles();
+    return v;
+  }
+};
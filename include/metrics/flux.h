@@ -0,0 +1,208 @@
+#pragma once
+
+#include "algorithm"
+#include "cmath"
+#include "cstdint"
+#include "thread"
+#include "vector"
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include "immintrin.h"
+#endif
+
+#include "metrics/compensated_sum.h"
+#include "metrics/flat_mesh.h"
+
+// Flux of the constant field (1, 1, 1) through a triangle soup.
+//
+// For a triangle (a, b, c) with n = (b - a) x (c - a) the flux is
+// area * dot(n / |n|, (1, 1, 1)) = 0.5 * (n.x + n.y + n.z), so no square root
+// or normalization is needed, and degenerate triangles contribute 0.
+//
+// The triangles are summed in fixed blocks with compensated (Neumaier)
+// summation, and the block sums are combined in block order. The blocks do
+// not depend on the number of threads, so neither does the result.
+
+static const size_t kFluxBlockTriangles = 4096;
+// Below this size the thread start-up costs more than the sum.
+static const size_t kParallelFluxMinTriangles = 1 << 20;
+
+// Twice the flux of triangle t.
+inline double doubleTriangleFlux(const MeshView &mesh, size_t t) {
+  uint32_t a = mesh.corner(t, 0);
+  uint32_t b = mesh.corner(t, 1);
+  uint32_t c = mesh.corner(t, 2);
+  double e1x = mesh.px(b) - mesh.px(a);
+  double e1y = mesh.py(b) - mesh.py(a);
+  double e1z = mesh.pz(b) - mesh.pz(a);
+  double e2x = mesh.px(c) - mesh.px(a);
+  double e2y = mesh.py(c) - mesh.py(a);
+  double e2z = mesh.pz(c) - mesh.pz(a);
+  return (e1y * e2z - e1z * e2y) + (e1z * e2x - e1x * e2z) +
+         (e1x * e2y - e1y * e2x);
+}
+
+inline double fluxBlockScalar(const MeshView &mesh, size_t begin, size_t end) {
+  CompensatedSum sum;
+  for (size_t t = begin; t < end; ++t) {
+    sum.add(doubleTriangleFlux(mesh, t));
+  }
+  return 0.5 * sum.value();
+}
+
+#if defined(__AVX512F__)
+
+inline double fluxBlockSimd(const MeshView &mesh, size_t begin, size_t end) {
+  const long long stride = static_cast<long long>(mesh.stride);
+  __m512d sum = _mm512_setzero_pd();
+  __m512d compensation = _mm512_setzero_pd();
+  size_t t = begin;
+  for (; t + 8 <= end; t += 8) {
+    const uint32_t *tri = mesh.triangles + 3 * t;
+    __m512i corner[3];
+    for (int k = 0; k < 3; ++k) {
+      corner[k] = _mm512_set_epi64(
+          tri[21 + k] * stride, tri[18 + k] * stride, tri[15 + k] * stride,
+          tri[12 + k] * stride, tri[9 + k] * stride, tri[6 + k] * stride,
+          tri[3 + k] * stride, tri[k] * stride);
+    }
+    __m512d px[3], py[3], pz[3];
+    for (int k = 0; k < 3; ++k) {
+      px[k] = _mm512_i64gather_pd(corner[k], mesh.x, 8);
+      py[k] = _mm512_i64gather_pd(corner[k], mesh.y, 8);
+      pz[k] = _mm512_i64gather_pd(corner[k], mesh.z, 8);
+    }
+    __m512d e1x = _mm512_sub_pd(px[1], px[0]);
+    __m512d e1y = _mm512_sub_pd(py[1], py[0]);
+    __m512d e1z = _mm512_sub_pd(pz[1], pz[0]);
+    __m512d e2x = _mm512_sub_pd(px[2], px[0]);
+    __m512d e2y = _mm512_sub_pd(py[2], py[0]);
+    __m512d e2z = _mm512_sub_pd(pz[2], pz[0]);
+    __m512d nx =
+        _mm512_sub_pd(_mm512_mul_pd(e1y, e2z), _mm512_mul_pd(e1z, e2y));
+    __m512d ny =
+        _mm512_sub_pd(_mm512_mul_pd(e1z, e2x), _mm512_mul_pd(e1x, e2z));
+    __m512d nz =
+        _mm512_sub_pd(_mm512_mul_pd(e1x, e2y), _mm512_mul_pd(e1y, e2x));
+    __m512d value = _mm512_add_pd(_mm512_add_pd(nx, ny), nz);
+    // Per lane Kahan step.
+    __m512d y = _mm512_sub_pd(value, compensation);
+    __m512d s = _mm512_add_pd(sum, y);
+    compensation = _mm512_sub_pd(_mm512_sub_pd(s, sum), y);
+    sum = s;
+  }
+  alignas(64) double lanes[8];
+  alignas(64) double lanesCompensation[8];
+  _mm512_store_pd(lanes, sum);
+  _mm512_store_pd(lanesCompensation, compensation);
+  CompensatedSum total;
+  for (int lane = 0; lane < 8; ++lane) {
+    total.add(lanes[lane]);
+    total.add(-lanesCompensation[lane]);
+  }
+  for (; t < end; ++t) {
+    total.add(doubleTriangleFlux(mesh, t));
+  }
+  return 0.5 * total.value();
+}
+
+#elif defined(__AVX2__)
+
+inline double fluxBlockSimd(const MeshView &mesh, size_t begin, size_t end) {
+  const long long stride = static_cast<long long>(mesh.stride);
+  __m256d sum = _mm256_setzero_pd();
+  __m256d compensation = _mm256_setzero_pd();
+  size_t t = begin;
+  for (; t + 4 <= end; t += 4) {
+    const uint32_t *tri = mesh.triangles + 3 * t;
+    __m256i corner[3];
+    for (int k = 0; k < 3; ++k) {
+      corner[k] = _mm256_set_epi64x(tri[9 + k] * stride, tri[6 + k] * stride,
+                                    tri[3 + k] * stride, tri[k] * stride);
+    }
+    __m256d px[3], py[3], pz[3];
+    for (int k = 0; k < 3; ++k) {
+      px[k] = _mm256_i64gather_pd(mesh.x, corner[k], 8);
+      py[k] = _mm256_i64gather_pd(mesh.y, corner[k], 8);
+      pz[k] = _mm256_i64gather_pd(mesh.z, corner[k], 8);
+    }
+    __m256d e1x = _mm256_sub_pd(px[1], px[0]);
+    __m256d e1y = _mm256_sub_pd(py[1], py[0]);
+    __m256d e1z = _mm256_sub_pd(pz[1], pz[0]);
+    __m256d e2x = _mm256_sub_pd(px[2], px[0]);
+    __m256d e2y = _mm256_sub_pd(py[2], py[0]);
+    __m256d e2z = _mm256_sub_pd(pz[2], pz[0]);
+    __m256d nx =
+        _mm256_sub_pd(_mm256_mul_pd(e1y, e2z), _mm256_mul_pd(e1z, e2y));
+    __m256d ny =
+        _mm256_sub_pd(_mm256_mul_pd(e1z, e2x), _mm256_mul_pd(e1x, e2z));
+    __m256d nz =
+        _mm256_sub_pd(_mm256_mul_pd(e1x, e2y), _mm256_mul_pd(e1y, e2x));
+    __m256d value = _mm256_add_pd(_mm256_add_pd(nx, ny), nz);
+    // Per lane Kahan step.
+    __m256d y = _mm256_sub_pd(value, compensation);
+    __m256d s = _mm256_add_pd(sum, y);
+    compensation = _mm256_sub_pd(_mm256_sub_pd(s, sum), y);
+    sum = s;
+  }
+  alignas(32) double lanes[4];
+  alignas(32) double lanesCompensation[4];
+  _mm256_store_pd(lanes, sum);
+  _mm256_store_pd(lanesCompensation, compensation);
+  CompensatedSum total;
+  for (int lane = 0; lane < 4; ++lane) {
+    total.add(lanes[lane]);
+    total.add(-lanesCompensation[lane]);
+  }
+  for (; t < end; ++t) {
+    total.add(doubleTriangleFlux(mesh, t));
+  }
+  return 0.5 * total.value();
+}
+
+#endif
+
+inline double fluxBlock(const MeshView &mesh, size_t begin, size_t end) {
+#if defined(__AVX2__) || defined(__AVX512F__)
+  return fluxBlockSimd(mesh, begin, end);
+#else
+  return fluxBlockScalar(mesh, begin, end);
+#endif
+}
+
+// Signed flux of (1, 1, 1) through the mesh.
+inline double computeFlux(const MeshView &mesh, size_t numThreads = 1) {
+  const size_t numTriangles = mesh.numTriangles;
+  const size_t numBlocks =
+      (numTriangles + kFluxBlockTriangles - 1) / kFluxBlockTriangles;
+  std::vector<double> blockFlux(numBlocks, 0.0);
+  auto sumBlocks = [&](size_t first, size_t last) {
+    for (size_t block = first; block < last; ++block) {
+      size_t begin = block * kFluxBlockTriangles;
+      size_t end = std::min(numTriangles, begin + kFluxBlockTriangles);
+      blockFlux[block] = fluxBlock(mesh, begin, end);
+    }
+  };
+
+  if (numThreads > 1 && numTriangles >= kParallelFluxMinTriangles) {
+    numThreads = std::min(numThreads, numBlocks);
+    size_t blocksPerThread = (numBlocks + numThreads - 1) / numThreads;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < numThreads; ++i) {
+      size_t first = std::min(numBlocks, i * blocksPerThread);
+      size_t last = std::min(numBlocks, first + blocksPerThread);
+      workers.push_back(std::thread(sumBlocks, first, last));
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  } else {
+    sumBlocks(0, numBlocks);
+  }
+
+  CompensatedSum flux;
+  for (double value : blockFlux) {
+    flux.add(value);
+  }
+  return flux.value();
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "cmath"
+#include "cstdio"
+#include "cstdlib"
+#include "string"
+
+// JSON values of the files and answers the tools write (results.json, the
+// --profile log and the --serve answers).
+
+// text as a quoted string, with quotes, backslashes and control characters
+// escaped.
+inline std::string jsonString(const std::string &text) {
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      quoted += escaped;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+// JSON has no NaN, an undefined value is written as null. Numbers use the
+// shortest of 15 or 17 digits that reads back exactly.
+inline std::string jsonNumber(double value) {
+  if (!std::isfinite(value)) {
+    return "null";
+  }
+  char text[32];
+  std::snprintf(text, sizeof(text), "%.15g", value);
+  if (std::strtod(text, nullptr) != value) {
+    std::snprintf(text, sizeof(text), "%.17g", value);
+  }
+  return text;
+}
@@ -0,0 +1,573 @@
+#pragma once
+
+#include "array"
+#include "atomic"
+#include "cmath"
+#include "cstdio"
+#include "memory"
+#include "random"
+#include "sstream"
+#include "stdexcept"
+
+#include "CGAL/Polygon_mesh_processing/self_intersections.h"
+#include "CGAL/Real_timer.h"
+#include "CGAL/intersections.h"
+#include "CGAL/tags.h"
+
+#include "boost/iterator/function_output_iterator.hpp"
+
+#include "metrics/box_bvh.h"
+#include "metrics/common.h"
+#include "metrics/edge_count.h"
+#include "metrics/flat_mesh.h"
+#include "metrics/flux.h"
+#include "metrics/scheduler.h"
+#include "metrics/streaming.h"
+#include "metrics/thread_budget.h"
+#include "metrics/union_find.h"
+#include "metrics/workspace.h"
+
+// Written by Jingwei Xu for https://arxiv.org/abs/2411.04954
+//
+// The metric kernels shared by the per-metric tools and cad_metrics. Each
+// kernel works on an already loaded mesh and throws std::runtime_error when
+// the metric can not be computed. SegE, DangEL and FluxEE run on the flat
+// indexed mesh, only SIR needs the CGAL halfedge mesh.
+
+// Result cache ids of the metric outputs. Bump the version when a kernel
+// changes its output so that cached values get recomputed.
+static const char *const kSegmentNumMetricId = "segment_num/2";
+static const char *const kDanglingEdgeMetricId = "dangling_edge/2";
+static const char *const kFluxEnclosureMetricId = "flux_enclosure_error/2";
+static const char *const kSelfIntersectionMetricId = "self_intersection/1";
+
+// SegE: number of connected vertex sets. Large meshes use the concurrent
+// union-find when numThreads > 1. The flat kernels take the arrays of an
+// optional per-worker workspace (see workspace.h).
+inline int computeSegmentNumber(const MeshView &mesh, size_t numThreads = 1,
+                                Workspace *workspace = nullptr) {
+  return static_cast<int>(
+      computeComponents(mesh, false, numThreads, workspace).count);
+}
+
+// SegE with the face and vertex count of every component, largest first.
+inline ComponentStats computeSegmentStats(const MeshView &mesh,
+                                          size_t numThreads = 1,
+                                          Workspace *workspace = nullptr) {
+  return computeComponents(mesh, true, numThreads, workspace);
+}
+
+// Text layout of the segment statistics: the component count, then one
+// "faces vertices" line per component.
+inline std::string formatSegmentStats(const ComponentStats &stats) {
+  std::ostringstream content;
+  content << stats.count;
+  for (size_t i = 0; i < stats.faces.size(); ++i) {
+    content << '\n' << stats.faces[i] << ' ' << stats.vertices[i];
+  }
+  return content.str();
+}
+
+// DangEL: total length of the edges bounded by only one face, divided by the
+// half extent of the bounding box.
+inline double computeDanglingEdgeLength(const MeshView &mesh,
+                                        size_t numThreads = 1,
+                                        Workspace *workspace = nullptr) {
+  return computeDanglingEdges(mesh, false, numThreads, workspace)
+      .normalizedLength();
+}
+
+// Text layout of the dangling edge list: one "a b" vertex index pair per
+// line.
+inline std::string formatBoundaryEdges(const DanglingEdgeResult &result) {
+  std::ostringstream content;
+  for (const auto &edge : result.boundaryEdges) {
+    content << edge.first << ' ' << edge.second << '\n';
+  }
+  return content.str();
+}
+
+// FluxEE: flux of the constant field (1, 1, 1) through the surface. Closed
+// surfaces enclose no source, so any non-zero flux is an error.
+inline double computeFluxEnclosureError(const MeshView &mesh,
+                                        size_t numThreads = 1) {
+  return std::abs(computeFlux(mesh, numThreads));
+}
+
+struct SelfIntersectionResult {
+  size_t self_intersect_faces_num = 0;
+  size_t faces_num = 0;
+  size_t intersecting_pairs_num = 0;
+  // Faces tested by a sampled estimate, 0 for an exact count. The estimate
+  // is self_intersect_faces_num, rounded, with the 95% confidence interval
+  // [ratio_low, ratio_high] of the ratio.
+  size_t sampled_faces_num = 0;
+  double ratio_low = 0.0;
+  double ratio_high = 0.0;
+};
+
+// SIR: number of faces intersecting at least one other face. ConcurrencyTag
+// selects CGAL's sequential or TBB parallel code path.
+//
+// A single self_intersections() pass does the box broad phase and the
+// triangle tests. The intersecting pairs are not stored: each one only marks
+// its two faces in a bitset indexed by face index. CGAL calls the output
+// iterator from one thread, also in parallel mode. The bitset is copied to
+// faceFlags when given, for the engine comparison of bench_metrics.
+template <typename ConcurrencyTag>
+SelfIntersectionResult
+computeSelfIntersectionRatio(const Mesh &cmesh, ConcurrencyTag,
+                             std::vector<uint8_t> *faceFlags = nullptr) {
+  std::cout << "Face number:" << cmesh.faces().size() << std::endl;
+  CGAL::Real_timer timer;
+  timer.start();
+
+  SelfIntersectionResult result;
+  // Removed faces keep their index, size the bitset for them too.
+  std::vector<bool> intersecting(
+      cmesh.num_faces() + cmesh.number_of_removed_faces(), false);
+  auto mark = [&](const std::pair<face_descriptor, face_descriptor> &p) {
+    result.intersecting_pairs_num += 1;
+    for (face_descriptor f : {p.first, p.second}) {
+      if (!intersecting[f.idx()]) {
+        intersecting[f.idx()] = true;
+        result.self_intersect_faces_num += 1;
+      }
+    }
+  };
+  PMP::self_intersections<ConcurrencyTag>(
+      faces(cmesh), cmesh, boost::make_function_output_iterator(mark));
+  if (faceFlags != nullptr) {
+    faceFlags->assign(intersecting.begin(), intersecting.end());
+  }
+
+  result.faces_num = cmesh.num_faces();
+  std::cout << result.intersecting_pairs_num
+            << " pairs of triangles intersect." << std::endl;
+  std::cout << "Elapsed time (self intersections): " << timer.time()
+            << std::endl;
+  return result;
+}
+
+// Whether the faces with vertices a and b, whose boxes overlap, intersect.
+// Decided with the predicates and the rules self_intersections() uses:
+// faces sharing an edge only intersect when they are coplanar and fold onto
+// each other, faces sharing one vertex when the edge of one opposite that
+// vertex meets the other face.
+inline bool facesIntersect(const Mesh &cmesh, const std::array<uint32_t, 3> &a,
+                           const std::array<uint32_t, 3> &b) {
+  auto point = [&cmesh](uint32_t v) -> const K::Point_3 & {
+    return cmesh.point(Mesh::Vertex_index(v));
+  };
+  int sharedA[3];
+  int sharedB[3];
+  int shared = 0;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      if (a[i] == b[j]) {
+        sharedA[shared] = i;
+        sharedB[shared] = j;
+        ++shared;
+        break;
+      }
+    }
+  }
+  if (shared >= 2) {
+    const K::Point_3 &p = point(a[sharedA[0]]);
+    const K::Point_3 &q = point(a[sharedA[1]]);
+    const K::Point_3 &r = point(a[3 - sharedA[0] - sharedA[1]]);
+    const K::Point_3 &s = point(b[3 - sharedB[0] - sharedB[1]]);
+    return CGAL::coplanar(p, q, r, s) &&
+           CGAL::coplanar_orientation(p, q, r, s) == CGAL::POSITIVE;
+  }
+  K::Triangle_3 triangleA(point(a[0]), point(a[1]), point(a[2]));
+  K::Triangle_3 triangleB(point(b[0]), point(b[1]), point(b[2]));
+  if (shared == 1) {
+    int i = sharedA[0];
+    int j = sharedB[0];
+    K::Segment_3 edgeA(point(a[(i + 1) % 3]), point(a[(i + 2) % 3]));
+    K::Segment_3 edgeB(point(b[(j + 1) % 3]), point(b[(j + 2) % 3]));
+    return CGAL::do_intersect(triangleA, edgeB) ||
+           CGAL::do_intersect(triangleB, edgeA);
+  }
+  return CGAL::do_intersect(triangleA, triangleB);
+}
+
+// Vertices and boxes of the faces of cmesh, indexed by face index like the
+// bitset of the CGAL engine. Degenerate faces are flagged and left out of
+// items, the faces the broad phase works on.
+struct FaceBoxes {
+  std::vector<std::array<uint32_t, 3>> corners;
+  std::vector<Box3> boxes;
+  std::vector<uint8_t> degenerate;
+  std::vector<uint32_t> items;
+  size_t numDegenerate = 0;
+};
+
+inline void collectFaceBoxes(const Mesh &cmesh, FaceBoxes &faceBoxes) {
+  // Removed faces keep their index, size the arrays for them too.
+  const size_t numSlots = cmesh.num_faces() + cmesh.number_of_removed_faces();
+  faceBoxes.corners.assign(numSlots, std::array<uint32_t, 3>());
+  faceBoxes.boxes.assign(numSlots, Box3());
+  faceBoxes.degenerate.assign(numSlots, 0);
+  faceBoxes.items.clear();
+  faceBoxes.items.reserve(cmesh.num_faces());
+  faceBoxes.numDegenerate = 0;
+  for (face_descriptor f : faces(cmesh)) {
+    std::array<uint32_t, 3> &face = faceBoxes.corners[f.idx()];
+    size_t k = 0;
+    for (Mesh::Halfedge_index h :
+         halfedges_around_face(cmesh.halfedge(f), cmesh)) {
+      face[k++] = static_cast<uint32_t>(cmesh.target(h).idx());
+    }
+    const K::Point_3 &p = cmesh.point(Mesh::Vertex_index(face[0]));
+    const K::Point_3 &q = cmesh.point(Mesh::Vertex_index(face[1]));
+    const K::Point_3 &r = cmesh.point(Mesh::Vertex_index(face[2]));
+    if (CGAL::collinear(p, q, r)) {
+      faceBoxes.degenerate[f.idx()] = 1;
+      faceBoxes.numDegenerate += 1;
+      continue;
+    }
+    Box3 &box = faceBoxes.boxes[f.idx()];
+    for (int dim = 0; dim < 3; ++dim) {
+      box.min[dim] = std::min({p[dim], q[dim], r[dim]});
+      box.max[dim] = std::max({p[dim], q[dim], r[dim]});
+    }
+    faceBoxes.items.push_back(static_cast<uint32_t>(f.idx()));
+  }
+}
+
+// SIR with the flat BVH broad phase of box_bvh.h instead of CGAL's box
+// intersection (--sir-engine bvh). It runs on numThreads plain threads, TBB
+// is not needed. As in self_intersections(), a degenerate face is reported
+// as intersecting itself and left out of the broad phase, and the other
+// candidate pairs go through facesIntersect(), so the counts match the CGAL
+// engine. faceFlags, when given, gets the intersecting faces as in
+// computeSelfIntersectionRatio().
+inline SelfIntersectionResult
+computeSelfIntersectionRatioBvh(const Mesh &cmesh, size_t numThreads,
+                                std::vector<uint8_t> *faceFlags = nullptr) {
+  std::cout << "Face number:" << cmesh.faces().size() << std::endl;
+  CGAL::Real_timer timer;
+  timer.start();
+  numThreads = std::max<size_t>(1, numThreads);
+
+  FaceBoxes faceBoxes;
+  collectFaceBoxes(cmesh, faceBoxes);
+  const size_t numSlots = faceBoxes.degenerate.size();
+  std::unique_ptr<std::atomic<uint8_t>[]> intersecting(
+      new std::atomic<uint8_t>[numSlots]);
+  for (size_t f = 0; f < numSlots; ++f) {
+    intersecting[f].store(faceBoxes.degenerate[f], std::memory_order_relaxed);
+  }
+
+  SelfIntersectionResult result;
+  result.intersecting_pairs_num = faceBoxes.numDegenerate;
+  BoxBvh bvh(faceBoxes.boxes, faceBoxes.items, numThreads);
+  std::vector<size_t> pairs(numThreads, 0);
+  bvh.forEachOverlap(numThreads, [&](size_t thread, uint32_t a, uint32_t b) {
+    if (facesIntersect(cmesh, faceBoxes.corners[a], faceBoxes.corners[b])) {
+      pairs[thread] += 1;
+      intersecting[a].store(1, std::memory_order_relaxed);
+      intersecting[b].store(1, std::memory_order_relaxed);
+    }
+  });
+  for (size_t count : pairs) {
+    result.intersecting_pairs_num += count;
+  }
+  for (size_t f = 0; f < numSlots; ++f) {
+    result.self_intersect_faces_num +=
+        intersecting[f].load(std::memory_order_relaxed);
+  }
+  if (faceFlags != nullptr) {
+    faceFlags->resize(numSlots);
+    for (size_t f = 0; f < numSlots; ++f) {
+      (*faceFlags)[f] = intersecting[f].load(std::memory_order_relaxed);
+    }
+  }
+
+  result.faces_num = cmesh.num_faces();
+  std::cout << result.intersecting_pairs_num
+            << " pairs of triangles intersect." << std::endl;
+  std::cout << "Elapsed time (self intersections): " << timer.time()
+            << std::endl;
+  return result;
+}
+
+// z of the 95% confidence intervals of the sampled SIR.
+static const double kSirConfidenceZ = 1.959963984540054;
+// First sample size of --sir-error when --sir-samples is not given.
+static const size_t kSirInitialSamples = 1024;
+// Seed of the face sample, fixed so that a mesh always gets the same
+// estimate.
+static const uint64_t kSirSampleSeed = 0x5eed5eedULL;
+
+// Wilson score interval of hits out of samples drawn without replacement
+// from population, the sampling error shrinking to 0 as the sample reaches
+// the whole population.
+inline void sirConfidenceInterval(size_t hits, size_t samples,
+                                  size_t population, double &low,
+                                  double &high) {
+  const double n = static_cast<double>(samples);
+  const double p = static_cast<double>(hits) / n;
+  const double fpc =
+      population > 1 && samples < population
+          ? static_cast<double>(population - samples) / (population - 1)
+          : 0.0;
+  const double z2 = kSirConfidenceZ * kSirConfidenceZ * fpc;
+  const double denominator = 1.0 + z2 / n;
+  const double center = (p + z2 / (2.0 * n)) / denominator;
+  const double half =
+      std::sqrt(z2 * (p * (1.0 - p) / n + z2 / (4.0 * n * n))) / denominator;
+  low = std::max(0.0, std::min(p, center - half));
+  high = std::min(1.0, std::max(p, center + half));
+}
+
+// SIR estimated from a sample of the faces (--sir-samples, --sir-error). The
+// faces, in the Morton order of the BVH, are cut into as many strata of
+// consecutive faces as there are samples and one random face of each stratum
+// is tested against all other faces through the BVH, so the sample covers
+// the whole surface. A face counts when it is degenerate or intersects any
+// other face, as in computeSelfIntersectionRatioBvh(), so the estimate and
+// its 95% confidence interval are for the ratio of the exact engines.
+//
+// With maxError > 0 the sample grows until the interval is at most maxError
+// wide on either side. Faces tested by a smaller sample keep their result.
+// The estimate becomes exact once every face is tested.
+inline SelfIntersectionResult
+estimateSelfIntersectionRatio(const Mesh &cmesh, size_t samples,
+                              double maxError, size_t numThreads) {
+  std::cout << "Face number:" << cmesh.faces().size() << std::endl;
+  CGAL::Real_timer timer;
+  timer.start();
+  numThreads = std::max<size_t>(1, numThreads);
+
+  SelfIntersectionResult result;
+  result.faces_num = cmesh.num_faces();
+  if (result.faces_num == 0) {
+    return result;
+  }
+  FaceBoxes faceBoxes;
+  collectFaceBoxes(cmesh, faceBoxes);
+  BoxBvh bvh(faceBoxes.boxes, faceBoxes.items, numThreads);
+  // The population: the faces in Morton order, then the degenerate ones.
+  std::vector<uint32_t> population = bvh.order();
+  for (size_t f = 0; f < faceBoxes.degenerate.size(); ++f) {
+    if (faceBoxes.degenerate[f]) {
+      population.push_back(static_cast<uint32_t>(f));
+    }
+  }
+  const size_t numFaces = population.size();
+
+  // 0 untested, 1 clear, 2 intersecting. A round tests distinct faces, so
+  // the threads never write the same entry.
+  std::vector<uint8_t> state(faceBoxes.degenerate.size(), 0);
+  auto test = [&](uint32_t face) {
+    if (faceBoxes.degenerate[face]) {
+      return true;
+    }
+    const std::array<uint32_t, 3> &corners = faceBoxes.corners[face];
+    return bvh.anyOverlap(faceBoxes.boxes[face], [&](uint32_t other) {
+      return other != face &&
+             facesIntersect(cmesh, corners, faceBoxes.corners[other]);
+    });
+  };
+
+  size_t n = std::min(numFaces, samples > 0 ? samples : kSirInitialSamples);
+  std::mt19937_64 random(kSirSampleSeed);
+  std::vector<uint32_t> sample;
+  size_t hits = 0;
+  while (true) {
+    sample.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      size_t begin = i * numFaces / n;
+      size_t end = (i + 1) * numFaces / n;
+      std::uniform_int_distribution<size_t> pick(begin, end - 1);
+      sample[i] = population[pick(random)];
+    }
+    std::atomic<size_t> cursor(0);
+    runWorkers(std::min(numThreads, n), [&](size_t) {
+      for (size_t i = cursor.fetch_add(1); i < n; i = cursor.fetch_add(1)) {
+        uint8_t &entry = state[sample[i]];
+        if (entry == 0) {
+          entry = test(sample[i]) ? 2 : 1;
+        }
+      }
+    });
+    hits = 0;
+    for (uint32_t face : sample) {
+      hits += state[face] == 2;
+    }
+    sirConfidenceInterval(hits, n, numFaces, result.ratio_low,
+                          result.ratio_high);
+    double p = static_cast<double>(hits) / n;
+    if (n == numFaces || !(maxError > 0.0) ||
+        std::max(p - result.ratio_low, result.ratio_high - p) <= maxError) {
+      break;
+    }
+    // Size for the normal interval at the point of the current interval
+    // closest to 1/2, corrected for the finite population, at least double.
+    double worst =
+        std::min(std::max(0.5, result.ratio_low), result.ratio_high);
+    double needed = kSirConfidenceZ * kSirConfidenceZ * worst *
+                    (1.0 - worst) / (maxError * maxError);
+    needed /= 1.0 + (needed - 1.0) / numFaces;
+    n = std::min(numFaces,
+                 std::max(2 * n, static_cast<size_t>(std::ceil(needed))));
+  }
+
+  result.sampled_faces_num = n;
+  result.self_intersect_faces_num = static_cast<size_t>(
+      std::llround(static_cast<double>(hits) / n * result.faces_num));
+  std::cout << hits << " of " << n << " sampled faces intersect, ratio in ["
+            << result.ratio_low << ", " << result.ratio_high
+            << "] at 95% confidence." << std::endl;
+  std::cout << "Elapsed time (self intersections): " << timer.time()
+            << std::endl;
+  return result;
+}
+
+// Engine of SIR (--sir-engine).
+enum class SelfIntersectionEngine { Cgal, Bvh };
+
+inline bool parseSelfIntersectionEngine(const std::string &name,
+                                        SelfIntersectionEngine &engine) {
+  if (name == "cgal") {
+    engine = SelfIntersectionEngine::Cgal;
+  } else if (name == "bvh") {
+    engine = SelfIntersectionEngine::Bvh;
+  } else {
+    std::cerr << "Unknown self intersection engine: " << name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// How SIR is computed: exactly by engine, or estimated from a sample of
+// samples faces, grown until the confidence interval is within maxError.
+struct SelfIntersectionOptions {
+  SelfIntersectionEngine engine = SelfIntersectionEngine::Cgal;
+  size_t samples = 0;
+  double maxError = 0.0;
+
+  bool sampled() const { return samples > 0 || maxError > 0.0; }
+};
+
+// Options of --sir-engine, --sir-samples and --sir-error.
+inline bool parseSelfIntersectionOptions(const std::string &engine,
+                                         size_t samples, double maxError,
+                                         SelfIntersectionOptions &options) {
+  if (!parseSelfIntersectionEngine(engine, options.engine)) {
+    return false;
+  }
+  if (!(maxError >= 0.0 && maxError < 1.0)) {
+    std::cerr << "The SIR error target must be in [0, 1)" << std::endl;
+    return false;
+  }
+  options.samples = samples;
+  options.maxError = maxError;
+  return true;
+}
+
+// Part of the result cache id of sampled SIR values, which are cached apart
+// from the exact ones and from samples of other sizes.
+inline std::string selfIntersectionCacheTag(
+    const SelfIntersectionOptions &options) {
+  if (!options.sampled()) {
+    return "";
+  }
+  char tag[64];
+  std::snprintf(tag, sizeof(tag), "@sample=%zu,%.9g", options.samples,
+                options.maxError);
+  return tag;
+}
+
+// Part of the journal id of SIR (see RunJournal). Both engines give the same
+// value, so the engine is not part of the cache id, but a metric that timed
+// out or failed with one engine is run again with the other.
+inline std::string selfIntersectionJournalTag(
+    const SelfIntersectionOptions &options) {
+  return options.engine == SelfIntersectionEngine::Bvh ? "@bvh" : "";
+}
+
+// Whether SIR can use more than one thread in this build.
+inline bool selfIntersectionRunsParallel(
+    const SelfIntersectionOptions &options) {
+  return options.sampled() || options.engine == SelfIntersectionEngine::Bvh ||
+         kCgalParallelAvailable;
+}
+
+// SIR as options ask for, on numThreads granted threads.
+inline SelfIntersectionResult
+computeSelfIntersectionRatio(const Mesh &cmesh,
+                             const SelfIntersectionOptions &options,
+                             size_t numThreads) {
+  if (options.sampled()) {
+    return estimateSelfIntersectionRatio(cmesh, options.samples,
+                                         options.maxError, numThreads);
+  }
+  if (options.engine == SelfIntersectionEngine::Bvh) {
+    return computeSelfIntersectionRatioBvh(cmesh, numThreads);
+  }
+  return runWithThreads(numThreads, [&cmesh](auto tag) {
+    return computeSelfIntersectionRatio(cmesh, tag);
+  });
+}
+
+// Text layout of SIR: the intersecting face count and the face count, and
+// for a sampled estimate a third line with its confidence interval.
+inline std::string
+formatSelfIntersection(const SelfIntersectionResult &result) {
+  std::ostringstream content;
+  content << result.self_intersect_faces_num << '\n' << result.faces_num;
+  if (result.sampled_faces_num > 0) {
+    content.precision(9);
+    content << '\n' << result.ratio_low << ' ' << result.ratio_high;
+  }
+  return content.str();
+}
+
+// Metrics of a run (-m), shared by cad_metrics and the Python module.
+struct MetricSelection {
+  bool segment = false;
+  bool dangling = false;
+  bool flux = false;
+  bool self_intersection = false;
+  // Write the per-component sizes of SegE as well.
+  bool segment_stats = false;
+  // Write the list of dangling edges as well.
+  bool boundary_edges = false;
+  SelfIntersectionOptions self_intersection_options;
+  // Vertex welding distance of the loaded meshes, relative to the bounding
+  // box half extent (see weld.h).
+  double weld_tolerance = 0.0;
+  // Evaluate the files out of core (see streaming.h).
+  bool stream = false;
+  StreamOptions stream_options;
+};
+
+// Parse a comma separated metric list such as "segment,flux". "all" selects
+// every metric.
+inline bool parseMetricSelection(const std::string &list,
+                                 MetricSelection &selection) {
+  std::stringstream stream(list);
+  std::string name;
+  while (std::getline(stream, name, ',')) {
+    if (name == "all") {
+      selection.segment = selection.dangling = selection.flux =
+          selection.self_intersection = true;
+    } else if (name == "segment") {
+      selection.segment = true;
+    } else if (name == "dangling") {
+      selection.dangling = true;
+    } else if (name == "flux") {
+      selection.flux = true;
+    } else if (name == "self") {
+      selection.self_intersection = true;
+    } else {
+      std::cerr << "Unknown metric: " << name << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
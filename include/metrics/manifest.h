@@ -0,0 +1,165 @@
+#pragma once
+
+#include "algorithm"
+#include "cstdint"
+#include "cstdlib"
+#include "fstream"
+#include "functional"
+#include "iostream"
+#include "queue"
+#include "string"
+#include "sys/stat.h"
+#include "utility"
+#include "vector"
+
+#include "metrics/common.h"
+
+// The meshes of a run: every mesh of a folder, or the paths listed in a
+// manifest, optionally cut down to one shard (--manifest, --shard i/N).
+//
+// Shards are assigned deterministically from the file list and the file
+// sizes alone, so every node of a multi-node evaluation computes the same
+// assignment without talking to the others. Each shard keeps its cache,
+// results file and journal under its own name; the per-mesh text outputs go
+// to the usual folders, which the shards share.
+
+struct MeshList {
+  std::vector<std::string> files;
+  // Name the cache, results file and journal of the run derive from, like
+  // the mesh folder of a plain run.
+  std::string runBase;
+  // "_shard<i>of<N>" with --shard, appended to the shard-local file names.
+  std::string shardSuffix;
+};
+
+// "i/N" with 0 <= i < N.
+inline bool parseShard(const std::string &text, size_t &index,
+                       size_t &count) {
+  size_t slash = text.find('/');
+  if (slash == std::string::npos) {
+    return false;
+  }
+  char *end;
+  index = std::strtoul(text.c_str(), &end, 10);
+  if (end != text.c_str() + slash) {
+    return false;
+  }
+  count = std::strtoul(text.c_str() + slash + 1, &end, 10);
+  return *end == '\0' && count > 0 && index < count;
+}
+
+// One mesh path per line, "-" reads the list from stdin. Empty lines and
+// lines starting with '#' are skipped. Relative paths are taken relative to
+// the working directory, as the mesh_dir argument is.
+inline bool readManifest(const std::string &path,
+                         std::vector<std::string> &files) {
+  std::ifstream file;
+  if (path != "-") {
+    file.open(path);
+    if (!file.is_open()) {
+      std::cerr << "Error: Could not open manifest " << path << std::endl;
+      return false;
+    }
+  }
+  std::istream &in = path == "-" ? std::cin : file;
+  std::string line;
+  while (std::getline(in, line)) {
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+      line.pop_back();
+    }
+    if (!line.empty() && line[0] != '#') {
+      files.push_back(line);
+    }
+  }
+  return true;
+}
+
+// The files of shard index of count. The largest files are dealt first, each
+// to the shard with the fewest bytes so far (ties by path and by shard
+// index), which balances the shards by size.
+inline std::vector<std::string>
+selectShard(const std::vector<std::string> &files, size_t index,
+            size_t count) {
+  std::vector<std::pair<off_t, const std::string *>> sized;
+  sized.reserve(files.size());
+  for (const std::string &file : files) {
+    struct stat st;
+    sized.emplace_back(stat(file.c_str(), &st) == 0 ? st.st_size : 0, &file);
+  }
+  std::sort(sized.begin(), sized.end(),
+            [](const std::pair<off_t, const std::string *> &a,
+               const std::pair<off_t, const std::string *> &b) {
+              return a.first != b.first ? a.first > b.first
+                                        : *a.second < *b.second;
+            });
+
+  // (bytes, shard), smallest first.
+  typedef std::pair<uint64_t, size_t> Load;
+  std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+  for (size_t shard = 0; shard < count; ++shard) {
+    loads.push(Load(0, shard));
+  }
+  std::vector<std::string> selected;
+  for (const auto &entry : sized) {
+    Load load = loads.top();
+    loads.pop();
+    if (load.second == index) {
+      selected.push_back(*entry.second);
+    }
+    // Every file counts at least one byte, so empty files spread as well.
+    load.first += std::max<uint64_t>(1, static_cast<uint64_t>(entry.first));
+    loads.push(load);
+  }
+  // In path order, independent of the order of the list.
+  std::sort(selected.begin(), selected.end());
+  return selected;
+}
+
+// Collect the meshes of the run from meshDir or manifest and keep the ones
+// of shard ("" for all). With a manifest, meshDir only names the run's
+// files and defaults to the manifest path without its extension.
+inline bool collectMeshFiles(const std::string &meshDir,
+                             const std::string &manifest,
+                             const std::string &shard, MeshList &list) {
+  list = MeshList();
+  if (!manifest.empty()) {
+    if (meshDir.empty() && manifest == "-") {
+      std::cerr << "Please specify mesh_dir to name the results of a "
+                   "manifest read from stdin"
+                << std::endl;
+      return false;
+    }
+    if (!readManifest(manifest, list.files)) {
+      return false;
+    }
+    std::string name = get_filename(manifest);
+    list.runBase = meshDir.empty()
+                       ? manifest.substr(0, manifest.size() - name.size()) +
+                             replace_extension(name, "")
+                       : meshDir;
+  } else {
+    list.files = list_mesh_files(meshDir);
+    list.runBase = meshDir;
+  }
+  while (list.runBase.size() > 1 && list.runBase.back() == '/') {
+    list.runBase.pop_back();
+  }
+
+  if (!shard.empty()) {
+    size_t index, count;
+    if (!parseShard(shard, index, count)) {
+      std::cerr << "Invalid shard " << shard << ", expected i/N with "
+                << "0 <= i < N" << std::endl;
+      return false;
+    }
+    size_t total = list.files.size();
+    list.files = selectShard(list.files, index, count);
+    list.shardSuffix =
+        "_shard" + std::to_string(index) + "of" + std::to_string(count);
+    list.runBase += list.shardSuffix;
+    std::cout << "Shard " << index << "/" << count << ": "
+              << list.files.size() << " of " << total << " meshes"
+              << std::endl;
+  }
+  return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "cstddef"
+#include "fcntl.h"
+#include "string"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                          MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        data_ = static_cast<const char *>(mapped);
+        size_ = static_cast<size_t>(st.st_size);
+        madvise(mapped, size_, MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool valid() const { return data_ != nullptr; }
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
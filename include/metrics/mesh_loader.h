@@ -0,0 +1,604 @@
+#pragma once
+
+#include "algorithm"
+#include "cerrno"
+#include "cstdint"
+#include "cstdlib"
+#include "cstring"
+#include "exception"
+#include "iostream"
+#include "string"
+#include "vector"
+
+#include "metrics/flat_mesh.h"
+#include "metrics/mapped_file.h"
+#include "metrics/paths.h"
+#include "metrics/polygon_soup.h"
+#include "metrics/weld.h"
+#include "metrics/workspace.h"
+
+// Native PLY/STL reader. The file is memory mapped and decoded straight into
+// the coordinate and triangle arrays of a FlatMesh, without going through an
+// intermediate polygon soup of CGAL points.
+//
+// Supported: ASCII, binary little endian and binary big endian PLY, binary
+// and ASCII STL. Polygons with more than three corners are fan triangulated.
+
+namespace mesh_loader_detail {
+
+// Binary STL and binary_little_endian PLY data need no swapping on such
+// hosts.
+static const bool kHostLittleEndian =
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32,
+                     Float64, Invalid };
+
+inline PlyType parsePlyType(const std::string &name) {
+  if (name == "char" || name == "int8") return PlyType::Int8;
+  if (name == "uchar" || name == "uint8") return PlyType::UInt8;
+  if (name == "short" || name == "int16") return PlyType::Int16;
+  if (name == "ushort" || name == "uint16") return PlyType::UInt16;
+  if (name == "int" || name == "int32") return PlyType::Int32;
+  if (name == "uint" || name == "uint32") return PlyType::UInt32;
+  if (name == "float" || name == "float32") return PlyType::Float32;
+  if (name == "double" || name == "float64") return PlyType::Float64;
+  return PlyType::Invalid;
+}
+
+inline size_t plyTypeSize(PlyType type) {
+  switch (type) {
+  case PlyType::Int8:
+  case PlyType::UInt8:
+    return 1;
+  case PlyType::Int16:
+  case PlyType::UInt16:
+    return 2;
+  case PlyType::Int32:
+  case PlyType::UInt32:
+  case PlyType::Float32:
+    return 4;
+  case PlyType::Float64:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+template <typename T> T loadScalar(const char *p, bool swapBytes) {
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, p, sizeof(T));
+  if (swapBytes) {
+    std::reverse(bytes, bytes + sizeof(T));
+  }
+  T value;
+  std::memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+// Scalar stored little endian, as in binary STL.
+template <typename T> T loadLittleEndian(const char *p) {
+  return loadScalar<T>(p, !kHostLittleEndian);
+}
+
+inline double loadPlyScalar(const char *p, PlyType type, bool swapBytes) {
+  switch (type) {
+  case PlyType::Int8:
+    return loadScalar<int8_t>(p, false);
+  case PlyType::UInt8:
+    return loadScalar<uint8_t>(p, false);
+  case PlyType::Int16:
+    return loadScalar<int16_t>(p, swapBytes);
+  case PlyType::UInt16:
+    return loadScalar<uint16_t>(p, swapBytes);
+  case PlyType::Int32:
+    return loadScalar<int32_t>(p, swapBytes);
+  case PlyType::UInt32:
+    return loadScalar<uint32_t>(p, swapBytes);
+  case PlyType::Float32:
+    return loadScalar<float>(p, swapBytes);
+  case PlyType::Float64:
+    return loadScalar<double>(p, swapBytes);
+  default:
+    return 0.0;
+  }
+}
+
+struct PlyProperty {
+  std::string name;
+  PlyType type = PlyType::Invalid;
+  bool isList = false;
+  PlyType countType = PlyType::Invalid;
+};
+
+struct PlyElement {
+  std::string name;
+  size_t count = 0;
+  std::vector<PlyProperty> properties;
+};
+
+// Whitespace separated token reader over a buffer that is not null
+// terminated.
+class TokenReader {
+public:
+  TokenReader(const char *begin, const char *end) : cur_(begin), end_(end) {}
+
+  bool next(std::string &token) {
+    while (cur_ < end_ && isSpace(*cur_)) {
+      ++cur_;
+    }
+    const char *start = cur_;
+    while (cur_ < end_ && !isSpace(*cur_)) {
+      ++cur_;
+    }
+    token.assign(start, cur_);
+    return !token.empty();
+  }
+
+  bool nextNumber(double &value) {
+    while (cur_ < end_ && isSpace(*cur_)) {
+      ++cur_;
+    }
+    char buffer[64];
+    size_t length = 0;
+    while (cur_ < end_ && !isSpace(*cur_) && length + 1 < sizeof(buffer)) {
+      buffer[length++] = *cur_++;
+    }
+    if (length == 0) {
+      return false;
+    }
+    buffer[length] = '\0';
+    char *parsed = nullptr;
+    value = std::strtod(buffer, &parsed);
+    return parsed == buffer + length;
+  }
+
+  // Bytes not read yet.
+  size_t remaining() const { return static_cast<size_t>(end_ - cur_); }
+
+  // Skip the rest of the current line.
+  void skipLine() {
+    while (cur_ < end_ && *cur_ != '\n') {
+      ++cur_;
+    }
+    if (cur_ < end_) {
+      ++cur_;
+    }
+  }
+
+private:
+  static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  }
+
+  const char *cur_;
+  const char *end_;
+};
+
+// Length of a PLY list. False unless value is a count the reader can index,
+// which also rejects negative and NaN values before they are converted.
+inline bool plyListSize(double value, size_t &size) {
+  if (!(value >= 0.0 && value <= static_cast<double>(UINT32_MAX))) {
+    return false;
+  }
+  size = static_cast<size_t>(value);
+  return true;
+}
+
+// Vertex index of a face corner. False unless 0 <= value < numVertices.
+inline bool plyVertexIndex(double value, uint64_t numVertices,
+                           uint32_t &index) {
+  if (!(value >= 0.0 && value < static_cast<double>(numVertices) &&
+        value <= static_cast<double>(UINT32_MAX))) {
+    return false;
+  }
+  index = static_cast<uint32_t>(value);
+  return true;
+}
+
+// Append a polygon as a triangle fan. The corners are valid vertex indices.
+inline void appendPolygon(const uint32_t *corners, size_t count,
+                          FlatMesh &mesh) {
+  for (size_t i = 1; i + 1 < count; ++i) {
+    mesh.triangles.push_back(corners[0]);
+    mesh.triangles.push_back(corners[i]);
+    mesh.triangles.push_back(corners[i + 1]);
+  }
+}
+
+// Fewest bytes a record of element takes in the body: one value per
+// property, a binary value at least one byte, an ASCII value at least one
+// digit and a separator.
+inline size_t plyMinRecordSize(const PlyElement &element, bool ascii) {
+  size_t bytes = 0;
+  for (const PlyProperty &property : element.properties) {
+    bytes += ascii ? 2
+                   : plyTypeSize(property.isList ? property.countType
+                                                 : property.type);
+  }
+  return bytes;
+}
+
+enum class PlyFormat { Ascii, BinaryLittle, BinaryBig };
+
+// Whether the binary scalars of a file in format need their bytes swapped.
+inline bool plySwapBytes(PlyFormat format) {
+  return (format == PlyFormat::BinaryLittle) != kHostLittleEndian;
+}
+
+// Parse the PLY header at the start of [data, end). body is set to the first
+// byte after the end_header line.
+inline bool parsePlyHeader(const char *data, const char *end,
+                           PlyFormat &format,
+                           std::vector<PlyElement> &elements,
+                           const char *&body, std::string &error) {
+  const char *headerEnd = nullptr;
+  static const char kEndHeader[] = "end_header";
+  for (const char *p = data; p + sizeof(kEndHeader) - 1 <= end; ++p) {
+    if (std::memcmp(p, kEndHeader, sizeof(kEndHeader) - 1) == 0) {
+      headerEnd = p + sizeof(kEndHeader) - 1;
+      break;
+    }
+  }
+  if (headerEnd == nullptr) {
+    error = "missing end_header";
+    return false;
+  }
+  // The body starts after the end of the end_header line.
+  body = headerEnd;
+  while (body < end && *body != '\n') {
+    ++body;
+  }
+  if (body < end) {
+    ++body;
+  }
+
+  format = PlyFormat::Ascii;
+  elements.clear();
+  TokenReader header(data, headerEnd);
+  std::string token;
+  header.next(token);
+  if (token != "ply") {
+    error = "not a PLY file";
+    return false;
+  }
+  while (header.next(token) && token != "end_header") {
+    if (token == "format") {
+      header.next(token);
+      if (token == "ascii") {
+        format = PlyFormat::Ascii;
+      } else if (token == "binary_little_endian") {
+        format = PlyFormat::BinaryLittle;
+      } else if (token == "binary_big_endian") {
+        format = PlyFormat::BinaryBig;
+      } else {
+        error = "unknown format " + token;
+        return false;
+      }
+      header.skipLine();
+    } else if (token == "element") {
+      PlyElement element;
+      header.next(element.name);
+      header.next(token);
+      char *parsed = nullptr;
+      errno = 0;
+      element.count = std::strtoull(token.c_str(), &parsed, 10);
+      if (token.empty() || *parsed != '\0' || token[0] == '-' ||
+          errno == ERANGE) {
+        error = "invalid element count " + token;
+        return false;
+      }
+      elements.push_back(element);
+    } else if (token == "property") {
+      if (elements.empty()) {
+        error = "property outside of an element";
+        return false;
+      }
+      PlyProperty property;
+      header.next(token);
+      if (token == "list") {
+        property.isList = true;
+        header.next(token);
+        property.countType = parsePlyType(token);
+        header.next(token);
+      }
+      property.type = parsePlyType(token);
+      header.next(property.name);
+      if (property.type == PlyType::Invalid ||
+          (property.isList && property.countType == PlyType::Invalid)) {
+        error = "unknown property type";
+        return false;
+      }
+      elements.back().properties.push_back(property);
+    } else {
+      // comment, obj_info, ...
+      header.skipLine();
+    }
+  }
+  return true;
+}
+
+inline bool readPly(const char *data, size_t size, FlatMesh &mesh,
+                    std::string &error) {
+  const char *end = data + size;
+  PlyFormat format;
+  std::vector<PlyElement> elements;
+  const char *body = nullptr;
+  if (!parsePlyHeader(data, end, format, elements, body, error)) {
+    return false;
+  }
+
+  const bool swapBytes = plySwapBytes(format);
+  const bool ascii = format == PlyFormat::Ascii;
+  TokenReader asciiBody(body, end);
+  const char *cursor = body;
+  std::vector<uint32_t> corners;
+
+  for (const PlyElement &element : elements) {
+    const bool isVertex = element.name == "vertex";
+    const bool isFace = element.name == "face";
+    int xyz[3] = {-1, -1, -1};
+    int indexProperty = -1;
+    for (size_t i = 0; i < element.properties.size(); ++i) {
+      const PlyProperty &property = element.properties[i];
+      if (isVertex && !property.isList) {
+        if (property.name == "x") xyz[0] = static_cast<int>(i);
+        if (property.name == "y") xyz[1] = static_cast<int>(i);
+        if (property.name == "z") xyz[2] = static_cast<int>(i);
+      }
+      if (isFace && property.isList &&
+          (property.name == "vertex_indices" ||
+           property.name == "vertex_index")) {
+        indexProperty = static_cast<int>(i);
+      }
+    }
+    if (isVertex && (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0)) {
+      error = "vertex element without x, y, z";
+      return false;
+    }
+    if (element.properties.empty()) {
+      continue;  // nothing stored
+    }
+    // The count comes from the header: check that the rest of the file can
+    // hold that many records before reserving for them.
+    size_t remaining = ascii ? asciiBody.remaining()
+                             : static_cast<size_t>(end - cursor);
+    if (element.count > remaining / plyMinRecordSize(element, ascii)) {
+      error = "element " + element.name + " larger than the file";
+      return false;
+    }
+    if (isVertex) {
+      mesh.reserve(element.count, 0);
+    }
+    if (isFace) {
+      mesh.triangles.reserve(element.count * 3);
+    }
+
+    for (size_t item = 0; item < element.count; ++item) {
+      double point[3] = {0.0, 0.0, 0.0};
+      corners.clear();
+      for (size_t i = 0; i < element.properties.size(); ++i) {
+        const PlyProperty &property = element.properties[i];
+        bool keepList = static_cast<int>(i) == indexProperty;
+        if (ascii) {
+          double value = 0.0;
+          if (!asciiBody.nextNumber(value)) {
+            error = "truncated ASCII body";
+            return false;
+          }
+          if (property.isList) {
+            size_t count = 0;
+            if (!plyListSize(value, count)) {
+              error = "invalid list size";
+              return false;
+            }
+            for (size_t k = 0; k < count; ++k) {
+              if (!asciiBody.nextNumber(value)) {
+                error = "truncated ASCII body";
+                return false;
+              }
+              if (keepList) {
+                uint32_t index = 0;
+                if (!plyVertexIndex(value, mesh.numVertices(), index)) {
+                  error = "face index out of range";
+                  return false;
+                }
+                corners.push_back(index);
+              }
+            }
+          } else {
+            for (int d = 0; d < 3; ++d) {
+              if (xyz[d] == static_cast<int>(i)) {
+                point[d] = value;
+              }
+            }
+          }
+        } else {
+          if (property.isList) {
+            size_t countSize = plyTypeSize(property.countType);
+            if (cursor + countSize > end) {
+              error = "truncated binary body";
+              return false;
+            }
+            size_t count = 0;
+            if (!plyListSize(
+                    loadPlyScalar(cursor, property.countType, swapBytes),
+                    count)) {
+              error = "invalid list size";
+              return false;
+            }
+            cursor += countSize;
+            size_t valueSize = plyTypeSize(property.type);
+            if (count * valueSize > static_cast<size_t>(end - cursor)) {
+              error = "truncated binary body";
+              return false;
+            }
+            if (keepList) {
+              for (size_t k = 0; k < count; ++k) {
+                uint32_t index = 0;
+                if (!plyVertexIndex(loadPlyScalar(cursor + k * valueSize,
+                                                  property.type, swapBytes),
+                                    mesh.numVertices(), index)) {
+                  error = "face index out of range";
+                  return false;
+                }
+                corners.push_back(index);
+              }
+            }
+            cursor += count * valueSize;
+          } else {
+            size_t valueSize = plyTypeSize(property.type);
+            if (cursor + valueSize > end) {
+              error = "truncated binary body";
+              return false;
+            }
+            for (int d = 0; d < 3; ++d) {
+              if (xyz[d] == static_cast<int>(i)) {
+                point[d] = loadPlyScalar(cursor, property.type, swapBytes);
+              }
+            }
+            cursor += valueSize;
+          }
+        }
+      }
+      if (isVertex) {
+        mesh.addVertex(point[0], point[1], point[2]);
+      } else if (isFace) {
+        appendPolygon(corners.data(), corners.size(), mesh);
+      }
+    }
+  }
+  return true;
+}
+
+inline bool readBinaryStl(const char *data, size_t size, FlatMesh &mesh) {
+  if (size < 84) {
+    return false;
+  }
+  uint32_t count = loadLittleEndian<uint32_t>(data + 80);
+  if (size != 84 + static_cast<size_t>(count) * 50) {
+    return false;
+  }
+  // STL is a triangle soup: every corner gets its own vertex, the duplicates
+  // are merged by cleanFlatMesh().
+  mesh.resizeVertices(static_cast<size_t>(count) * 3);
+  mesh.triangles.resize(static_cast<size_t>(count) * 3);
+  for (size_t t = 0; t < count; ++t) {
+    const char *record = data + 84 + t * 50 + 12;  // skip the normal
+    for (size_t k = 0; k < 3; ++k) {
+      size_t v = t * 3 + k;
+      mesh.x[v] = loadLittleEndian<float>(record + k * 12);
+      mesh.y[v] = loadLittleEndian<float>(record + k * 12 + 4);
+      mesh.z[v] = loadLittleEndian<float>(record + k * 12 + 8);
+      mesh.triangles[v] = static_cast<uint32_t>(v);
+    }
+  }
+  return true;
+}
+
+inline bool readAsciiStl(const char *data, size_t size, FlatMesh &mesh,
+                         std::string &error) {
+  TokenReader reader(data, data + size);
+  std::string token;
+  if (!reader.next(token) || token != "solid") {
+    error = "not an STL file";
+    return false;
+  }
+  size_t corners = 0;
+  while (reader.next(token)) {
+    if (token != "vertex") {
+      continue;
+    }
+    double point[3] = {0.0, 0.0, 0.0};
+    for (int d = 0; d < 3; ++d) {
+      if (!reader.nextNumber(point[d])) {
+        error = "truncated vertex";
+        return false;
+      }
+    }
+    mesh.addVertex(point[0], point[1], point[2]);
+    mesh.triangles.push_back(static_cast<uint32_t>(corners++));
+  }
+  if (corners % 3 != 0) {
+    error = "facet without three vertices";
+    return false;
+  }
+  return true;
+}
+
+} // namespace mesh_loader_detail
+
+// Weld the vertices (see weld.h), drop triangles that became degenerate,
+// vertices used by no triangle and duplicate triangles, then orient the
+// triangles and split the vertices where several fans meet (see
+// polygon_soup.h). With the default options this is what CGAL's
+// read_polygon_mesh() did to the soup, and gives STL soups their
+// connectivity back. Returns false when the result is no polygon mesh, which
+// read_polygon_mesh() rejected too. The work arrays are those of workspace
+// when one is given.
+inline bool cleanFlatMesh(FlatMesh &mesh,
+                          const WeldOptions &weld = WeldOptions(),
+                          Workspace *workspace = nullptr) {
+  Workspace local;
+  Workspace &ws = workspace != nullptr ? *workspace : local;
+  weldVertices(mesh.view(), weld, ws.labels, &ws);
+  compactFlatMesh(mesh, ws.labels, &ws);
+  removeDuplicateTriangles(mesh, weld.numThreads, &ws);
+  return orientTriangleSoup(mesh, weld.numThreads, &ws);
+}
+
+// Decode the content of a .ply or .stl file held in memory; the format is
+// taken from the extension of name. Returns false and prints the reason when
+// the data can not be decoded.
+inline bool readFlatMeshData(const char *data, size_t size,
+                             const std::string &name, FlatMesh &mesh,
+                             const WeldOptions &weld = WeldOptions(),
+                             Workspace *workspace = nullptr) {
+  mesh.clear();
+  std::string error;
+  bool ok = false;
+  // A file too large for memory fails like a corrupt one, instead of ending
+  // the batch.
+  try {
+    if (hasExtension(name, ".ply")) {
+      ok = mesh_loader_detail::readPly(data, size, mesh, error);
+    } else if (hasExtension(name, ".stl")) {
+      ok = mesh_loader_detail::readBinaryStl(data, size, mesh);
+      if (!ok) {
+        mesh.clear();
+        ok = mesh_loader_detail::readAsciiStl(data, size, mesh, error);
+      }
+    } else {
+      error = "unsupported extension";
+    }
+    if (ok && !cleanFlatMesh(mesh, weld, workspace)) {
+      ok = false;
+      error = "not a polygon mesh";
+    }
+  } catch (const std::exception &e) {
+    ok = false;
+    error = e.what();
+  }
+  if (!ok) {
+    std::cerr << "Error: Could not read " << name << ": " << error
+              << std::endl;
+    mesh.clear();
+    return false;
+  }
+  return true;
+}
+
+// Read a .ply or .stl file. Returns false and prints the reason when the
+// file can not be decoded.
+inline bool readFlatMesh(const std::string &path, FlatMesh &mesh,
+                         const WeldOptions &weld = WeldOptions(),
+                         Workspace *workspace = nullptr) {
+  mesh.clear();
+  MappedFile file(path);
+  if (!file.valid()) {
+    std::cerr << "Error: Could not map " << path << std::endl;
+    return false;
+  }
+  return readFlatMeshData(file.data(), file.size(), path, mesh, weld,
+                          workspace);
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include "chrono"
+#include "cstdio"
+#include "cstdlib"
+#include "string"
+
+#include "metrics/common.h"
+#include "metrics/kernels.h"
+#include "metrics/profiler.h"
+#include "metrics/result_cache.h"
+#include "metrics/results_file.h"
+#include "metrics/run_journal.h"
+
+// Where the tools put the metric results: one text file per mesh and metric
+// (the original layout), the columnar results file, or both.
+enum class OutputFormat { Text, Columnar, Both };
+
+inline bool parseOutputFormat(const std::string &name, OutputFormat &format) {
+  if (name == "text") {
+    format = OutputFormat::Text;
+  } else if (name == "columnar") {
+    format = OutputFormat::Columnar;
+  } else if (name == "both") {
+    format = OutputFormat::Both;
+  } else {
+    std::cerr << "Unknown output format: " << name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// <dir>_results.bin for the mesh folder <dir>, or "" when the format has no
+// columnar output.
+inline std::string resultsFilePath(std::string dirPath, OutputFormat format) {
+  if (format == OutputFormat::Text) {
+    return "";
+  }
+  while (dirPath.size() > 1 && dirPath.back() == '/') {
+    dirPath.pop_back();
+  }
+  return dirPath + kResultsFileSuffix;
+}
+
+static const char *const kMetricOutputSuffixes[kNumMetricColumns] = {
+    kSegmentNumSuffix, kDanglingEdgeSuffix, kFluxEnclosureSuffix,
+    kSelfIntersectionSuffix};
+static const char *const kMetricOutputLabels[kNumMetricColumns] = {
+    "Segment number", "Dangling Edge Length", "Flux enclosure error",
+    "Self intersection"};
+static const char *const kMetricCacheIds[kNumMetricColumns] = {
+    kSegmentNumMetricId, kDanglingEdgeMetricId, kFluxEnclosureMetricId,
+    kSelfIntersectionMetricId};
+
+// The results of one worker. Every mesh is one row: begin() starts it, the
+// metrics fill their column and finish() hands the row to the worker's
+// results buffer. Text outputs are written immediately. With a profile log
+// the time spent in here is recorded as the output stage of the mesh.
+//
+// In a supervised worker process (see supervisor.h) the results are not
+// stored but reported one line each to the supervisor, which replays them
+// into its own MetricOutput with applyReport():
+//
+//   N <faces>
+//   W <column> <seconds> <escaped text content>
+//   F <column> <status> <seconds>
+class MetricOutput {
+public:
+  MetricOutput(ResultsFile &file, ResultCache &cache, OutputFormat format)
+      : buffer_(file), cache_(cache),
+        writeText_(format != OutputFormat::Columnar) {}
+
+  ~MetricOutput() { finish(); }
+
+  MetricOutput(const MetricOutput &) = delete;
+  MetricOutput &operator=(const MetricOutput &) = delete;
+
+  void begin(const std::string &inputPath) {
+    finish();
+    inputPath_ = inputPath;
+    record_ = MetricRecord();
+    record_.meshId = meshIdOf(inputPath);
+    // The content key is only computed once the cache is used, so meshes
+    // replayed from the journal are not read.
+    cacheKey_.clear();
+    hasCacheKey_ = false;
+    open_ = true;
+  }
+
+  void setFaces(size_t faces) {
+    record_.faces = faces;
+    if (report_ != nullptr) {
+      std::fprintf(report_, "N\t%zu\n", faces);
+      std::fflush(report_);
+    }
+  }
+
+  void setProfile(ProfileLog *profile) { profile_ = profile; }
+
+  // Appended to the cache ids of the metrics, for options that change the
+  // loaded mesh (see weldCacheTag()).
+  void setCacheTag(const std::string &tag) { cacheTag_ = tag; }
+
+  // Appended to the cache id of column only, for options of one metric (see
+  // selfIntersectionCacheTag()).
+  void setCacheTag(MetricColumn column, const std::string &tag) {
+    columnCacheTags_[column] = tag;
+  }
+
+  // Appended to the journal id of column only, for options that change how a
+  // metric runs but not its value (see selfIntersectionJournalTag()).
+  void setJournalTag(MetricColumn column, const std::string &tag) {
+    columnJournalTags_[column] = tag;
+  }
+
+  // The row of the current mesh.
+  const MetricRecord &record() const { return record_; }
+
+  // Record every finished metric in journal as well.
+  void setJournal(RunJournal *journal) { journal_ = journal; }
+
+  // Report the results to stream instead of storing them.
+  void setReportStream(std::FILE *stream) { report_ = stream; }
+
+  // Replay a metric the resumed run had finished, whatever its status.
+  // Returns false when the journal has no entry for it, or one computed with
+  // other options.
+  bool replay(MetricColumn column) {
+    JournalEntry entry;
+    if (journal_ == nullptr ||
+        !journal_->lookup(inputPath_, column, journalId(column), entry)) {
+      return false;
+    }
+    OutputTimer timer(*this);
+    if (metricStatusHasValue(entry.status)) {
+      if (writeText_ &&
+          !restoreMetricOutput(inputPath_, kMetricOutputSuffixes[column],
+                               entry.content, kMetricOutputLabels[column])) {
+        return false;
+      }
+      setValue(column, entry.content,
+               static_cast<MetricStatus>(entry.status), entry.seconds);
+    } else {
+      record_.status[column] = entry.status;
+      record_.seconds[column] = entry.seconds;
+    }
+    if (entry.faces > 0) {
+      record_.faces = entry.faces;
+    }
+    return true;
+  }
+
+  // Restore a metric from the result cache. Returns false on a miss.
+  bool restore(MetricColumn column) {
+    OutputTimer timer(*this);
+    std::string content;
+    if (!cache_.lookup(cacheKey(), cacheId(column), content)) {
+      return false;
+    }
+    if (writeText_ &&
+        !restoreMetricOutput(inputPath_, kMetricOutputSuffixes[column],
+                             content, kMetricOutputLabels[column])) {
+      return false;
+    }
+    setValue(column, content, kStatusCached, 0.0);
+    journal(column, content);
+    return true;
+  }
+
+  // Store a computed metric given in its text layout.
+  void write(MetricColumn column, const std::string &content, double seconds) {
+    if (report_ != nullptr) {
+      std::fprintf(report_, "W\t%d\t%.9g\t%s\n", static_cast<int>(column),
+                   seconds, escapeField(content).c_str());
+      std::fflush(report_);
+      return;
+    }
+    OutputTimer timer(*this);
+    if (writeText_) {
+      writeMetricOutput(inputPath_, kMetricOutputSuffixes[column], content,
+                        kMetricOutputLabels[column]);
+    }
+    cache_.store(cacheKey(), cacheId(column), content);
+    setValue(column, content, kStatusOk, seconds);
+    journal(column, content);
+  }
+
+  void fail(MetricColumn column, MetricStatus status, double seconds = 0.0) {
+    if (report_ != nullptr) {
+      std::fprintf(report_, "F\t%d\t%d\t%.9g\n", static_cast<int>(column),
+                   static_cast<int>(status), seconds);
+      std::fflush(report_);
+    }
+    record_.status[column] = status;
+    record_.seconds[column] = seconds;
+    journal(column, "");
+  }
+
+  // Replay one line reported by a worker process. Sets column and returns
+  // true when the line completed a metric (W or F).
+  bool applyReport(const std::string &line, MetricColumn &column) {
+    std::vector<std::string> fields = splitFields(line);
+    if (fields[0] == "N" && fields.size() == 2) {
+      setFaces(std::strtoull(fields[1].c_str(), nullptr, 10));
+      return false;
+    }
+    if (fields.size() != 4 || (fields[0] != "W" && fields[0] != "F")) {
+      return false;
+    }
+    int index = std::atoi(fields[1].c_str());
+    if (index < 0 || index >= kNumMetricColumns) {
+      return false;
+    }
+    column = static_cast<MetricColumn>(index);
+    if (fields[0] == "W") {
+      write(column, unescapeField(fields[3]),
+            std::strtod(fields[2].c_str(), nullptr));
+    } else {
+      fail(column, static_cast<MetricStatus>(std::atoi(fields[2].c_str())),
+           std::strtod(fields[3].c_str(), nullptr));
+    }
+    return true;
+  }
+
+  // Extra outputs that only exist in the text layout (segment stats,
+  // boundary edges).
+  void writeText(const std::string &suffix, const std::string &content,
+                 const std::string &label) {
+    OutputTimer timer(*this);
+    writeMetricOutput(inputPath_, suffix, content, label);
+  }
+
+  void finish() {
+    if (!open_) {
+      return;
+    }
+    {
+      OutputTimer timer(*this);
+      buffer_.add(record_);
+    }
+    if (profile_ != nullptr) {
+      StageSample sample;
+      sample.mesh = inputPath_;
+      sample.stage = kStageOutput;
+      sample.seconds = outputSeconds_;
+      sample.faces = record_.faces;
+      profile_->push_back(sample);
+    }
+    outputSeconds_ = 0.0;
+    open_ = false;
+  }
+
+private:
+  // Adds its lifetime to the output time of the mesh.
+  class OutputTimer {
+  public:
+    explicit OutputTimer(MetricOutput &output)
+        : output_(output), start_(std::chrono::steady_clock::now()) {}
+    ~OutputTimer() {
+      output_.outputSeconds_ += std::chrono::duration<double>(
+                                    std::chrono::steady_clock::now() - start_)
+                                    .count();
+    }
+
+  private:
+    MetricOutput &output_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  const std::string &cacheKey() {
+    if (!hasCacheKey_) {
+      cacheKey_ = cache_.contentKey(inputPath_);
+      hasCacheKey_ = true;
+    }
+    return cacheKey_;
+  }
+
+  std::string cacheId(MetricColumn column) const {
+    return kMetricCacheIds[column] + cacheTag_ + columnCacheTags_[column];
+  }
+
+  std::string journalId(MetricColumn column) const {
+    return cacheId(column) + columnJournalTags_[column];
+  }
+
+  // Called once the metric's outputs are in place.
+  void journal(MetricColumn column, const std::string &content) {
+    if (journal_ != nullptr) {
+      journal_->record(inputPath_, column, journalId(column),
+                       record_.status[column], record_.seconds[column],
+                       record_.faces, content);
+    }
+  }
+
+  void setValue(MetricColumn column, const std::string &content,
+                MetricStatus status, double seconds) {
+    record_.value[column] = metricValueFromText(column, content);
+    record_.status[column] = status;
+    record_.seconds[column] = seconds;
+  }
+
+  ResultsBuffer buffer_;
+  ResultCache &cache_;
+  bool writeText_;
+  bool open_ = false;
+  std::string inputPath_;
+  std::string cacheKey_;
+  bool hasCacheKey_ = false;
+  std::string cacheTag_;
+  std::string columnCacheTags_[kNumMetricColumns];
+  std::string columnJournalTags_[kNumMetricColumns];
+  MetricRecord record_;
+  ProfileLog *profile_ = nullptr;
+  RunJournal *journal_ = nullptr;
+  std::FILE *report_ = nullptr;
+  double outputSeconds_ = 0.0;
+};
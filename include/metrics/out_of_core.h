@@ -0,0 +1,361 @@
+#pragma once
+
+#include "algorithm"
+#include "cerrno"
+#include "cstdint"
+#include "cstdlib"
+#include "cstring"
+#include "fcntl.h"
+#include "functional"
+#include "memory"
+#include "queue"
+#include "stdexcept"
+#include "string"
+#include "sys/mman.h"
+#include "unistd.h"
+#include "utility"
+#include "vector"
+
+// External memory building blocks of the streaming evaluation (--stream, see
+// streaming.h): temporary files, buffered record streams, a merge sort whose
+// runs spill to disk, and arrays and a disjoint set that live in a memory
+// mapped temporary file.
+//
+// Temporary files are unlinked as soon as they are created, so nothing is
+// left behind when the process dies. Failing file operations throw
+// std::runtime_error like the kernels do.
+
+// Read buffer of the record streams and of the mesh readers.
+static const size_t kStreamBufferBytes = size_t(1) << 20;
+// Smallest read buffer of a run in the merge phase.
+static const size_t kMinMergeBufferBytes = size_t(64) << 10;
+
+// The temporary folder: dir, else $TMPDIR, else /tmp.
+inline std::string streamTempDir(const std::string &dir) {
+  if (!dir.empty()) {
+    return dir;
+  }
+  const char *env = std::getenv("TMPDIR");
+  return env != nullptr && env[0] != '\0' ? std::string(env) : "/tmp";
+}
+
+inline std::runtime_error streamFileError(const std::string &what) {
+  return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Anonymous file in dir, removed when closed.
+class TempFile {
+public:
+  explicit TempFile(const std::string &dir) {
+    std::string pattern = streamTempDir(dir) + "/cad_metrics_stream.XXXXXX";
+    std::vector<char> path(pattern.begin(), pattern.end());
+    path.push_back('\0');
+    fd_ = mkstemp(path.data());
+    if (fd_ < 0) {
+      throw streamFileError("Could not create a temporary file in " +
+                            streamTempDir(dir));
+    }
+    unlink(path.data());
+  }
+
+  ~TempFile() { close(fd_); }
+
+  TempFile(const TempFile &) = delete;
+  TempFile &operator=(const TempFile &) = delete;
+
+  int fd() const { return fd_; }
+
+  void write(const void *data, size_t bytes, uint64_t offset) const {
+    const char *p = static_cast<const char *>(data);
+    while (bytes > 0) {
+      ssize_t written = pwrite(fd_, p, bytes, static_cast<off_t>(offset));
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        throw streamFileError("Could not write a temporary file");
+      }
+      p += written;
+      bytes -= static_cast<size_t>(written);
+      offset += static_cast<uint64_t>(written);
+    }
+  }
+
+  void read(void *data, size_t bytes, uint64_t offset) const {
+    char *p = static_cast<char *>(data);
+    while (bytes > 0) {
+      ssize_t got = pread(fd_, p, bytes, static_cast<off_t>(offset));
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got <= 0) {
+        throw streamFileError("Could not read a temporary file");
+      }
+      p += got;
+      bytes -= static_cast<size_t>(got);
+      offset += static_cast<uint64_t>(got);
+    }
+  }
+
+private:
+  int fd_ = -1;
+};
+
+// Records of a trivially copyable type appended to a temporary file.
+template <typename Record> class RecordWriter {
+public:
+  RecordWriter(const TempFile &file, size_t bufferRecords)
+      : file_(file), capacity_(std::max<size_t>(1, bufferRecords)) {
+    buffer_.reserve(capacity_);
+  }
+
+  void add(const Record &record) {
+    buffer_.push_back(record);
+    if (buffer_.size() == capacity_) {
+      flush();
+    }
+  }
+
+  void flush() {
+    file_.write(buffer_.data(), buffer_.size() * sizeof(Record), end_);
+    end_ += buffer_.size() * sizeof(Record);
+    buffer_.clear();
+  }
+
+  // Records written so far, flushed or not.
+  uint64_t size() const { return end_ / sizeof(Record) + buffer_.size(); }
+
+private:
+  const TempFile &file_;
+  size_t capacity_;
+  std::vector<Record> buffer_;
+  uint64_t end_ = 0;
+};
+
+// Sequential reader of count records written from record first on.
+template <typename Record> class RecordReader {
+public:
+  RecordReader(const TempFile &file, uint64_t first, uint64_t count,
+               size_t bufferRecords)
+      : file_(&file), next_(first), left_(count),
+        capacity_(std::max<size_t>(1, bufferRecords)) {}
+
+  // Whether a record is left; then current() is valid.
+  bool valid() {
+    if (position_ == buffer_.size()) {
+      refill();
+    }
+    return position_ < buffer_.size();
+  }
+
+  const Record &current() const { return buffer_[position_]; }
+  void advance() { ++position_; }
+
+private:
+  void refill() {
+    size_t count = static_cast<size_t>(std::min<uint64_t>(capacity_, left_));
+    buffer_.resize(count);
+    position_ = 0;
+    if (count == 0) {
+      return;
+    }
+    file_->read(buffer_.data(), count * sizeof(Record),
+                next_ * sizeof(Record));
+    next_ += count;
+    left_ -= count;
+  }
+
+  const TempFile *file_;
+  uint64_t next_;
+  uint64_t left_;
+  size_t capacity_;
+  std::vector<Record> buffer_;
+  size_t position_ = 0;
+};
+
+// Sort of more records than fit in memory. Records are collected in a buffer
+// of bufferBytes; a full buffer is sorted and written to a temporary file as
+// a run, and forEach() merges the runs. When every record fits in the buffer
+// nothing is written. Less must order the records totally, so that the
+// result does not depend on where the runs are cut.
+template <typename Record, typename Less = std::less<Record>>
+class ExternalSorter {
+public:
+  ExternalSorter(const std::string &tmpDir, size_t bufferBytes,
+                 const Less &less = Less())
+      : tmpDir_(tmpDir), bufferBytes_(bufferBytes),
+        capacity_(std::max<size_t>(1, bufferBytes / sizeof(Record))),
+        less_(less) {}
+
+  void add(const Record &record) {
+    if (buffer_.capacity() == 0) {
+      buffer_.reserve(capacity_);
+    }
+    buffer_.push_back(record);
+    if (buffer_.size() == capacity_) {
+      spill();
+    }
+  }
+
+  uint64_t size() const { return spilled_ + buffer_.size(); }
+  size_t runs() const { return runs_.size(); }
+
+  // Call visit(record) for every record in sorted order. Consumes the
+  // records.
+  template <typename Visit> void forEach(const Visit &visit) {
+    if (runs_.empty()) {
+      std::sort(buffer_.begin(), buffer_.end(), less_);
+      for (const Record &record : buffer_) {
+        visit(record);
+      }
+      std::vector<Record>().swap(buffer_);
+      return;
+    }
+    if (!buffer_.empty()) {
+      spill();
+    }
+    std::vector<Record>().swap(buffer_);
+
+    // The merge buffers share the sort buffer's memory.
+    size_t runBytes =
+        std::max(kMinMergeBufferBytes, bufferBytes_ / runs_.size());
+    std::vector<RecordReader<Record>> readers;
+    for (const std::pair<uint64_t, uint64_t> &run : runs_) {
+      readers.emplace_back(*file_, run.first, run.second,
+                           runBytes / sizeof(Record));
+    }
+    // Min heap of the run heads; equal records come from the lower run
+    // first.
+    auto greater = [&](size_t a, size_t b) {
+      const Record &ra = readers[a].current();
+      const Record &rb = readers[b].current();
+      if (less_(rb, ra)) {
+        return true;
+      }
+      return !less_(ra, rb) && b < a;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heads(
+        greater);
+    for (size_t run = 0; run < readers.size(); ++run) {
+      if (readers[run].valid()) {
+        heads.push(run);
+      }
+    }
+    while (!heads.empty()) {
+      size_t run = heads.top();
+      heads.pop();
+      visit(readers[run].current());
+      readers[run].advance();
+      if (readers[run].valid()) {
+        heads.push(run);
+      }
+    }
+    runs_.clear();
+    file_.reset();
+    spilled_ = 0;
+  }
+
+private:
+  void spill() {
+    if (!file_) {
+      file_.reset(new TempFile(tmpDir_));
+    }
+    std::sort(buffer_.begin(), buffer_.end(), less_);
+    file_->write(buffer_.data(), buffer_.size() * sizeof(Record),
+                 spilled_ * sizeof(Record));
+    runs_.emplace_back(spilled_, buffer_.size());
+    spilled_ += buffer_.size();
+    buffer_.clear();
+  }
+
+  std::string tmpDir_;
+  size_t bufferBytes_;
+  size_t capacity_;
+  Less less_;
+  std::vector<Record> buffer_;
+  std::unique_ptr<TempFile> file_;
+  // First record and record count of every run.
+  std::vector<std::pair<uint64_t, uint64_t>> runs_;
+  uint64_t spilled_ = 0;
+};
+
+// Fixed size array in a memory mapped temporary file. The kernel pages it
+// out under memory pressure instead of the process running out of memory.
+template <typename T> class MappedArray {
+public:
+  MappedArray(const std::string &tmpDir, uint64_t size)
+      : file_(tmpDir), size_(size) {
+    if (size_ == 0) {
+      return;
+    }
+    uint64_t bytes = size_ * sizeof(T);
+    if (ftruncate(file_.fd(), static_cast<off_t>(bytes)) != 0) {
+      throw streamFileError("Could not size a temporary file");
+    }
+    void *mapped = mmap(nullptr, static_cast<size_t>(bytes),
+                        PROT_READ | PROT_WRITE, MAP_SHARED, file_.fd(), 0);
+    if (mapped == MAP_FAILED) {
+      throw streamFileError("Could not map a temporary file");
+    }
+    data_ = static_cast<T *>(mapped);
+  }
+
+  ~MappedArray() {
+    if (data_ != nullptr) {
+      munmap(data_, static_cast<size_t>(size_ * sizeof(T)));
+    }
+  }
+
+  MappedArray(const MappedArray &) = delete;
+  MappedArray &operator=(const MappedArray &) = delete;
+
+  uint64_t size() const { return size_; }
+  T &operator[](uint64_t i) { return data_[i]; }
+  const T &operator[](uint64_t i) const { return data_[i]; }
+
+private:
+  TempFile file_;
+  uint64_t size_;
+  T *data_ = nullptr;
+};
+
+// Union-find over a MappedArray. A root is linked under the smaller of the
+// two roots and find() halves the paths, so no rank array is needed and the
+// forest stays shallow enough for the few unions per vertex of a mesh.
+class MappedDisjointSet {
+public:
+  MappedDisjointSet(const std::string &tmpDir, uint32_t size)
+      : parent_(tmpDir, size) {
+    for (uint32_t v = 0; v < size; ++v) {
+      parent_[v] = v;
+    }
+  }
+
+  uint32_t find(uint32_t v) {
+    while (parent_[v] != v) {
+      parent_[v] = parent_[parent_[v]];
+      v = parent_[v];
+    }
+    return v;
+  }
+
+  void unite(uint32_t a, uint32_t b) {
+    a = find(a);
+    b = find(b);
+    if (a != b) {
+      parent_[std::max(a, b)] = std::min(a, b);
+    }
+  }
+
+  // Number of sets.
+  size_t countSets() const {
+    size_t count = 0;
+    for (uint64_t v = 0; v < parent_.size(); ++v) {
+      count += parent_[v] == v;
+    }
+    return count;
+  }
+
+private:
+  MappedArray<uint32_t> parent_;
+};
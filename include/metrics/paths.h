@@ -0,0 +1,126 @@
+#pragma once
+
+#include "cctype"
+#include "cerrno"
+#include "dirent.h"
+#include "fstream"
+#include "iostream"
+#include "set"
+#include "string"
+#include "sys/stat.h"
+#include "vector"
+
+// File names and folders of the tools. Nothing here needs CGAL, so
+// merge_results uses it without the mesh code.
+
+// Output folder suffixes, one folder per metric next to the input folder.
+// merge_results relies on these names.
+static const char *const kSegmentNumSuffix = "_segment_num";
+static const char *const kDanglingEdgeSuffix = "_dangling_edge";
+static const char *const kFluxEnclosureSuffix = "_flux_enclosure_error";
+static const char *const kSelfIntersectionSuffix = "_self_intersection";
+// Optional per-component sizes of SegE (--segment-stats).
+static const char *const kSegmentStatsSuffix = "_segment_stats";
+// Optional list of the dangling edges of DangEL (--boundary-edges).
+static const char *const kBoundaryEdgesSuffix = "_boundary_edges";
+// Content addressed result cache, see metrics/result_cache.h.
+static const char *const kMetricCacheSuffix = "_metric_cache.tsv";
+// Columnar results file, see metrics/results_file.h.
+static const char *const kResultsFileSuffix = "_results.bin";
+// Progress journal of a run, see metrics/run_journal.h.
+static const char *const kRunJournalSuffix = "_journal.tsv";
+
+inline std::string get_parent_path(const std::string &filepath) {
+  size_t found = filepath.find_last_of("/\\");
+  return (found != std::string::npos) ? filepath.substr(0, found) : "";
+}
+
+inline std::string get_filename(const std::string &filepath) {
+  size_t found = filepath.find_last_of("/\\");
+  return (found != std::string::npos) ? filepath.substr(found + 1) : filepath;
+}
+
+inline std::string replace_extension(const std::string &filename,
+                                     const std::string &new_extension) {
+  size_t found = filename.find_last_of(".");
+  return (found != std::string::npos)
+             ? filename.substr(0, found) + new_extension
+             : filename + new_extension;
+}
+
+inline void create_directories(const std::string &dirPath) {
+  if (mkdir(dirPath.c_str(), 0755) && errno != EEXIST) {
+    std::cerr << "Error creating directory: " << dirPath << std::endl;
+  }
+}
+
+inline bool fileExists(const std::string &filename) {
+  std::ifstream file(filename);
+  return file.good();
+}
+
+inline bool hasExtension(const std::string &filename, const std::string &ext) {
+  if (filename.size() < ext.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < ext.size(); ++i) {
+    char c = filename[filename.size() - ext.size() + i];
+    if (std::tolower(static_cast<unsigned char>(c)) != ext[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool isStlFile(const std::string &filename) {
+  return hasExtension(filename, ".stl");
+}
+
+inline bool isPlyFile(const std::string &filename) {
+  return hasExtension(filename, ".ply");
+}
+
+inline std::vector<std::string> list_directory(const std::string &dirPath) {
+  std::vector<std::string> filenames;
+  DIR *dir = opendir(dirPath.c_str());
+
+  if (dir == nullptr) {
+    std::cerr << "Error opening directory: " << dirPath << std::endl;
+    return filenames;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string filename(entry->d_name);
+    if (filename != "." && filename != "..") {
+      filenames.push_back(filename);
+    }
+  }
+
+  closedir(dir);
+  return filenames;
+}
+
+// Collect every .ply and .stl file of the directory as a full path. When both
+// mesh.ply and mesh.stl exist the .stl is taken as a leftover of the old
+// ply2stl.py conversion and only the .ply is kept.
+inline std::vector<std::string> list_mesh_files(std::string dirPath) {
+  std::vector<std::string> files = list_directory(dirPath);
+
+  std::set<std::string> plyStems;
+  for (const std::string &s : files) {
+    if (isPlyFile(s)) {
+      plyStems.insert(replace_extension(s, ""));
+    }
+  }
+
+  dirPath.push_back('/');
+  std::vector<std::string> meshFiles;
+  for (const std::string &s : files) {
+    if (isPlyFile(s) ||
+        (isStlFile(s) && !plyStems.count(replace_extension(s, "")))) {
+      meshFiles.push_back(dirPath + s);
+    }
+  }
+  return meshFiles;
+}
@@ -0,0 +1,496 @@
+#pragma once
+
+#include "algorithm"
+#include "cstdint"
+#include "unordered_set"
+#include "utility"
+#include "vector"
+
+#include "metrics/edge_count.h"
+#include "metrics/flat_mesh.h"
+#include "metrics/weld.h"
+#include "metrics/workspace.h"
+
+// Polygon soup repair and orientation of the flat mesh.
+//
+// CGAL's read_polygon_mesh(), which the metrics used to load through, does
+// three things to the soup before it builds the halfedge mesh, and the flat
+// kernels must see the mesh it built for SegE, DangEL and FluxEE to keep
+// their values:
+//
+// - repair_polygon_soup(): equal points are merged, degenerate polygons and
+//   unused points are dropped (the weld and compactFlatMesh() do these) and
+//   duplicate polygons are merged whatever their orientation, keeping the
+//   first one (removeDuplicateTriangles()).
+// - orient_polygon_soup(): the triangles are flipped to agree with their
+//   neighbours, which FluxEE depends on, and the vertices whose triangles
+//   form several fans (two shells touching at a vertex, the sides of an edge
+//   used by three or more triangles) get one copy per fan, which SegE and
+//   DangEL depend on (orientTriangleSoup()).
+// - is_polygon_soup_a_polygon_mesh(): a soup that still has an edge used
+//   twice in the same direction or a vertex with several fans is rejected
+//   (isPolygonMesh()).
+//
+// orientTriangleSoup() follows CGAL's Polygon_soup_orienter step by step,
+// seeds, traversal order and all, because which triangles get flipped and
+// which fan keeps the original vertex depend on them. Its edge map is
+// replaced by a vertex to triangle incidence table and a radix sorted array
+// of edge keys: the triangles with the edge (a, b) are one run of the array,
+// found by a binary search among the edges of the higher vertex, so a vertex
+// used by many triangles costs no more than a regular one.
+
+namespace polygon_soup_detail {
+
+inline void sortCorners(uint32_t corners[3]) {
+  if (corners[0] > corners[1]) {
+    std::swap(corners[0], corners[1]);
+  }
+  if (corners[1] > corners[2]) {
+    std::swap(corners[1], corners[2]);
+  }
+  if (corners[0] > corners[1]) {
+    std::swap(corners[0], corners[1]);
+  }
+}
+
+inline void sortedTriangle(const std::vector<uint32_t> &tris, size_t t,
+                           uint32_t corners[3]) {
+  for (size_t k = 0; k < 3; ++k) {
+    corners[k] = tris[3 * t + k];
+  }
+  sortCorners(corners);
+}
+
+static const uint32_t kNoTriangle = UINT32_MAX;
+
+// Triangles of a soup with their vertex incidence and edges. The triangles
+// of v are incident[offsets[v]] to incident[offsets[v + 1] - 1], in index
+// order. Every use of an edge (a, b), a < b, by a triangle t is the key
+// (b, slot of t among the triangles of a) of the sorted edges array, so the
+// uses of an edge are one run in triangle order, and the keys of b start at
+// edges[edgeOffsets[b]]. Flipping a triangle leaves the tables valid.
+class TriangleSoup {
+public:
+  TriangleSoup(std::vector<uint32_t> &tris, size_t numVertices,
+               Workspace &ws, size_t numThreads = 1)
+      : tris_(tris), offsets_(ws.incidenceOffsets),
+        incident_(ws.incidentTriangles), edges_(ws.keys),
+        edgeOffsets_(ws.edgeOffsets) {
+    offsets_.assign(numVertices + 1, 0);
+    for (uint32_t v : tris) {
+      ++offsets_[v + 1];
+    }
+    for (size_t v = 0; v < numVertices; ++v) {
+      offsets_[v + 1] += offsets_[v];
+    }
+    // offsets[v] serves as the fill position of v, which leaves it at the
+    // start of v + 1; the offsets are shifted back afterwards.
+    incident_.resize(tris.size());
+    for (size_t i = 0; i < tris.size(); ++i) {
+      incident_[offsets_[tris[i]]++] = static_cast<uint32_t>(i / 3);
+    }
+    for (size_t v = numVertices; v > 0; --v) {
+      offsets_[v] = offsets_[v - 1];
+    }
+    offsets_[0] = 0;
+
+    edges_.clear();
+    edges_.reserve(tris.size());
+    for (uint32_t a = 0; a < numVertices; ++a) {
+      for (uint32_t slot = offsets_[a]; slot < offsets_[a + 1]; ++slot) {
+        for (size_t k = 0; k < 3; ++k) {
+          uint32_t b = corner(incident_[slot], k);
+          if (b > a) {
+            edges_.push_back((static_cast<uint64_t>(b) << 32) | slot);
+          }
+        }
+      }
+    }
+    // The keys are made in slot order and the sort is stable, so sorting on
+    // the higher vertex alone sorts them.
+    radixSortKeys(edges_, ws.sortScratch, numThreads, 4);
+    edgeOffsets_.assign(numVertices + 1, 0);
+    for (uint64_t key : edges_) {
+      ++edgeOffsets_[(key >> 32) + 1];
+    }
+    for (size_t v = 0; v < numVertices; ++v) {
+      edgeOffsets_[v + 1] += edgeOffsets_[v];
+    }
+  }
+
+  size_t numTriangles() const { return tris_.size() / 3; }
+  uint32_t corner(uint32_t t, size_t k) const { return tris_[3 * t + k]; }
+
+  const uint32_t *begin(uint32_t v) const {
+    return incident_.data() + offsets_[v];
+  }
+  const uint32_t *end(uint32_t v) const {
+    return incident_.data() + offsets_[v + 1];
+  }
+  size_t degree(uint32_t v) const { return offsets_[v + 1] - offsets_[v]; }
+
+  // The corners before and after v in triangle t, which uses v.
+  uint32_t before(uint32_t t, uint32_t v) const {
+    return corner(t, (position(t, v) + 2) % 3);
+  }
+  uint32_t after(uint32_t t, uint32_t v) const {
+    return corner(t, (position(t, v) + 1) % 3);
+  }
+
+  // Number of triangles with the edge (a, b) in either direction.
+  size_t edgeUses(uint32_t a, uint32_t b) const {
+    const uint64_t *first;
+    const uint64_t *last;
+    edgeRun(a, b, first, last);
+    return static_cast<size_t>(last - first);
+  }
+
+  // The first triangle but skip with the directed edge (a, b).
+  uint32_t findEdge(uint32_t a, uint32_t b,
+                    uint32_t skip = kNoTriangle) const {
+    const uint64_t *first;
+    const uint64_t *last;
+    edgeRun(a, b, first, last);
+    for (const uint64_t *key = first; key != last; ++key) {
+      uint32_t t = incident_[static_cast<uint32_t>(*key)];
+      if (t != skip && after(t, a) == b) {
+        return t;
+      }
+    }
+    return kNoTriangle;
+  }
+
+  void flip(uint32_t t) { std::swap(tris_[3 * t], tris_[3 * t + 2]); }
+
+  void replace(uint32_t t, uint32_t from, uint32_t to) {
+    for (size_t k = 0; k < 3; ++k) {
+      if (tris_[3 * t + k] == from) {
+        tris_[3 * t + k] = to;
+      }
+    }
+  }
+
+private:
+  size_t position(uint32_t t, uint32_t v) const {
+    return corner(t, 0) == v ? 0 : corner(t, 1) == v ? 1 : 2;
+  }
+
+  // The keys of the uses of the edge (a, b): those of the higher vertex
+  // whose slot is one of the lower vertex.
+  void edgeRun(uint32_t a, uint32_t b, const uint64_t *&first,
+               const uint64_t *&last) const {
+    const uint32_t lower = std::min(a, b);
+    const uint64_t higher = std::max(a, b);
+    const uint64_t *keys = edges_.data();
+    first = std::lower_bound(keys + edgeOffsets_[higher],
+                             keys + edgeOffsets_[higher + 1],
+                             (higher << 32) | offsets_[lower]);
+    last = std::lower_bound(first, keys + edgeOffsets_[higher + 1],
+                            (higher << 32) | offsets_[lower + 1]);
+  }
+
+  std::vector<uint32_t> &tris_;
+  std::vector<uint32_t> &offsets_;
+  std::vector<uint32_t> &incident_;
+  std::vector<uint64_t> &edges_;
+  std::vector<uint32_t> &edgeOffsets_;
+};
+
+// Undirected edges the fan walks and the orientation do not cross, as
+// packEdgeKey() keys.
+class MarkedEdges {
+public:
+  bool contains(uint32_t a, uint32_t b) const {
+    return !keys_.empty() && keys_.count(packEdgeKey(a, b)) != 0;
+  }
+  void insert(uint32_t a, uint32_t b) { keys_.insert(packEdgeKey(a, b)); }
+
+private:
+  std::unordered_set<uint64_t> keys_;
+};
+
+// Mark the edges used by more than two triangles, as CGAL's fill_edge_map()
+// does.
+inline void markSharedEdges(const TriangleSoup &soup, size_t numVertices,
+                            MarkedEdges &marked) {
+  for (uint32_t a = 0; a < numVertices; ++a) {
+    if (soup.degree(a) < 3) {
+      continue;
+    }
+    for (const uint32_t *t = soup.begin(a); t != soup.end(a); ++t) {
+      uint32_t b = soup.after(*t, a);
+      if (soup.edgeUses(a, b) > 2) {
+        marked.insert(a, b);
+      }
+    }
+  }
+}
+
+// Flip triangles so that neighbours across unmarked edges agree: CGAL's
+// Polygon_soup_orienter::orient(). Every unoriented triangle of lowest index
+// seeds a depth first traversal; a neighbour using an edge in the same
+// direction is flipped unless it is already oriented, in which case the
+// edge is marked. Returns false when some edge had to be marked.
+inline bool orientTriangles(TriangleSoup &soup, MarkedEdges &marked,
+                            Workspace &ws) {
+  const size_t n = soup.numTriangles();
+  std::vector<uint8_t> &oriented = ws.flags;
+  oriented.assign(n, 0);
+  std::vector<uint32_t> &stack = ws.remap;
+  stack.clear();
+  bool orientable = true;
+  for (uint32_t seed = 0; seed < n; ++seed) {
+    if (oriented[seed]) {
+      continue;
+    }
+    oriented[seed] = 1;
+    stack.push_back(seed);
+    while (!stack.empty()) {
+      uint32_t t = stack.back();
+      stack.pop_back();
+      for (size_t k = 0; k < 3; ++k) {
+        uint32_t a = soup.corner(t, k);
+        uint32_t b = soup.corner(t, (k + 1) % 3);
+        if (marked.contains(a, b)) {
+          continue;
+        }
+        uint32_t same = soup.findEdge(a, b, t);
+        if (same != kNoTriangle) {
+          if (oriented[same]) {
+            orientable = false;
+            marked.insert(a, b);
+          } else {
+            soup.flip(same);
+            oriented[same] = 1;
+            stack.push_back(same);
+          }
+          continue;
+        }
+        uint32_t other = soup.findEdge(b, a);
+        if (other != kNoTriangle && !oriented[other]) {
+          oriented[other] = 1;
+          stack.push_back(other);
+        }
+      }
+    }
+  }
+  return orientable;
+}
+
+// Call visit(t) for the triangles of the fan around v that triangle start
+// belongs to, other than start, walking across unmarked edges the way CGAL's
+// duplicate_singular_vertices() does: clockwise until the walk is back at
+// start, and from start counterclockwise when it met a border.
+template <typename Visit>
+void walkFan(const TriangleSoup &soup, const MarkedEdges &marked, uint32_t v,
+             uint32_t start, const Visit &visit) {
+  // A walk takes at most one step per triangle of v, even on the soups
+  // CGAL only asserts against.
+  const size_t maxSteps = soup.degree(v);
+  const uint32_t prev = soup.before(start, v);
+  uint32_t next = soup.after(start, v);
+  bool border = false;
+  for (size_t step = 0; step < maxSteps; ++step) {
+    uint32_t t =
+        marked.contains(v, next) ? kNoTriangle : soup.findEdge(next, v);
+    if (t == kNoTriangle) {
+      border = true;
+      break;
+    }
+    next = soup.after(t, v);
+    visit(t);
+    if (next == prev) {
+      break;
+    }
+  }
+  if (!border) {
+    return;
+  }
+  next = prev;
+  for (size_t step = 0; step < maxSteps; ++step) {
+    uint32_t t =
+        marked.contains(next, v) ? kNoTriangle : soup.findEdge(v, next);
+    if (t == kNoTriangle) {
+      break;
+    }
+    next = soup.before(t, v);
+    visit(t);
+  }
+}
+
+// Call fan(v, first, last) for every fan of every vertex but the first one
+// of the vertex, the fans of a vertex in the order of their lowest
+// triangle. first to last are the triangles of the fan in walk order.
+template <typename Fan>
+void forEachExtraFan(const TriangleSoup &soup, const MarkedEdges &marked,
+                     size_t numVertices, Workspace &ws, const Fan &fan) {
+  // visited[t] is v + 1 once a fan of v went through t.
+  std::vector<uint32_t> &visited = ws.slots;
+  visited.assign(soup.numTriangles(), 0);
+  std::vector<uint32_t> triangles;
+  for (uint32_t v = 0; v < numVertices; ++v) {
+    bool firstFan = true;
+    for (const uint32_t *t = soup.begin(v); t != soup.end(v); ++t) {
+      if (visited[*t] == v + 1) {
+        continue;
+      }
+      visited[*t] = v + 1;
+      triangles.assign(1, *t);
+      walkFan(soup, marked, v, *t, [&](uint32_t other) {
+        visited[other] = v + 1;
+        triangles.push_back(other);
+      });
+      if (!firstFan) {
+        fan(v, triangles.data(), triangles.data() + triangles.size());
+      }
+      firstFan = false;
+    }
+  }
+}
+
+} // namespace polygon_soup_detail
+
+// Drop every triangle that has the same three corners as an earlier one, in
+// either orientation. The (hash, triangle) keys are radix sorted on the hash
+// like the cell keys of the weld, so the triangles of a run stay in index
+// order and the first of a set of duplicates is the one kept. Returns the
+// number of triangles dropped.
+inline size_t removeDuplicateTriangles(FlatMesh &mesh, size_t numThreads = 1,
+                                       Workspace *workspace = nullptr) {
+  using namespace polygon_soup_detail;
+  using weld_detail::keyHash;
+  using weld_detail::keyVertex;
+  const size_t n = mesh.numTriangles();
+  if (n < 2) {
+    return 0;
+  }
+  Workspace local;
+  Workspace &ws = workspace != nullptr ? *workspace : local;
+  std::vector<uint32_t> &tris = mesh.triangles;
+
+  std::vector<uint64_t> &keys = ws.keys;
+  keys.resize(n);
+  for (size_t t = 0; t < n; ++t) {
+    uint32_t corners[3];
+    sortedTriangle(tris, t, corners);
+    uint32_t hash =
+        weld_detail::hashTriple(corners[0], corners[1], corners[2]);
+    keys[t] = (static_cast<uint64_t>(hash) << 32) | static_cast<uint32_t>(t);
+  }
+  radixSortKeys(keys, ws.sortScratch, numThreads, 4);
+
+  std::vector<uint8_t> &dropped = ws.flags;
+  dropped.assign(n, 0);
+  size_t numDropped = 0;
+  for (size_t i = 0; i < n;) {
+    size_t run = i + 1;
+    while (run < n && keyHash(keys[run]) == keyHash(keys[i])) {
+      ++run;
+    }
+    // Runs hold one triangle unless the triangle is repeated or hashes
+    // collide.
+    for (size_t j = i; j + 1 < run; ++j) {
+      uint32_t first = keyVertex(keys[j]);
+      if (dropped[first]) {
+        continue;
+      }
+      uint32_t a[3];
+      sortedTriangle(tris, first, a);
+      for (size_t k = j + 1; k < run; ++k) {
+        uint32_t other = keyVertex(keys[k]);
+        uint32_t b[3];
+        sortedTriangle(tris, other, b);
+        if (!dropped[other] && std::equal(a, a + 3, b)) {
+          dropped[other] = 1;
+          ++numDropped;
+        }
+      }
+    }
+    i = run;
+  }
+  if (numDropped == 0) {
+    return 0;
+  }
+
+  size_t kept = 0;
+  for (size_t t = 0; t < n; ++t) {
+    if (!dropped[t]) {
+      for (size_t k = 0; k < 3; ++k) {
+        tris[3 * kept + k] = tris[3 * t + k];
+      }
+      ++kept;
+    }
+  }
+  tris.resize(3 * kept);
+  return numDropped;
+}
+
+// Whether the triangles form a polygon mesh: no directed edge is used twice
+// and the triangles of every vertex form one fan. This is CGAL's
+// is_polygon_soup_a_polygon_mesh(), a precondition of building a halfedge
+// mesh.
+inline bool isPolygonMesh(FlatMesh &mesh, size_t numThreads = 1,
+                          Workspace *workspace = nullptr) {
+  using namespace polygon_soup_detail;
+  Workspace local;
+  Workspace &ws = workspace != nullptr ? *workspace : local;
+  TriangleSoup soup(mesh.triangles, mesh.numVertices(), ws, numThreads);
+  // Every directed edge (a, b) is found from a.
+  for (uint32_t a = 0; a < mesh.numVertices(); ++a) {
+    for (const uint32_t *t = soup.begin(a); t != soup.end(a); ++t) {
+      if (soup.findEdge(a, soup.after(*t, a), *t) != kNoTriangle) {
+        return false;
+      }
+    }
+  }
+  bool oneFan = true;
+  forEachExtraFan(soup, MarkedEdges(), mesh.numVertices(), ws,
+                  [&](uint32_t, const uint32_t *, const uint32_t *) {
+                    oneFan = false;
+                  });
+  return oneFan;
+}
+
+// Orient the triangles and split the vertices whose triangles form several
+// fans, as CGAL's orient_polygon_soup() does: edges used by more than two
+// triangles and edges across which the orientation conflicts are cut, and
+// every fan of a vertex but the one of its lowest triangle gets a copy of
+// the vertex, appended in vertex order. Run it on a repaired soup (see
+// cleanFlatMesh()). Returns whether the result is a polygon mesh, like
+// read_polygon_mesh() checks next; the metrics reject meshes that are not.
+inline bool orientTriangleSoup(FlatMesh &mesh, size_t numThreads = 1,
+                               Workspace *workspace = nullptr) {
+  using namespace polygon_soup_detail;
+  Workspace local;
+  Workspace &ws = workspace != nullptr ? *workspace : local;
+  const size_t numVertices = mesh.numVertices();
+
+  TriangleSoup soup(mesh.triangles, numVertices, ws, numThreads);
+  MarkedEdges marked;
+  markSharedEdges(soup, numVertices, marked);
+  // Whether the soup was orientable only matters to the final check.
+  orientTriangles(soup, marked, ws);
+
+  // The copies are made after every vertex was walked, so the walks see the
+  // original corners.
+  std::vector<uint32_t> splitVertices;
+  std::vector<size_t> splitEnds;
+  std::vector<uint32_t> splitTriangles;
+  forEachExtraFan(soup, marked, numVertices, ws,
+                  [&](uint32_t v, const uint32_t *first, const uint32_t *last) {
+                    splitVertices.push_back(v);
+                    splitTriangles.insert(splitTriangles.end(), first, last);
+                    splitEnds.push_back(splitTriangles.size());
+                  });
+  size_t begin = 0;
+  for (size_t i = 0; i < splitVertices.size(); ++i) {
+    const uint32_t v = splitVertices[i];
+    const uint32_t copy = static_cast<uint32_t>(mesh.numVertices());
+    mesh.addVertex(mesh.x[v], mesh.y[v], mesh.z[v]);
+    for (size_t j = begin; j < splitEnds[i]; ++j) {
+      soup.replace(splitTriangles[j], v, copy);
+    }
+    begin = splitEnds[i];
+  }
+  return isPolygonMesh(mesh, numThreads, &ws);
+}
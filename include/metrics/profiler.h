@@ -0,0 +1,218 @@
+#pragma once
+
+#include "chrono"
+#include "cmath"
+#include "cstdint"
+#include "cstdio"
+#include "fstream"
+#include "iostream"
+#include "string"
+#include "sys/resource.h"
+#include "vector"
+
+#include "metrics/json.h"
+
+// Per-mesh, per-stage timings of a run (--profile).
+//
+// Every worker appends its samples to its own ProfileLog, so recording takes
+// no lock; the logs are only read once the workers have joined. With
+// profiling off the workers get no log and StageTimer does nothing.
+
+enum ProfileStage {
+  kStageLoad = 0,
+  // Surface_mesh construction for SIR.
+  kStageBuild,
+  kStageSegment,
+  kStageDangling,
+  kStageFlux,
+  kStageSelfIntersection,
+  // The file passes and external sorts of --stream, which load and evaluate
+  // in one go.
+  kStageStream,
+  // Text files, results file and cache.
+  kStageOutput,
+  kNumProfileStages
+};
+
+static const char *const kProfileStageNames[kNumProfileStages] = {
+    "load", "build", "segment", "dangling", "flux", "self_intersection",
+    "stream", "output"};
+
+struct StageSample {
+  std::string mesh;
+  ProfileStage stage = kStageLoad;
+  double seconds = 0.0;
+  uint64_t faces = 0;
+  uint64_t vertices = 0;
+  // Growth of the process peak RSS during the stage. The peak is shared by
+  // all threads, so with several workers this is an upper bound of what the
+  // stage itself needed.
+  int64_t peakRssDeltaKb = 0;
+  // SIR: intersecting face pairs.
+  uint64_t pairs = 0;
+};
+
+typedef std::vector<StageSample> ProfileLog;
+
+// Peak resident set size of the process in KiB.
+inline int64_t peakRssKb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return static_cast<int64_t>(usage.ru_maxrss);
+}
+
+// Times one stage of one mesh and appends the sample to log when it goes out
+// of scope. A null log disables it.
+class StageTimer {
+public:
+  StageTimer(ProfileLog *log, ProfileStage stage, const std::string &mesh)
+      : log_(log) {
+    if (log_ == nullptr) {
+      return;
+    }
+    sample_.mesh = mesh;
+    sample_.stage = stage;
+    startRss_ = peakRssKb();
+    start_ = std::chrono::steady_clock::now();
+  }
+
+  ~StageTimer() {
+    if (log_ == nullptr) {
+      return;
+    }
+    sample_.seconds = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start_)
+                          .count();
+    sample_.peakRssDeltaKb = peakRssKb() - startRss_;
+    log_->push_back(sample_);
+  }
+
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+
+  void setCounts(size_t faces, size_t vertices) {
+    sample_.faces = faces;
+    sample_.vertices = vertices;
+  }
+
+  void setPairs(size_t pairs) { sample_.pairs = pairs; }
+
+private:
+  ProfileLog *log_;
+  StageSample sample_;
+  int64_t startRss_ = 0;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// One log per worker, indexed by the worker index of runWorkers.
+class Profiler {
+public:
+  Profiler(size_t numWorkers, bool enabled)
+      : logs_(enabled ? numWorkers : 0) {}
+
+  ProfileLog *log(size_t worker) {
+    return worker < logs_.size() ? &logs_[worker] : nullptr;
+  }
+
+  // Write the samples to path, as CSV when it ends in .csv and as JSON
+  // otherwise. Call after the workers have joined.
+  bool write(const std::string &path) const {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+      std::cerr << "Error: Could not open " << path << std::endl;
+      return false;
+    }
+    bool csv =
+        path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    if (csv) {
+      writeCsv(out);
+    } else {
+      writeJson(out);
+    }
+    std::cout << "Profile saved to: " << path << std::endl;
+    return true;
+  }
+
+private:
+  static std::string number(double value) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.9g", value);
+    return text;
+  }
+
+  static std::string csvString(const std::string &text) {
+    if (text.find_first_of(",\"\n") == std::string::npos) {
+      return text;
+    }
+    std::string quoted = "\"";
+    for (char c : text) {
+      quoted += c;
+      if (c == '"') {
+        quoted += '"';
+      }
+    }
+    return quoted + "\"";
+  }
+
+  void writeCsv(std::ostream &out) const {
+    out << "mesh,stage,seconds,faces,vertices,peak_rss_delta_kb,pairs\n";
+    for (const ProfileLog &log : logs_) {
+      for (const StageSample &s : log) {
+        out << csvString(s.mesh) << ',' << kProfileStageNames[s.stage] << ','
+            << number(s.seconds) << ',' << s.faces << ',' << s.vertices << ','
+            << s.peakRssDeltaKb << ',' << s.pairs << '\n';
+      }
+    }
+  }
+
+  void writeJson(std::ostream &out) const {
+    // Per stage totals first, they tell which stage dominates the run.
+    size_t count[kNumProfileStages] = {};
+    double total[kNumProfileStages] = {};
+    double slowest[kNumProfileStages] = {};
+    std::string slowestMesh[kNumProfileStages];
+    for (const ProfileLog &log : logs_) {
+      for (const StageSample &s : log) {
+        count[s.stage] += 1;
+        total[s.stage] += s.seconds;
+        if (s.seconds >= slowest[s.stage]) {
+          slowest[s.stage] = s.seconds;
+          slowestMesh[s.stage] = s.mesh;
+        }
+      }
+    }
+
+    out << "{\n    \"summary\": {\n";
+    bool first = true;
+    for (int stage = 0; stage < kNumProfileStages; ++stage) {
+      if (count[stage] == 0) {
+        continue;
+      }
+      out << (first ? "" : ",\n") << "        \""
+          << kProfileStageNames[stage] << "\": {\"count\": " << count[stage]
+          << ", \"total_seconds\": " << number(total[stage])
+          << ", \"max_seconds\": " << number(slowest[stage])
+          << ", \"slowest_mesh\": " << jsonString(slowestMesh[stage]) << "}";
+      first = false;
+    }
+    out << "\n    },\n    \"samples\": [\n";
+    first = true;
+    for (const ProfileLog &log : logs_) {
+      for (const StageSample &s : log) {
+        out << (first ? "" : ",\n") << "        {\"mesh\": "
+            << jsonString(s.mesh) << ", \"stage\": \""
+            << kProfileStageNames[s.stage]
+            << "\", \"seconds\": " << number(s.seconds)
+            << ", \"faces\": " << s.faces << ", \"vertices\": " << s.vertices
+            << ", \"peak_rss_delta_kb\": " << s.peakRssDeltaKb
+            << ", \"pairs\": " << s.pairs << "}";
+        first = false;
+      }
+    }
+    out << "\n    ]\n}\n";
+  }
+
+  std::vector<ProfileLog> logs_;
+};
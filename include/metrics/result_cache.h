@@ -0,0 +1,398 @@
+#pragma once
+
+#include "cstdint"
+#include "cstdio"
+#include "cstring"
+#include "fstream"
+#include "iostream"
+#include "iterator"
+#include "mutex"
+#include "string"
+#include "sys/file.h"
+#include "sys/stat.h"
+#include "unistd.h"
+#include "unordered_map"
+#include "unordered_set"
+#include "utility"
+#include "vector"
+
+#include "metrics/mapped_file.h"
+
+// Persistent metric results keyed by the content of the mesh file.
+//
+// Every entry maps (content hash, metric id) to the text written into the
+// metric output file. The metric id carries a version number that is bumped
+// whenever a kernel changes its result, which invalidates the old entries. A
+// regenerated mesh gets a new hash and misses the cache, so its outputs are
+// recomputed; unchanged meshes are not loaded at all.
+//
+// The cache is an append-only text file next to the mesh folder
+// (<dir>_metric_cache.tsv); the last entry for a key wins. To avoid reading
+// unchanged files again, it also remembers the hash of every path together
+// with its size and modification time.
+//
+// Superseded entries, and results of content no path has any more, are
+// dropped when the file is opened: once they make up half of the lines the
+// live entries are written to a temporary file that is renamed over the
+// cache. Every process holds a shared lock on the cache while it has it
+// open, and only one that can lock it exclusively, so no other process
+// appends to it, compacts it.
+
+// XXH64 of a byte range.
+inline uint64_t contentHash(const char *data, size_t size,
+                            uint64_t seed = 0) {
+  const uint64_t p1 = 0x9E3779B185EBCA87ull;
+  const uint64_t p2 = 0xC2B2AE3D27D4EB4Full;
+  const uint64_t p3 = 0x165667B19E3779F9ull;
+  const uint64_t p4 = 0x85EBCA77C2B2AE63ull;
+  const uint64_t p5 = 0x27D4EB2F165667C5ull;
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  auto read64 = [](const char *p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+  };
+  auto read32 = [](const char *p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return static_cast<uint64_t>(v);
+  };
+  auto round = [&](uint64_t acc, uint64_t input) {
+    acc += input * p2;
+    acc = rotl(acc, 31);
+    return acc * p1;
+  };
+  auto mergeRound = [&](uint64_t acc, uint64_t value) {
+    acc ^= round(0, value);
+    return acc * p1 + p4;
+  };
+
+  const char *p = data;
+  const char *end = data + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = seed + p1 + p2;
+    uint64_t v2 = seed + p2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - p1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = mergeRound(h, v1);
+    h = mergeRound(h, v2);
+    h = mergeRound(h, v3);
+    h = mergeRound(h, v4);
+  } else {
+    h = seed + p5;
+  }
+  h += static_cast<uint64_t>(size);
+  for (; p + 8 <= end; p += 8) {
+    h ^= round(0, read64(p));
+    h = rotl(h, 27) * p1 + p4;
+  }
+  if (p + 4 <= end) {
+    h ^= read32(p) * p1;
+    h = rotl(h, 23) * p2 + p3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= static_cast<uint64_t>(static_cast<unsigned char>(*p)) * p5;
+    h = rotl(h, 11) * p1;
+  }
+  h ^= h >> 33;
+  h *= p2;
+  h ^= h >> 29;
+  h *= p3;
+  h ^= h >> 32;
+  return h;
+}
+
+// Entries are single tab separated lines, so newlines and tabs in a field
+// are escaped.
+inline std::string escapeField(const std::string &text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '\\') {
+      escaped += "\\\\";
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else if (c == '\t') {
+      escaped += "\\t";
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+inline std::string unescapeField(const std::string &text) {
+  std::string plain;
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] == '\\' && i + 1 < text.size()) {
+      char next = text[++i];
+      plain += next == 'n' ? '\n' : next == 't' ? '\t' : next;
+    } else {
+      plain += text[i];
+    }
+  }
+  return plain;
+}
+
+inline std::vector<std::string> splitFields(const std::string &line) {
+  std::vector<std::string> fields;
+  size_t start = 0;
+  while (true) {
+    size_t tab = line.find('\t', start);
+    fields.push_back(line.substr(start, tab - start));
+    if (tab == std::string::npos) {
+      break;
+    }
+    start = tab + 1;
+  }
+  return fields;
+}
+
+// Size and modification time of a file, "" when it does not exist.
+inline std::string fileStamp(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return "";
+  }
+  return std::to_string(st.st_size) + ":" +
+         std::to_string(st.st_mtim.tv_sec) + "." +
+         std::to_string(st.st_mtim.tv_nsec);
+}
+
+// Read the newline terminated lines of an append-only log. An incomplete
+// last line is skipped; with repair, which needs the only lock on the file,
+// it is also cut off, since it was left by a crash and new lines must start
+// cleanly. Under a shared lock it may be a line another process is writing.
+inline std::vector<std::string> readLogLines(const std::string &path,
+                                             bool repair) {
+  std::vector<std::string> lines;
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) {
+    return lines;
+  }
+  std::string text((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+  size_t start = 0;
+  size_t end;
+  while ((end = text.find('\n', start)) != std::string::npos) {
+    lines.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  if (repair && start < text.size() && truncate(path.c_str(), start) != 0) {
+    std::cerr << "Error: Could not repair " << path << std::endl;
+  }
+  return lines;
+}
+
+class ResultCache {
+public:
+  // An empty path disables the cache: lookups miss and stores are dropped.
+  explicit ResultCache(const std::string &cachePath) : path_(cachePath) {
+    if (!path_.empty()) {
+      open();
+    }
+  }
+
+  ~ResultCache() {
+    if (out_ != nullptr) {
+      std::fclose(out_);
+    }
+  }
+
+  ResultCache(const ResultCache &) = delete;
+  ResultCache &operator=(const ResultCache &) = delete;
+
+  bool enabled() const { return out_ != nullptr; }
+
+  // Content key of a mesh file, empty when the file can not be read. Files
+  // whose size and modification time did not change since they were hashed
+  // are not read again.
+  std::string contentKey(const std::string &meshPath) {
+    if (!enabled()) {
+      return "";
+    }
+    std::string stamp = fileStamp(meshPath);
+    if (stamp.empty()) {
+      return "";
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto found = files_.find(meshPath);
+      if (found != files_.end() && found->second.first == stamp) {
+        return found->second.second;
+      }
+    }
+    MappedFile file(meshPath);
+    if (!file.valid()) {
+      return "";
+    }
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx",
+                  static_cast<unsigned long long>(
+                      contentHash(file.data(), file.size())));
+    std::string key(hex);
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_[meshPath] = std::make_pair(stamp, key);
+    appendLine(out_, fileLine(meshPath, stamp, key));
+    return key;
+  }
+
+  bool lookup(const std::string &key, const std::string &metric,
+              std::string &content) {
+    if (key.empty()) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = results_.find(key + "\t" + metric);
+    if (found == results_.end()) {
+      return false;
+    }
+    content = found->second;
+    return true;
+  }
+
+  void store(const std::string &key, const std::string &metric,
+             const std::string &content) {
+    if (key.empty()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    results_[key + "\t" + metric] = content;
+    appendLine(out_, resultLine(key + "\t" + metric, content));
+  }
+
+private:
+  // Open the file for appending and load its entries, compacting it when
+  // this is the only process using it.
+  void open() {
+    bool exclusive = false;
+    while (true) {
+      out_ = std::fopen(path_.c_str(), "a");
+      if (out_ == nullptr) {
+        std::cerr << "Error: Could not open cache " << path_ << std::endl;
+        return;
+      }
+      int fd = fileno(out_);
+      exclusive = flock(fd, LOCK_EX | LOCK_NB) == 0;
+      if (!exclusive) {
+        flock(fd, LOCK_SH);
+      }
+      // Another process may have renamed a compacted file over the one
+      // opened here while this one waited for the lock.
+      if (isCurrentFile(fd)) {
+        break;
+      }
+      std::fclose(out_);
+    }
+    std::vector<std::string> lines = readLogLines(path_, exclusive);
+    for (const std::string &line : lines) {
+      parseLine(line);
+    }
+    if (exclusive) {
+      compact(lines.size());
+      flock(fileno(out_), LOCK_SH);
+    }
+  }
+
+  bool isCurrentFile(int fd) const {
+    struct stat opened;
+    struct stat current;
+    return fstat(fd, &opened) == 0 && stat(path_.c_str(), &current) == 0 &&
+           opened.st_dev == current.st_dev && opened.st_ino == current.st_ino;
+  }
+
+  // Drop the results of content keys no path maps to, and rewrite the file
+  // when it has at least as many stale lines as live entries. Called with
+  // the file locked exclusively.
+  void compact(size_t numLines) {
+    std::unordered_set<std::string> liveKeys;
+    for (const auto &file : files_) {
+      liveKeys.insert(file.second.second);
+    }
+    for (auto result = results_.begin(); result != results_.end();) {
+      const std::string &entry = result->first;
+      if (liveKeys.count(entry.substr(0, entry.find('\t'))) == 0) {
+        result = results_.erase(result);
+      } else {
+        ++result;
+      }
+    }
+    const size_t live = files_.size() + results_.size();
+    if (numLines - live < live || numLines == live) {
+      return;
+    }
+
+    // The new file is locked before it replaces the old one, so no other
+    // process compacts it in between.
+    std::string tempPath = path_ + ".tmp";
+    std::remove(tempPath.c_str());
+    std::FILE *temp = std::fopen(tempPath.c_str(), "a");
+    if (temp == nullptr) {
+      std::cerr << "Error: Could not compact cache " << path_ << std::endl;
+      return;
+    }
+    flock(fileno(temp), LOCK_SH);
+    for (const auto &file : files_) {
+      appendLine(temp, fileLine(file.first, file.second.first,
+                                file.second.second));
+    }
+    for (const auto &result : results_) {
+      appendLine(temp, resultLine(result.first, result.second));
+    }
+    if (std::ferror(temp) != 0 ||
+        std::rename(tempPath.c_str(), path_.c_str()) != 0) {
+      std::cerr << "Error: Could not compact cache " << path_ << std::endl;
+      std::fclose(temp);
+      std::remove(tempPath.c_str());
+      return;
+    }
+    std::fclose(out_);
+    out_ = temp;
+  }
+
+  static std::string fileLine(const std::string &meshPath,
+                              const std::string &stamp,
+                              const std::string &key) {
+    return "F\t" + escapeField(meshPath) + "\t" + stamp + "\t" + key;
+  }
+
+  // entry is the content key and the metric id joined by a tab.
+  static std::string resultLine(const std::string &entry,
+                                const std::string &content) {
+    return "R\t" + entry + "\t" + escapeField(content);
+  }
+
+  void parseLine(const std::string &line) {
+    std::vector<std::string> fields = splitFields(line);
+    // Lines with an unexpected layout are ignored.
+    if (fields[0] == "F" && fields.size() == 4) {
+      files_[unescapeField(fields[1])] = std::make_pair(fields[2], fields[3]);
+    } else if (fields[0] == "R" && fields.size() == 4) {
+      results_[fields[1] + "\t" + fields[2]] = unescapeField(fields[3]);
+    }
+  }
+
+  static void appendLine(std::FILE *out, const std::string &line) {
+    if (out == nullptr) {
+      return;
+    }
+    std::fputs((line + "\n").c_str(), out);
+    std::fflush(out);
+  }
+
+  std::string path_;
+  std::FILE *out_ = nullptr;
+  std::mutex mutex_;
+  // path -> (size:mtime, content key)
+  std::unordered_map<std::string, std::pair<std::string, std::string>> files_;
+  // content key \t metric id -> output text
+  std::unordered_map<std::string, std::string> results_;
+};
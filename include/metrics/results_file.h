@@ -0,0 +1,429 @@
+#pragma once
+
+#include "algorithm"
+#include "cmath"
+#include "cstdint"
+#include "cstdlib"
+#include "cstring"
+#include "fcntl.h"
+#include "iostream"
+#include "limits"
+#include "mutex"
+#include "string"
+#include "sys/file.h"
+#include "sys/stat.h"
+#include "unistd.h"
+#include "vector"
+
+#include "metrics/mapped_file.h"
+
+// Single append-only results file holding every metric of every mesh.
+//
+// The file starts with a header and is followed by blocks of rows. Each block
+// stores its rows column by column:
+//
+//   header: "CADMRES1" | uint32 version | uint32 number of metric columns
+//   block:  uint32 kResultsBlockMagic | uint32 rows | uint64 payload bytes
+//           mesh ids   (rows NUL terminated strings)
+//           faces      (uint64 x rows)
+//           values     (double x rows, per metric column)
+//           seconds    (double x rows, per metric column)
+//           status     (uint8 x rows, per metric column)
+//
+// Values are native endian. A block cut short by a crash is ignored by the
+// reader and cut off when the file is opened for appending again, so the
+// blocks of a resumed run follow the last complete one. A mesh evaluated
+// again, or by several per-metric tools, has several rows; readers take
+// each metric from the last row whose status for it is not kStatusNotRun.
+
+enum MetricColumn {
+  kSegmentColumn = 0,
+  kDanglingColumn,
+  kFluxColumn,
+  kSelfIntersectionColumn,
+  kNumMetricColumns
+};
+
+static const char *const kMetricColumnNames[kNumMetricColumns] = {
+    "segment_num", "dangling_edge_length", "flux_enclosure_error",
+    "self_intersection_ratio"};
+
+enum MetricStatus : uint8_t {
+  kStatusNotRun = 0,
+  kStatusOk = 1,
+  // Restored from the result cache.
+  kStatusCached = 2,
+  kStatusFailed = 3,
+  kStatusLoadFailed = 4,
+  // Killed by the supervisor (--timeout), or out of its --memory-limit.
+  kStatusTimeout = 5,
+  kStatusOutOfMemory = 6,
+};
+
+inline bool metricStatusHasValue(uint8_t status) {
+  return status == kStatusOk || status == kStatusCached;
+}
+
+inline const char *metricStatusName(uint8_t status) {
+  switch (status) {
+  case kStatusNotRun:
+    return "not_run";
+  case kStatusOk:
+    return "ok";
+  case kStatusCached:
+    return "cached";
+  case kStatusFailed:
+    return "failed";
+  case kStatusLoadFailed:
+    return "load_failed";
+  case kStatusTimeout:
+    return "timeout";
+  case kStatusOutOfMemory:
+    return "out_of_memory";
+  }
+  return "unknown";
+}
+
+struct MetricRecord {
+  // File name without directory and extensions.
+  std::string meshId;
+  // Triangles of the loaded mesh, 0 when it was not loaded.
+  uint64_t faces = 0;
+  double value[kNumMetricColumns];
+  double seconds[kNumMetricColumns];
+  uint8_t status[kNumMetricColumns];
+
+  MetricRecord() {
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      value[c] = std::numeric_limits<double>::quiet_NaN();
+      seconds[c] = 0.0;
+      status[c] = kStatusNotRun;
+    }
+  }
+};
+
+static const char kResultsFileMagic[8] = {'C', 'A', 'D', 'M',
+                                          'R', 'E', 'S', '1'};
+static const uint32_t kResultsFileVersion = 1;
+static const uint32_t kResultsBlockMagic = 0x4b4c4252; // "RBLK"
+static const size_t kResultsHeaderBytes =
+    sizeof(kResultsFileMagic) + 2 * sizeof(uint32_t);
+static const size_t kResultsBlockHeaderBytes =
+    2 * sizeof(uint32_t) + sizeof(uint64_t);
+// Rows a worker buffers before it appends a block.
+static const size_t kResultsBatchRows = 1024;
+
+// Mesh id used to join the results of one mesh: "dir/abc.ply" -> "abc".
+inline std::string meshIdOf(const std::string &path) {
+  std::string name = path.substr(path.find_last_of('/') + 1);
+  return name.substr(0, name.find('.'));
+}
+
+// Parse the text written to the output file of a metric column. Returns
+// false when the text is malformed; "nan" parses as NaN. SIR is the ratio of
+// its two lines and fails for a mesh without faces.
+inline bool parseMetricValue(MetricColumn column, const std::string &content,
+                             double &value) {
+  const char *text = content.c_str();
+  char *end = nullptr;
+  value = std::strtod(text, &end);
+  if (end == text) {
+    return false;
+  }
+  if (column == kSelfIntersectionColumn) {
+    // "<intersecting faces>\n<faces>"
+    const char *facesText = end;
+    double faces = std::strtod(facesText, &end);
+    if (end == facesText || faces == 0.0) {
+      return false;
+    }
+    value /= faces;
+  }
+  return true;
+}
+
+inline double metricValueFromText(MetricColumn column,
+                                  const std::string &content) {
+  double value;
+  if (!parseMetricValue(column, content, value)) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  return value;
+}
+
+// Check the header of a results file. Returns false, with the reason in
+// error, when it is not a results file this version reads.
+inline bool checkResultsHeader(const char *data, size_t size,
+                               std::string &error) {
+  if (size < kResultsHeaderBytes ||
+      std::memcmp(data, kResultsFileMagic, sizeof(kResultsFileMagic)) != 0) {
+    error = "is not a results file";
+    return false;
+  }
+  uint32_t numColumns;
+  std::memcpy(&numColumns, data + sizeof(kResultsFileMagic) + 4, 4);
+  if (numColumns != kNumMetricColumns) {
+    error = "is an unsupported results file";
+    return false;
+  }
+  return true;
+}
+
+// Walk the blocks after the header and append their rows to records when
+// it is not null. Returns the end offset of the last complete block; what
+// follows it was cut short by a crash.
+inline size_t decodeResultsBlocks(const char *data, size_t size,
+                                  std::vector<MetricRecord> *records) {
+  size_t offset = kResultsHeaderBytes;
+  while (offset + kResultsBlockHeaderBytes <= size) {
+    uint32_t magic, rows;
+    uint64_t payloadSize;
+    std::memcpy(&magic, data + offset, 4);
+    std::memcpy(&rows, data + offset + 4, 4);
+    std::memcpy(&payloadSize, data + offset + 8, 8);
+    if (magic != kResultsBlockMagic ||
+        payloadSize > size - offset - kResultsBlockHeaderBytes) {
+      break;
+    }
+    const char *ids = data + offset + kResultsBlockHeaderBytes;
+    const char *end = ids + payloadSize;
+    const size_t fixedBytes =
+        rows *
+        (sizeof(uint64_t) + kNumMetricColumns * (2 * sizeof(double) + 1));
+
+    const char *p = ids;
+    bool valid = true;
+    for (uint32_t r = 0; r < rows; ++r) {
+      const char *nul =
+          static_cast<const char *>(std::memchr(p, '\0', end - p));
+      if (nul == nullptr) {
+        valid = false;
+        break;
+      }
+      p = nul + 1;
+    }
+    if (!valid || static_cast<size_t>(end - p) != fixedBytes) {
+      break;
+    }
+    offset += kResultsBlockHeaderBytes + payloadSize;
+    if (records == nullptr) {
+      continue;
+    }
+
+    size_t first = records->size();
+    records->resize(first + rows);
+    MetricRecord *block = records->data() + first;
+    p = ids;
+    for (uint32_t r = 0; r < rows; ++r) {
+      block[r].meshId.assign(p);
+      p += block[r].meshId.size() + 1;
+    }
+    for (uint32_t r = 0; r < rows; ++r, p += 8) {
+      std::memcpy(&block[r].faces, p, 8);
+    }
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      for (uint32_t r = 0; r < rows; ++r, p += 8) {
+        std::memcpy(&block[r].value[c], p, 8);
+      }
+    }
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      for (uint32_t r = 0; r < rows; ++r, p += 8) {
+        std::memcpy(&block[r].seconds[c], p, 8);
+      }
+    }
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      for (uint32_t r = 0; r < rows; ++r, ++p) {
+        block[r].status[c] = static_cast<uint8_t>(*p);
+      }
+    }
+  }
+  return offset;
+}
+
+// The results file shared by all workers of a run. An empty path disables
+// it. Blocks are appended with a single write each, under an exclusive
+// flock since the per-metric tools of one folder share the file.
+class ResultsFile {
+public:
+  explicit ResultsFile(const std::string &path) : path_(path) {
+    if (path_.empty()) {
+      return;
+    }
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+      std::cerr << "Error: Could not open " << path_ << std::endl;
+      return;
+    }
+    flock(fd_, LOCK_EX);
+    if (!repair()) {
+      ::close(fd_);
+      fd_ = -1;
+      return;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) == 0 && st.st_size == 0) {
+      std::string header(kResultsFileMagic, sizeof(kResultsFileMagic));
+      appendPod(header, kResultsFileVersion);
+      appendPod(header, static_cast<uint32_t>(kNumMetricColumns));
+      write(header);
+    }
+    flock(fd_, LOCK_UN);
+  }
+
+  ~ResultsFile() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  ResultsFile(const ResultsFile &) = delete;
+  ResultsFile &operator=(const ResultsFile &) = delete;
+
+  bool enabled() const { return fd_ >= 0; }
+  const std::string &path() const { return path_; }
+
+  void append(const std::string &bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flock(fd_, LOCK_EX);
+    write(bytes);
+    flock(fd_, LOCK_UN);
+  }
+
+  template <typename T> static void appendPod(std::string &bytes, T value) {
+    bytes.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+private:
+  void write(const std::string &bytes) {
+    size_t written = 0;
+    while (written < bytes.size()) {
+      ssize_t n = ::write(fd_, bytes.data() + written, bytes.size() - written);
+      if (n <= 0) {
+        std::cerr << "Error: Could not write " << path_ << std::endl;
+        return;
+      }
+      written += static_cast<size_t>(n);
+    }
+  }
+
+  // Cut off a block, or a header, left incomplete by a crash, as
+  // readLogLines() does for the text logs. Returns false when the file is
+  // no results file.
+  bool repair() {
+    struct stat st;
+    if (fstat(fd_, &st) == 0 && st.st_size == 0) {
+      return true;
+    }
+    MappedFile file(path_);
+    if (!file.valid()) {
+      std::cerr << "Error: Could not open " << path_ << std::endl;
+      return false;
+    }
+    size_t end = 0;
+    std::string error;
+    if (file.size() < kResultsHeaderBytes &&
+        std::memcmp(file.data(), kResultsFileMagic,
+                    std::min(file.size(), sizeof(kResultsFileMagic))) == 0) {
+      end = 0;
+    } else if (!checkResultsHeader(file.data(), file.size(), error)) {
+      std::cerr << "Error: " << path_ << " " << error << std::endl;
+      return false;
+    } else {
+      end = decodeResultsBlocks(file.data(), file.size(), nullptr);
+    }
+    if (end < file.size() &&
+        ftruncate(fd_, static_cast<off_t>(end)) != 0) {
+      std::cerr << "Error: Could not repair " << path_ << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  std::string path_;
+  int fd_ = -1;
+  std::mutex mutex_;
+};
+
+// Rows of one worker. Only its owner thread touches it; full batches are
+// encoded as a block and appended to the file.
+class ResultsBuffer {
+public:
+  explicit ResultsBuffer(ResultsFile &file,
+                         size_t batchRows = kResultsBatchRows)
+      : file_(file), batchRows_(batchRows) {}
+
+  ~ResultsBuffer() { flush(); }
+
+  ResultsBuffer(const ResultsBuffer &) = delete;
+  ResultsBuffer &operator=(const ResultsBuffer &) = delete;
+
+  void add(const MetricRecord &record) {
+    if (!file_.enabled()) {
+      return;
+    }
+    rows_.push_back(record);
+    if (rows_.size() >= batchRows_) {
+      flush();
+    }
+  }
+
+  void flush() {
+    if (rows_.empty()) {
+      return;
+    }
+    std::string payload;
+    for (const MetricRecord &row : rows_) {
+      payload.append(row.meshId);
+      payload.push_back('\0');
+    }
+    for (const MetricRecord &row : rows_) {
+      ResultsFile::appendPod(payload, row.faces);
+    }
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      for (const MetricRecord &row : rows_) {
+        ResultsFile::appendPod(payload, row.value[c]);
+      }
+    }
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      for (const MetricRecord &row : rows_) {
+        ResultsFile::appendPod(payload, row.seconds[c]);
+      }
+    }
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      for (const MetricRecord &row : rows_) {
+        payload.push_back(static_cast<char>(row.status[c]));
+      }
+    }
+
+    std::string block;
+    ResultsFile::appendPod(block, kResultsBlockMagic);
+    ResultsFile::appendPod(block, static_cast<uint32_t>(rows_.size()));
+    ResultsFile::appendPod(block, static_cast<uint64_t>(payload.size()));
+    block.append(payload);
+    file_.append(block);
+    rows_.clear();
+  }
+
+private:
+  ResultsFile &file_;
+  size_t batchRows_;
+  std::vector<MetricRecord> rows_;
+};
+
+// Read every row of a results file. Returns false when the file can not be
+// opened or is not a results file.
+inline bool readResultsFile(const std::string &path,
+                            std::vector<MetricRecord> &records) {
+  MappedFile file(path);
+  if (!file.valid()) {
+    std::cerr << "Error: Could not open " << path << std::endl;
+    return false;
+  }
+  std::string error;
+  if (!checkResultsHeader(file.data(), file.size(), error)) {
+    std::cerr << "Error: " << path << " " << error << std::endl;
+    return false;
+  }
+  decodeResultsBlocks(file.data(), file.size(), &records);
+  return true;
+}
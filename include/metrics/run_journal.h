@@ -0,0 +1,177 @@
+#pragma once
+
+#include "chrono"
+#include "cstdint"
+#include "cstdio"
+#include "cstdlib"
+#include "fcntl.h"
+#include "iostream"
+#include "mutex"
+#include "string"
+#include "sys/file.h"
+#include "unistd.h"
+#include "unordered_map"
+#include "vector"
+
+#include "metrics/result_cache.h"
+#include "metrics/results_file.h"
+
+// Progress journal of a run (<dir>_journal.tsv), replayed by --resume.
+//
+// Every finished metric of every mesh is appended as one line, whatever its
+// status:
+//
+//   <mesh path> <size:mtime> <column> <metric id> <status> <seconds> <faces>
+//   <content>
+//
+// A run started with --resume after a crash or preemption replays the
+// metrics its predecessor finished and only computes the others. Unlike the
+// result cache the journal also holds failed, timed out and out of memory
+// metrics, and needs no content hash: an entry applies as long as the mesh
+// file keeps its size and modification time. The metric id is the cache id
+// of the metric and its options (see MetricOutput::journalId()), so a run
+// resumed with other options computes the metrics again.
+//
+// Lines are synced to disk in batches, so a crash loses at most the last
+// second of entries, whose metrics are computed again. A last line cut short
+// is skipped when the journal is opened, and cut off when no other process
+// has it open.
+
+static const size_t kJournalSyncLines = 256;
+static const double kJournalSyncSeconds = 1.0;
+
+struct JournalEntry {
+  std::string stamp;
+  std::string metricId;
+  uint8_t status = kStatusNotRun;
+  double seconds = 0.0;
+  uint64_t faces = 0;
+  std::string content;
+};
+
+class RunJournal {
+public:
+  // An empty path disables the journal. Unless resume is set, the entries of
+  // the previous run are discarded.
+  RunJournal(const std::string &path, bool resume) : path_(path) {
+    if (path_.empty()) {
+      return;
+    }
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    fd_ = open(path_.c_str(), resume ? flags : flags | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      std::cerr << "Error: Could not open journal " << path_ << std::endl;
+      return;
+    }
+    // Like the result cache, the journal is held with a shared lock, and a
+    // torn last line is only cut off by a process that has it alone.
+    bool exclusive = flock(fd_, LOCK_EX | LOCK_NB) == 0;
+    if (resume) {
+      for (const std::string &line : readLogLines(path_, exclusive)) {
+        parseLine(line);
+      }
+    }
+    flock(fd_, LOCK_SH);
+    lastSync_ = std::chrono::steady_clock::now();
+  }
+
+  ~RunJournal() {
+    if (fd_ >= 0) {
+      fdatasync(fd_);
+      close(fd_);
+    }
+  }
+
+  RunJournal(const RunJournal &) = delete;
+  RunJournal &operator=(const RunJournal &) = delete;
+
+  // Entries of the resumed run.
+  size_t resumed() const { return entries_.size(); }
+
+  // The entry of the resumed run for this metric of the mesh, if the mesh
+  // file did not change since and the metric ran with the same metric id.
+  bool lookup(const std::string &meshPath, MetricColumn column,
+              const std::string &metricId, JournalEntry &entry) const {
+    if (entries_.empty()) {
+      return false;
+    }
+    auto found = entries_.find(entryKey(meshPath, column));
+    if (found == entries_.end() || found->second.metricId != metricId ||
+        found->second.stamp != fileStamp(meshPath)) {
+      return false;
+    }
+    entry = found->second;
+    return true;
+  }
+
+  void record(const std::string &meshPath, MetricColumn column,
+              const std::string &metricId, uint8_t status, double seconds,
+              uint64_t faces, const std::string &content) {
+    if (fd_ < 0) {
+      return;
+    }
+    char numbers[64];
+    std::snprintf(numbers, sizeof(numbers), "\t%d\t%.9g\t%llu\t",
+                  static_cast<int>(status), seconds,
+                  static_cast<unsigned long long>(faces));
+    std::string line = escapeField(meshPath) + "\t" + fileStamp(meshPath) +
+                       "\t" + std::to_string(static_cast<int>(column)) +
+                       "\t" + escapeField(metricId) + numbers +
+                       escapeField(content) + "\n";
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t written = 0;
+    while (written < line.size()) {
+      ssize_t n = write(fd_, line.data() + written, line.size() - written);
+      if (n < 0) {
+        std::cerr << "Error: Could not write " << path_ << std::endl;
+        return;
+      }
+      written += static_cast<size_t>(n);
+    }
+    unsynced_ += 1;
+    auto now = std::chrono::steady_clock::now();
+    if (unsynced_ >= kJournalSyncLines ||
+        std::chrono::duration<double>(now - lastSync_).count() >=
+            kJournalSyncSeconds) {
+      fdatasync(fd_);
+      unsynced_ = 0;
+      lastSync_ = now;
+    }
+  }
+
+private:
+  static std::string entryKey(const std::string &meshPath,
+                              MetricColumn column) {
+    return meshPath + "\t" + std::to_string(static_cast<int>(column));
+  }
+
+  void parseLine(const std::string &line) {
+    std::vector<std::string> fields = splitFields(line);
+    // Lines of journals without metric ids have 7 fields and are skipped.
+    if (fields.size() != 8) {
+      return;
+    }
+    int column = std::atoi(fields[2].c_str());
+    if (column < 0 || column >= kNumMetricColumns) {
+      return;
+    }
+    JournalEntry entry;
+    entry.stamp = fields[1];
+    entry.metricId = unescapeField(fields[3]);
+    entry.status = static_cast<uint8_t>(std::atoi(fields[4].c_str()));
+    entry.seconds = std::strtod(fields[5].c_str(), nullptr);
+    entry.faces = std::strtoull(fields[6].c_str(), nullptr, 10);
+    entry.content = unescapeField(fields[7]);
+    entries_[entryKey(unescapeField(fields[0]),
+                      static_cast<MetricColumn>(column))] = entry;
+  }
+
+  std::string path_;
+  int fd_ = -1;
+  std::mutex mutex_;
+  // Read once when resuming, not modified afterwards.
+  std::unordered_map<std::string, JournalEntry> entries_;
+  size_t unsynced_ = 0;
+  std::chrono::steady_clock::time_point lastSync_;
+};
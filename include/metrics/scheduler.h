@@ -0,0 +1,83 @@
+#pragma once
+
+#include "algorithm"
+#include "atomic"
+#include "functional"
+#include "numeric"
+#include "string"
+#include "sys/stat.h"
+#include "thread"
+#include "vector"
+
+// Hands out the mesh files one at a time to whichever worker asks first.
+// Workers pull from a shared atomic cursor, so a thread stuck on a huge mesh
+// does not hold back a fixed slice of the remaining files.
+class FileScheduler {
+public:
+  // With largestFirst the files are handed out by decreasing file size, which
+  // starts the expensive meshes early instead of leaving them for the tail of
+  // the run.
+  FileScheduler(const std::vector<std::string> &files, bool largestFirst)
+      : order_(files.size()), cursor_(0) {
+    std::iota(order_.begin(), order_.end(), 0);
+    if (largestFirst) {
+      std::vector<off_t> sizes(files.size(), 0);
+      for (size_t i = 0; i < files.size(); ++i) {
+        struct stat st;
+        if (stat(files[i].c_str(), &st) == 0) {
+          sizes[i] = st.st_size;
+        }
+      }
+      std::stable_sort(order_.begin(), order_.end(),
+                       [&sizes](size_t a, size_t b) {
+                         return sizes[a] > sizes[b];
+                       });
+    }
+  }
+
+  FileScheduler(const FileScheduler &) = delete;
+  FileScheduler &operator=(const FileScheduler &) = delete;
+
+  // Fetch the index of the next file to process. Returns false once every
+  // file has been handed out.
+  bool next(size_t &index) {
+    size_t slot = cursor_.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= order_.size()) {
+      return false;
+    }
+    index = order_[slot];
+    return true;
+  }
+
+  size_t size() const { return order_.size(); }
+
+  // Number of files not handed out yet.
+  size_t remaining() const {
+    size_t taken = cursor_.load(std::memory_order_relaxed);
+    return taken >= order_.size() ? 0 : order_.size() - taken;
+  }
+
+private:
+  std::vector<size_t> order_;
+  std::atomic<size_t> cursor_;
+};
+
+inline size_t defaultThreadCount() {
+  size_t numThreads = std::thread::hardware_concurrency();
+  return numThreads == 0 ? 1 : numThreads;
+}
+
+// Start numThreads workers running work(workerIndex) and wait for all of them.
+inline void runWorkers(size_t numThreads,
+                       const std::function<void(size_t)> &work) {
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < numThreads; ++i) {
+    workers.push_back(std::thread(work, i));
+  }
+
+  for (size_t i = 0; i < numThreads; ++i) {
+    if (workers[i].joinable()) {
+      workers[i].join();
+    }
+  }
+}
@@ -0,0 +1,882 @@
+#pragma once
+
+#include "algorithm"
+#include "cerrno"
+#include "cmath"
+#include "cstdint"
+#include "cstring"
+#include "fcntl.h"
+#include "iostream"
+#include "memory"
+#include "stdexcept"
+#include "string"
+#include "sys/stat.h"
+#include "unistd.h"
+#include "vector"
+
+#include "metrics/edge_count.h"
+#include "metrics/flat_mesh.h"
+#include "metrics/flux.h"
+#include "metrics/mesh_loader.h"
+#include "metrics/out_of_core.h"
+#include "metrics/weld.h"
+
+// Streaming evaluation of SegE, DangEL and FluxEE (--stream) for meshes that
+// do not fit in memory.
+//
+// The binary STL or PLY file is read sequentially in kStreamBufferBytes
+// chunks, two or three times, and never held whole:
+//
+//  1. The first pass drops the degenerate triangles and takes the bounding
+//     box, the DangEL scale. It also emits a weld record (coordinates,
+//     corner) for every corner of an STL soup, or every vertex of a PLY
+//     file.
+//  2. The weld records are sorted by coordinates on disk. Equal points
+//     become one vertex, and the vertices are numbered in the order the
+//     in-memory loader keeps them: by their first corner, skipping those no
+//     kept triangle uses. Two more external sorts bring the numbers back to
+//     corner order, in a mapped array.
+//  3. The second pass unites the vertices of every triangle in a mapped
+//     disjoint set (SegE), sums FluxEE in the blocks of computeFlux() and
+//     emits the three edges of every triangle with their lengths. It also
+//     emits the sorted vertices of every triangle, which are sorted on disk
+//     to find the triangles repeating an earlier one, as
+//     removeDuplicateTriangles() drops them.
+//  4. Only when there are such triangles, a third pass sums FluxEE and
+//     emits the edges again without them.
+//  5. The edges are sorted on disk and the edges used once are summed
+//     (DangEL).
+//
+// Only the sort buffers live in memory, bounded by StreamOptions::memoryBytes.
+// The per vertex arrays are memory mapped temporary files that the kernel
+// pages out when memory runs short.
+//
+// The results are those of the in-memory path with the default (exact)
+// weld, to the last bit, for meshes that cleanFlatMesh() does not orient or
+// split: the vertex numbering, the kept triangles and the summation order
+// are the same. The orientation of the soup and the splitting of singular
+// vertices (orientTriangleSoup()) need the whole mesh and are not done, nor
+// is the polygon mesh check. A soup with inconsistently oriented neighbours
+// gets another FluxEE, and one whose shells touch at a vertex another SegE,
+// so the results are cached apart from those of the in-memory path
+// (kStreamCacheTag). ASCII files and welding with a tolerance are not
+// supported.
+
+// Default --stream-memory, in MiB.
+static const size_t kDefaultStreamMemoryMb = 1024;
+// The PLY header must end within this many bytes.
+static const size_t kMaxPlyHeaderBytes = size_t(1) << 20;
+// Vertex number of the corners no kept triangle uses.
+static const uint32_t kNoStreamedVertex = UINT32_MAX;
+// Appended to the cache ids of the metrics computed with --stream.
+static const char *const kStreamCacheTag = "@stream";
+
+struct StreamOptions {
+  // Memory of the sort buffers.
+  size_t memoryBytes = kDefaultStreamMemoryMb << 20;
+  // Folder of the temporary files, "" for $TMPDIR or /tmp.
+  std::string tmpDir;
+};
+
+inline StreamOptions makeStreamOptions(size_t memoryMb,
+                                       const std::string &tmpDir) {
+  StreamOptions options;
+  options.memoryBytes = std::max<size_t>(1, memoryMb) << 20;
+  options.tmpDir = tmpDir;
+  return options;
+}
+
+struct StreamedMetrics {
+  // Of the mesh as the in-memory loader keeps it: welded, without
+  // degenerate triangles and unused vertices.
+  size_t numTriangles = 0;
+  size_t numVertices = 0;
+  size_t segments = 0;
+  // Length and scale of DangEL, see computeDanglingEdges().
+  DanglingEdgeResult dangling;
+  // Signed flux, FluxEE is its absolute value.
+  double flux = 0.0;
+};
+
+namespace streaming_detail {
+
+// Sequential reader of a file through one buffer.
+class ChunkedFile {
+public:
+  explicit ChunkedFile(const std::string &path)
+      : buffer_(kStreamBufferBytes) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) == 0) {
+      size_ = static_cast<uint64_t>(st.st_size);
+    }
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  ~ChunkedFile() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  ChunkedFile(const ChunkedFile &) = delete;
+  ChunkedFile &operator=(const ChunkedFile &) = delete;
+
+  bool valid() const { return fd_ >= 0; }
+  uint64_t size() const { return size_; }
+
+  // Continue reading at offset.
+  void seek(uint64_t offset) {
+    offset_ = offset;
+    begin_ = end_ = 0;
+  }
+
+  // The next bytes bytes (at most kStreamBufferBytes), or null when the file
+  // ends first.
+  const char *take(size_t bytes) {
+    if (end_ - begin_ < bytes && !fill(bytes)) {
+      return nullptr;
+    }
+    const char *data = buffer_.data() + begin_;
+    begin_ += bytes;
+    return data;
+  }
+
+  void skip(uint64_t bytes) {
+    if (bytes <= end_ - begin_) {
+      begin_ += static_cast<size_t>(bytes);
+    } else {
+      seek(offset_ + (bytes - (end_ - begin_)));
+    }
+  }
+
+private:
+  bool fill(size_t bytes) {
+    std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+    end_ -= begin_;
+    begin_ = 0;
+    while (end_ < bytes) {
+      ssize_t got = pread(fd_, buffer_.data() + end_, buffer_.size() - end_,
+                          static_cast<off_t>(offset_));
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got <= 0) {
+        return false;
+      }
+      end_ += static_cast<size_t>(got);
+      offset_ += static_cast<uint64_t>(got);
+    }
+    return true;
+  }
+
+  int fd_ = -1;
+  uint64_t size_ = 0;
+  std::vector<char> buffer_;
+  // Buffered bytes [begin_, end_); offset_ is the file offset of end_.
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  uint64_t offset_ = 0;
+};
+
+// A triangle as read: its corners (STL: 3 * triangle + k, PLY: the vertex
+// index) and their coordinates.
+struct StreamedTriangle {
+  uint64_t corner[3];
+  double point[3][3];
+};
+
+inline bool samePosition(const double *a, const double *b) {
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+// Two equal corners, which the exact weld merges.
+inline bool isDegenerate(const StreamedTriangle &t) {
+  return samePosition(t.point[0], t.point[1]) ||
+         samePosition(t.point[1], t.point[2]) ||
+         samePosition(t.point[0], t.point[2]);
+}
+
+// Reader of the triangles of a binary STL or PLY file. forEachTriangle()
+// can be called again for another pass. The vertices of a PLY file are kept
+// in a mapped array, so faces can be resolved in any order.
+class StreamedMeshReader {
+public:
+  StreamedMeshReader(const std::string &path, const std::string &tmpDir)
+      : path_(path), tmpDir_(tmpDir), file_(path) {}
+
+  // Read the header. Returns false with the reason when the file can not be
+  // streamed.
+  bool open(std::string &error) {
+    if (!file_.valid()) {
+      error = "could not open the file";
+      return false;
+    }
+    if (hasExtension(path_, ".stl")) {
+      return openStl(error);
+    }
+    if (hasExtension(path_, ".ply")) {
+      return openPly(error);
+    }
+    error = "unsupported extension";
+    return false;
+  }
+
+  // Whether every corner is its own vertex (STL).
+  bool soup() const { return soup_; }
+  // Number of corner indices: 3 per STL triangle, 1 per PLY vertex.
+  uint64_t numCorners() const { return numCorners_; }
+  // Coordinates of PLY vertex v, once a pass has read them.
+  const double *vertex(uint64_t v) const { return &(*vertices_)[3 * v]; }
+
+  // Call visit(const StreamedTriangle &) for every triangle in file order.
+  template <typename Visit>
+  bool forEachTriangle(const Visit &visit, std::string &error) {
+    file_.seek(bodyOffset_);
+    return soup_ ? readStlTriangles(visit, error)
+                 : readPlyTriangles(visit, error);
+  }
+
+private:
+  bool openStl(std::string &error) {
+    using mesh_loader_detail::loadLittleEndian;
+    const char *header = file_.take(84);
+    if (header != nullptr) {
+      numTriangles_ = loadLittleEndian<uint32_t>(header + 80);
+    }
+    if (header == nullptr || file_.size() != 84 + numTriangles_ * 50) {
+      error = "not a binary STL file, --stream reads binary STL and PLY";
+      return false;
+    }
+    soup_ = true;
+    bodyOffset_ = 84;
+    numCorners_ = 3 * numTriangles_;
+    return true;
+  }
+
+  bool openPly(std::string &error) {
+    using namespace mesh_loader_detail;
+    std::vector<char> header(static_cast<size_t>(
+        std::min<uint64_t>(file_.size(), kMaxPlyHeaderBytes)));
+    const char *data = file_.take(header.size());
+    if (data == nullptr) {
+      error = "could not read the header";
+      return false;
+    }
+    std::memcpy(header.data(), data, header.size());
+    const char *body = nullptr;
+    if (!parsePlyHeader(header.data(), header.data() + header.size(),
+                        format_, elements_, body, error)) {
+      return false;
+    }
+    if (format_ == PlyFormat::Ascii) {
+      error = "ASCII PLY, --stream reads binary STL and PLY";
+      return false;
+    }
+    bodyOffset_ = static_cast<uint64_t>(body - header.data());
+    for (const PlyElement &element : elements_) {
+      if (element.name == "vertex") {
+        numCorners_ += element.count;
+      }
+    }
+    return true;
+  }
+
+  template <typename Visit>
+  bool readStlTriangles(const Visit &visit, std::string &error) {
+    using mesh_loader_detail::loadLittleEndian;
+    StreamedTriangle t;
+    for (uint64_t i = 0; i < numTriangles_; ++i) {
+      const char *record = file_.take(50);
+      if (record == nullptr) {
+        error = "truncated binary body";
+        return false;
+      }
+      record += 12;  // skip the normal
+      for (size_t k = 0; k < 3; ++k) {
+        t.corner[k] = 3 * i + k;
+        for (size_t d = 0; d < 3; ++d) {
+          t.point[k][d] = loadLittleEndian<float>(record + k * 12 + d * 4);
+        }
+      }
+      visit(t);
+    }
+    return true;
+  }
+
+  // Decode one binary scalar, false when the file ends.
+  bool takeScalar(mesh_loader_detail::PlyType type, double &value) {
+    size_t size = mesh_loader_detail::plyTypeSize(type);
+    const char *data = file_.take(size);
+    if (data == nullptr) {
+      return false;
+    }
+    value = mesh_loader_detail::loadPlyScalar(
+        data, type, mesh_loader_detail::plySwapBytes(format_));
+    return true;
+  }
+
+  // The same decoding as readPly(), on the chunked file.
+  template <typename Visit>
+  bool readPlyTriangles(const Visit &visit, std::string &error) {
+    using namespace mesh_loader_detail;
+    const bool firstPass = !vertices_;
+    if (firstPass) {
+      vertices_.reset(new MappedArray<double>(tmpDir_, 3 * numCorners_));
+    }
+    uint64_t numVertices = 0;
+    std::vector<uint64_t> corners;
+    StreamedTriangle t;
+    for (const PlyElement &element : elements_) {
+      const bool isVertex = element.name == "vertex";
+      const bool isFace = element.name == "face";
+      int xyz[3] = {-1, -1, -1};
+      int indexProperty = -1;
+      uint64_t recordSize = 0;
+      bool hasList = false;
+      for (size_t i = 0; i < element.properties.size(); ++i) {
+        const PlyProperty &property = element.properties[i];
+        if (isVertex && !property.isList) {
+          if (property.name == "x") xyz[0] = static_cast<int>(i);
+          if (property.name == "y") xyz[1] = static_cast<int>(i);
+          if (property.name == "z") xyz[2] = static_cast<int>(i);
+        }
+        if (isFace && property.isList &&
+            (property.name == "vertex_indices" ||
+             property.name == "vertex_index")) {
+          indexProperty = static_cast<int>(i);
+        }
+        hasList = hasList || property.isList;
+        recordSize += plyTypeSize(property.type);
+      }
+      if (isVertex && (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0)) {
+        error = "vertex element without x, y, z";
+        return false;
+      }
+      // Fixed size elements the pass does not need are skipped whole.
+      if (!isFace && !(isVertex && firstPass) && !hasList) {
+        file_.skip(element.count * recordSize);
+        numVertices += isVertex ? element.count : 0;
+        continue;
+      }
+
+      for (uint64_t item = 0; item < element.count; ++item) {
+        double point[3] = {0.0, 0.0, 0.0};
+        corners.clear();
+        for (size_t i = 0; i < element.properties.size(); ++i) {
+          const PlyProperty &property = element.properties[i];
+          double value = 0.0;
+          if (!property.isList) {
+            if (!takeScalar(property.type, value)) {
+              error = "truncated binary body";
+              return false;
+            }
+            for (int d = 0; d < 3; ++d) {
+              if (xyz[d] == static_cast<int>(i)) {
+                point[d] = value;
+              }
+            }
+            continue;
+          }
+          if (!takeScalar(property.countType, value)) {
+            error = "truncated binary body";
+            return false;
+          }
+          size_t count = 0;
+          if (!plyListSize(value, count)) {
+            error = "invalid list size";
+            return false;
+          }
+          for (size_t k = 0; k < count; ++k) {
+            if (!takeScalar(property.type, value)) {
+              error = "truncated binary body";
+              return false;
+            }
+            if (static_cast<int>(i) == indexProperty) {
+              uint32_t index = 0;
+              if (!plyVertexIndex(value, numVertices, index)) {
+                error = "face index out of range";
+                return false;
+              }
+              corners.push_back(index);
+            }
+          }
+        }
+        if (isVertex) {
+          if (firstPass) {
+            for (int d = 0; d < 3; ++d) {
+              (*vertices_)[3 * numVertices + d] = point[d];
+            }
+          }
+          ++numVertices;
+        } else if (isFace && corners.size() >= 3) {
+          // Fan triangulated like appendPolygon().
+          for (size_t i = 1; i + 1 < corners.size(); ++i) {
+            const uint64_t fan[3] = {corners[0], corners[i], corners[i + 1]};
+            for (size_t k = 0; k < 3; ++k) {
+              t.corner[k] = fan[k];
+              std::memcpy(t.point[k], vertex(fan[k]), sizeof(t.point[k]));
+            }
+            visit(t);
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  std::string path_;
+  std::string tmpDir_;
+  ChunkedFile file_;
+  bool soup_ = false;
+  uint64_t bodyOffset_ = 0;
+  uint64_t numCorners_ = 0;
+  // STL
+  uint64_t numTriangles_ = 0;
+  // PLY
+  mesh_loader_detail::PlyFormat format_ =
+      mesh_loader_detail::PlyFormat::BinaryLittle;
+  std::vector<mesh_loader_detail::PlyElement> elements_;
+  std::unique_ptr<MappedArray<double>> vertices_;
+};
+
+// FluxEE in the blocks of computeFlux(): the kept triangles are collected
+// kFluxBlockTriangles at a time and every block is summed by fluxBlock().
+class StreamedFlux {
+public:
+  StreamedFlux()
+      : points_(9 * kFluxBlockTriangles),
+        triangles_(3 * kFluxBlockTriangles) {
+    for (size_t i = 0; i < triangles_.size(); ++i) {
+      triangles_[i] = static_cast<uint32_t>(i);
+    }
+  }
+
+  void add(const StreamedTriangle &t) {
+    std::memcpy(&points_[9 * size_], t.point, 9 * sizeof(double));
+    if (++size_ == kFluxBlockTriangles) {
+      flush();
+    }
+  }
+
+  double value() {
+    flush();
+    return total_.value();
+  }
+
+private:
+  void flush() {
+    if (size_ == 0) {
+      return;
+    }
+    MeshView block;
+    block.x = &points_[0];
+    block.y = &points_[1];
+    block.z = &points_[2];
+    block.stride = 3;
+    block.triangles = triangles_.data();
+    block.numVertices = 3 * size_;
+    block.numTriangles = size_;
+    total_.add(fluxBlock(block, 0, size_));
+    size_ = 0;
+  }
+
+  std::vector<double> points_;
+  std::vector<uint32_t> triangles_;
+  size_t size_ = 0;
+  CompensatedSum total_;
+};
+
+// A corner at a position. The coordinates are kept as weld_detail bits, in
+// which -0.0 equals 0.0; used tells whether a kept triangle has the corner.
+struct WeldRecord {
+  uint64_t bits[3];
+  uint64_t corner;
+  uint64_t used;
+};
+
+struct WeldRecordLess {
+  bool operator()(const WeldRecord &a, const WeldRecord &b) const {
+    for (int d = 0; d < 3; ++d) {
+      if (a.bits[d] != b.bits[d]) {
+        return a.bits[d] < b.bits[d];
+      }
+    }
+    return a.corner < b.corner;
+  }
+};
+
+inline WeldRecord makeWeldRecord(const double *point, uint64_t corner,
+                                 bool used) {
+  WeldRecord record;
+  for (int d = 0; d < 3; ++d) {
+    record.bits[d] = weld_detail::coordinateBits(point[d]);
+  }
+  record.corner = corner;
+  record.used = used ? 1 : 0;
+  return record;
+}
+
+// NaN coordinates compare unequal, so such a corner merges with nothing.
+inline bool weldsWith(const WeldRecord &a, const WeldRecord &b) {
+  for (int d = 0; d < 3; ++d) {
+    double value;
+    std::memcpy(&value, &a.bits[d], sizeof(value));
+    if (a.bits[d] != b.bits[d] || std::isnan(value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A corner and the first corner of its point. Sorted by first corner with
+// the used corners of a point ahead of the others.
+struct FirstCornerRecord {
+  uint64_t first;
+  uint64_t corner;
+  uint64_t used;
+};
+
+struct FirstCornerRecordLess {
+  bool operator()(const FirstCornerRecord &a,
+                  const FirstCornerRecord &b) const {
+    if (a.first != b.first) {
+      return a.first < b.first;
+    }
+    if (a.used != b.used) {
+      return a.used > b.used;
+    }
+    return a.corner < b.corner;
+  }
+};
+
+struct VertexRecord {
+  uint64_t corner;
+  uint64_t vertex;
+};
+
+struct VertexRecordLess {
+  bool operator()(const VertexRecord &a, const VertexRecord &b) const {
+    return a.corner < b.corner;
+  }
+};
+
+struct EdgeRecord {
+  uint64_t key;
+  double length;
+};
+
+struct EdgeRecordLess {
+  bool operator()(const EdgeRecord &a, const EdgeRecord &b) const {
+    return a.key < b.key || (a.key == b.key && a.length < b.length);
+  }
+};
+
+// The sorted vertices of a kept triangle and its number among the kept
+// triangles, in file order.
+struct TriangleRecord {
+  uint32_t vertices[3];
+  uint64_t triangle;
+};
+
+struct TriangleRecordLess {
+  bool operator()(const TriangleRecord &a, const TriangleRecord &b) const {
+    for (int k = 0; k < 3; ++k) {
+      if (a.vertices[k] != b.vertices[k]) {
+        return a.vertices[k] < b.vertices[k];
+      }
+    }
+    return a.triangle < b.triangle;
+  }
+};
+
+inline TriangleRecord makeTriangleRecord(const uint32_t *v,
+                                         uint64_t triangle) {
+  TriangleRecord record;
+  std::copy(v, v + 3, record.vertices);
+  std::sort(record.vertices, record.vertices + 3);
+  record.triangle = triangle;
+  return record;
+}
+
+// Flag the triangles with the vertices of an earlier triangle, the ones
+// removeDuplicateTriangles() drops, in a mapped array of numTriangles
+// entries. Returns the number of flagged triangles; duplicate is only
+// allocated when there are some.
+template <typename TriangleSorter>
+size_t
+flagDuplicateTriangles(TriangleSorter &triangles, const StreamOptions &options,
+                       uint64_t numTriangles,
+                       std::unique_ptr<MappedArray<uint8_t>> &duplicate) {
+  size_t count = 0;
+  bool started = false;
+  TriangleRecord previous;
+  triangles.forEach([&](const TriangleRecord &record) {
+    if (started && std::equal(record.vertices, record.vertices + 3,
+                              previous.vertices)) {
+      if (!duplicate) {
+        duplicate.reset(
+            new MappedArray<uint8_t>(options.tmpDir, numTriangles));
+      }
+      (*duplicate)[record.triangle] = 1;
+      count += 1;
+      return;
+    }
+    started = true;
+    previous = record;
+  });
+  return count;
+}
+
+// Number the welded vertices and write the number of every corner to
+// vertexOf, kNoStreamedVertex for the corners of unused points. The
+// in-memory weld keeps the coordinates of the first corner of a point and
+// compactFlatMesh() keeps the used points in that order, so the numbers
+// are ranks of first corners. Returns the number of vertices.
+template <typename WeldSorter>
+size_t numberVertices(WeldSorter &welds, const StreamOptions &options,
+                      MappedArray<uint32_t> &vertexOf) {
+  const size_t bufferBytes = std::max<size_t>(1, options.memoryBytes / 2);
+  ExternalSorter<FirstCornerRecord, FirstCornerRecordLess> byFirst(
+      options.tmpDir, bufferBytes);
+  bool started = false;
+  WeldRecord previous;
+  uint64_t first = 0;
+  welds.forEach([&](const WeldRecord &record) {
+    if (!started || !weldsWith(previous, record)) {
+      first = record.corner;
+    }
+    started = true;
+    previous = record;
+    byFirst.add(FirstCornerRecord{first, record.corner, record.used});
+  });
+
+  ExternalSorter<VertexRecord, VertexRecordLess> byCorner(options.tmpDir,
+                                                          bufferBytes);
+  uint64_t numVertices = 0;
+  started = false;
+  uint64_t point = 0;
+  uint64_t vertex = kNoStreamedVertex;
+  byFirst.forEach([&](const FirstCornerRecord &record) {
+    if (!started || record.first != point) {
+      // The used corners come first: an unused head means an unused point.
+      point = record.first;
+      vertex = record.used ? numVertices++ : kNoStreamedVertex;
+    }
+    started = true;
+    byCorner.add(VertexRecord{record.corner, vertex});
+  });
+  if (numVertices >= kNoStreamedVertex) {
+    throw std::runtime_error("more than 2^32 - 1 vertices");
+  }
+
+  uint64_t corner = 0;
+  byCorner.forEach([&](const VertexRecord &record) {
+    vertexOf[corner++] = static_cast<uint32_t>(record.vertex);
+  });
+  return static_cast<size_t>(numVertices);
+}
+
+} // namespace streaming_detail
+
+// Compute FluxEE, the DangEL scale and, when asked for, SegE and DangEL of a
+// binary STL or PLY file in bounded memory (see above). The dangling edges
+// are listed in result.dangling.boundaryEdges with listEdges. Returns false
+// and prints the reason when the file can not be read; throws
+// std::runtime_error when the temporary files fail.
+inline bool streamMeshMetrics(const std::string &path,
+                              const StreamOptions &options, bool segment,
+                              bool dangling, bool listEdges,
+                              StreamedMetrics &result) {
+  using namespace streaming_detail;
+  result = StreamedMetrics();
+  StreamedMeshReader reader(path, options.tmpDir);
+  std::string error;
+  if (!reader.open(error)) {
+    std::cerr << "Error: Could not stream " << path << ": " << error
+              << std::endl;
+    return false;
+  }
+
+  // Pass 1: the bounding box and the weld records. The weld is needed for
+  // FluxEE too, to find the duplicate triangles.
+  ExternalSorter<WeldRecord, WeldRecordLess> welds(
+      options.tmpDir, std::max<size_t>(1, options.memoryBytes / 2));
+  std::unique_ptr<MappedArray<uint8_t>> used;
+  if (!reader.soup()) {
+    used.reset(new MappedArray<uint8_t>(options.tmpDir, reader.numCorners()));
+  }
+  BoundingBox box;
+  uint64_t numKept = 0;
+  bool ok = reader.forEachTriangle(
+      [&](const StreamedTriangle &t) {
+        const bool kept = !isDegenerate(t);
+        for (size_t k = 0; k < 3; ++k) {
+          if (reader.soup()) {
+            welds.add(makeWeldRecord(t.point[k], t.corner[k], kept));
+          } else if (kept) {
+            (*used)[t.corner[k]] = 1;
+          }
+        }
+        if (!kept) {
+          return;
+        }
+        for (size_t k = 0; k < 3; ++k) {
+          for (int d = 0; d < 3; ++d) {
+            if (numKept == 0 && k == 0) {
+              box.min[d] = box.max[d] = t.point[k][d];
+            }
+            box.min[d] = std::min(box.min[d], t.point[k][d]);
+            box.max[d] = std::max(box.max[d], t.point[k][d]);
+          }
+        }
+        numKept += 1;
+      },
+      error);
+  if (!ok) {
+    std::cerr << "Error: Could not stream " << path << ": " << error
+              << std::endl;
+    return false;
+  }
+  result.dangling.scale = box.halfExtent();
+
+  // The weld.
+  if (!reader.soup()) {
+    for (uint64_t v = 0; v < reader.numCorners(); ++v) {
+      welds.add(makeWeldRecord(reader.vertex(v), v, (*used)[v] != 0));
+    }
+    used.reset();
+  }
+  MappedArray<uint32_t> vertexOf(options.tmpDir, reader.numCorners());
+  result.numVertices = numberVertices(welds, options, vertexOf);
+
+  // FluxEE and the edges of the kept triangles but the flagged duplicates.
+  // The edges get half of the memory while the triangles are sorted too.
+  std::unique_ptr<MappedArray<uint8_t>> duplicate;
+  std::unique_ptr<StreamedFlux> flux;
+  typedef ExternalSorter<EdgeRecord, EdgeRecordLess> EdgeSorter;
+  std::unique_ptr<EdgeSorter> edges;
+  auto startSums = [&](size_t edgeBytes) {
+    flux.reset(new StreamedFlux());
+    edges.reset(dangling ? new EdgeSorter(options.tmpDir, edgeBytes)
+                         : nullptr);
+  };
+  auto addToSums = [&](const StreamedTriangle &t, const uint32_t *v,
+                       uint64_t triangle) {
+    if (duplicate && (*duplicate)[triangle]) {
+      return;
+    }
+    flux->add(t);
+    if (!edges) {
+      return;
+    }
+    for (size_t k = 0; k < 3; ++k) {
+      const double *a = t.point[k];
+      const double *b = t.point[(k + 1) % 3];
+      double dx = a[0] - b[0];
+      double dy = a[1] - b[1];
+      double dz = a[2] - b[2];
+      edges->add(EdgeRecord{packEdgeKey(v[k], v[(k + 1) % 3]),
+                            std::sqrt(dx * dx + dy * dy + dz * dz)});
+    }
+  };
+
+  // Pass 2: unions, sums and the sorted triangles.
+  std::unique_ptr<MappedDisjointSet> components;
+  if (segment) {
+    components.reset(new MappedDisjointSet(
+        options.tmpDir, static_cast<uint32_t>(result.numVertices)));
+  }
+  const size_t halfMemory = std::max<size_t>(1, options.memoryBytes / 2);
+  ExternalSorter<TriangleRecord, TriangleRecordLess> triangles(
+      options.tmpDir, dangling ? halfMemory : options.memoryBytes);
+  startSums(halfMemory);
+  uint64_t triangle = 0;
+  ok = reader.forEachTriangle(
+      [&](const StreamedTriangle &t) {
+        if (isDegenerate(t)) {
+          return;
+        }
+        uint32_t v[3];
+        for (size_t k = 0; k < 3; ++k) {
+          v[k] = vertexOf[t.corner[k]];
+        }
+        if (components) {
+          components->unite(v[0], v[1]);
+          components->unite(v[0], v[2]);
+        }
+        triangles.add(makeTriangleRecord(v, triangle));
+        addToSums(t, v, triangle);
+        triangle += 1;
+      },
+      error);
+  size_t numDuplicates = 0;
+  if (ok) {
+    numDuplicates =
+        flagDuplicateTriangles(triangles, options, numKept, duplicate);
+  }
+
+  // Pass 3, only with duplicates: the sums again without them.
+  if (ok && numDuplicates > 0) {
+    startSums(options.memoryBytes);
+    triangle = 0;
+    ok = reader.forEachTriangle(
+        [&](const StreamedTriangle &t) {
+          if (isDegenerate(t)) {
+            return;
+          }
+          uint32_t v[3];
+          for (size_t k = 0; k < 3; ++k) {
+            v[k] = vertexOf[t.corner[k]];
+          }
+          addToSums(t, v, triangle);
+          triangle += 1;
+        },
+        error);
+  }
+  if (!ok) {
+    std::cerr << "Error: Could not stream " << path << ": " << error
+              << std::endl;
+    return false;
+  }
+  result.numTriangles = static_cast<size_t>(numKept) - numDuplicates;
+  result.flux = flux->value();
+  if (components) {
+    result.segments = components->countSets();
+  }
+  if (!edges) {
+    return true;
+  }
+
+  // Edges used by exactly one triangle, summed in key order like
+  // computeDanglingEdges().
+  bool pending = false;
+  bool repeated = false;
+  EdgeRecord previous;
+  auto closeRun = [&]() {
+    if (!pending || repeated) {
+      return;
+    }
+    result.dangling.length += previous.length;
+    result.dangling.numBoundaryEdges += 1;
+    if (listEdges) {
+      result.dangling.boundaryEdges.emplace_back(
+          edgeKeyLower(previous.key), edgeKeyHigher(previous.key));
+    }
+  };
+  edges->forEach([&](const EdgeRecord &record) {
+    if (pending && record.key == previous.key) {
+      repeated = true;
+      return;
+    }
+    closeRun();
+    pending = true;
+    repeated = false;
+    previous = record;
+  });
+  closeRun();
+  return true;
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "algorithm"
+#include "cerrno"
+#include "chrono"
+#include "cmath"
+#include "csignal"
+#include "cstdio"
+#include "cstring"
+#include "fcntl.h"
+#include "fstream"
+#include "iostream"
+#include "limits.h"
+#include "new"
+#include "poll.h"
+#include "spawn.h"
+#include "string"
+#include "sys/wait.h"
+#include "unistd.h"
+#include "vector"
+
+#include "metrics/metric_output.h"
+
+extern char **environ;
+
+// Wall clock and memory budget of the metrics of one mesh (--timeout,
+// --memory-limit).
+//
+// The metrics of a mesh run in a child process of the tool itself, started
+// with --worker-file. The child reports every finished metric on a pipe
+// (see MetricOutput), the supervisor stores them as usual. A metric that
+// does not finish within the timeout gets the child killed; the metrics it
+// had not reported are recorded as timeout, or as out_of_memory when the
+// child went over the memory limit, and the batch goes on.
+//
+// The memory limit applies to the anonymous resident memory of the child,
+// which the supervisor samples every kMemoryPollMs. An address space limit
+// (RLIMIT_AS) would also count the arenas of malloc, thread stacks and the
+// memory mapped mesh files, none of which take memory from other processes,
+// and would fail the mapping of a large mesh as a load error. A child can
+// overshoot the limit for the length of one sample.
+
+// Exit code of a worker whose allocation failed.
+static const int kWorkerExitOutOfMemory = 3;
+// Descriptor of the report pipe in the worker.
+static const int kWorkerReportFd = 3;
+// Interval at which the supervisor samples the memory of a worker.
+static const int kMemoryPollMs = 50;
+
+// Path of the running executable, to start the workers with.
+inline std::string selfExecutable() {
+  char path[PATH_MAX];
+  ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (length <= 0) {
+    return "";
+  }
+  return std::string(path, static_cast<size_t>(length));
+}
+
+// End the worker with kWorkerExitOutOfMemory when an allocation fails, so
+// that it is recorded as out_of_memory rather than as a crash.
+inline void exitWorkerOnOutOfMemory() {
+  std::set_new_handler([]() { _exit(kWorkerExitOutOfMemory); });
+}
+
+// Resident memory of process pid that is not backed by a file: the resident
+// pages minus the shared ones of /proc/<pid>/statm. 0 when it can not be
+// read.
+inline size_t anonymousResidentBytes(pid_t pid) {
+  std::ifstream statm("/proc/" + std::to_string(pid) + "/statm");
+  size_t size = 0, resident = 0, shared = 0;
+  if (!(statm >> size >> resident >> shared) || resident < shared) {
+    return 0;
+  }
+  return (resident - shared) * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+class Supervisor {
+public:
+  // timeoutSeconds applies to each metric of each mesh, 0 means none. With
+  // memoryLimitMb 0 the workers are not limited.
+  Supervisor(double timeoutSeconds, size_t memoryLimitMb)
+      : executable_(selfExecutable()), timeoutSeconds_(timeoutSeconds),
+        memoryLimitMb_(memoryLimitMb) {}
+
+  size_t memoryLimitMb() const { return memoryLimitMb_; }
+
+  // Run the worker of mesh with args (without the executable) and replay
+  // its reports into output. Metrics flagged in expected that the worker did
+  // not report are failed with the reason it ended.
+  void run(const std::string &mesh, const std::vector<std::string> &args,
+           MetricOutput &output,
+           const bool (&expected)[kNumMetricColumns]) const {
+    bool reported[kNumMetricColumns] = {};
+    auto start = std::chrono::steady_clock::now();
+    MetricStatus outcome = runWorker(mesh, args, output, reported);
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    for (int column = 0; column < kNumMetricColumns; ++column) {
+      if (expected[column] && !reported[column]) {
+        output.fail(static_cast<MetricColumn>(column), outcome, seconds);
+      }
+    }
+  }
+
+private:
+  // Returns the status of the metrics the worker left unreported.
+  MetricStatus runWorker(const std::string &mesh,
+                         const std::vector<std::string> &args,
+                         MetricOutput &output,
+                         bool (&reported)[kNumMetricColumns]) const {
+    int fds[2];
+    if (executable_.empty() || pipe2(fds, O_CLOEXEC) != 0) {
+      std::cerr << "Error: Could not start a worker for " << mesh
+                << std::endl;
+      return kStatusFailed;
+    }
+
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(executable_.c_str()));
+    for (const std::string &arg : args) {
+      argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], kWorkerReportFd);
+    pid_t pid;
+    int spawned = posix_spawn(&pid, executable_.c_str(), &actions, nullptr,
+                              argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (spawned != 0) {
+      close(fds[0]);
+      std::cerr << "Error: Could not start a worker for " << mesh << ": "
+                << std::strerror(spawned) << std::endl;
+      return kStatusFailed;
+    }
+
+    MetricStatus stopped = readReports(fds[0], pid, output, reported);
+    if (stopped != kStatusOk) {
+      kill(pid, SIGKILL);
+    }
+    close(fds[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    if (stopped == kStatusTimeout) {
+      std::cout << "Timeout: a metric of " << mesh << " ran longer than "
+                << timeoutSeconds_ << " s" << std::endl;
+      return kStatusTimeout;
+    }
+    if (stopped == kStatusOutOfMemory) {
+      std::cout << "Out of memory: " << mesh << " used more than "
+                << memoryLimitMb_ << " MiB" << std::endl;
+      return kStatusOutOfMemory;
+    }
+    // A failed allocation ends the worker with kWorkerExitOutOfMemory, and
+    // the kernel's OOM killer sends SIGKILL.
+    if ((WIFEXITED(status) &&
+         WEXITSTATUS(status) == kWorkerExitOutOfMemory) ||
+        (WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL)) {
+      std::cout << "Out of memory: " << mesh << std::endl;
+      return kStatusOutOfMemory;
+    }
+    if (WIFSIGNALED(status)) {
+      std::cout << "Worker of " << mesh << " crashed with signal "
+                << WTERMSIG(status) << std::endl;
+    }
+    return kStatusFailed;
+  }
+
+  // Read the report lines until the worker closes the pipe, then return
+  // kStatusOk. Returns kStatusTimeout when a metric ran out of time, the
+  // clock restarts with every metric, and kStatusOutOfMemory when the worker
+  // went over the memory limit.
+  MetricStatus readReports(int fd, pid_t pid, MetricOutput &output,
+                           bool (&reported)[kNumMetricColumns]) const {
+    typedef std::chrono::steady_clock Clock;
+    auto budget = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(timeoutSeconds_));
+    auto deadline = Clock::now() + budget;
+    const size_t memoryLimitBytes = memoryLimitMb_ << 20;
+    std::string pending;
+    char buffer[4096];
+    while (true) {
+      int waitMs = memoryLimitMb_ > 0 ? kMemoryPollMs : -1;
+      if (timeoutSeconds_ > 0.0) {
+        auto left = std::chrono::duration<double, std::milli>(
+                        deadline - Clock::now())
+                        .count();
+        if (left <= 0.0) {
+          return kStatusTimeout;
+        }
+        int leftMs = static_cast<int>(std::ceil(left));
+        waitMs = waitMs < 0 ? leftMs : std::min(waitMs, leftMs);
+      }
+      if (memoryLimitMb_ > 0 &&
+          anonymousResidentBytes(pid) > memoryLimitBytes) {
+        return kStatusOutOfMemory;
+      }
+      struct pollfd poller = {fd, POLLIN, 0};
+      int ready = poll(&poller, 1, waitMs);
+      if (ready < 0 && errno != EINTR) {
+        return kStatusOk;
+      }
+      if (ready <= 0) {
+        continue;
+      }
+      ssize_t count = read(fd, buffer, sizeof(buffer));
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        return kStatusOk;
+      }
+      pending.append(buffer, static_cast<size_t>(count));
+      size_t end;
+      while ((end = pending.find('\n')) != std::string::npos) {
+        MetricColumn column;
+        if (output.applyReport(pending.substr(0, end), column)) {
+          reported[column] = true;
+          deadline = Clock::now() + budget;
+        }
+        pending.erase(0, end + 1);
+      }
+    }
+  }
+
+  std::string executable_;
+  double timeoutSeconds_;
+  size_t memoryLimitMb_;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "algorithm"
+#include "cstddef"
+#include "mutex"
+#include "string"
+
+#include "CGAL/tags.h"
+
+#ifdef CGAL_LINKED_WITH_TBB
+#include "tbb/task_arena.h"
+#endif
+
+// CGAL's Parallel_tag code paths only run in parallel when linked with TBB.
+#ifdef CGAL_LINKED_WITH_TBB
+static const bool kCgalParallelAvailable = true;
+#else
+static const bool kCgalParallelAvailable = false;
+#endif
+
+// Shares the cores of the run between the per-file workers and the parallel
+// kernels running inside them.
+//
+// Every worker owns one core. While the file queue is deep the kernels run
+// sequentially (many files x one thread). A worker that finds the queue empty
+// retires and gives its core back; workers starting a file after that pick
+// up a share of the freed cores and run the kernel in parallel (few files x
+// many threads), so the tail of the run still uses the whole machine.
+class ThreadBudget {
+public:
+  // freeCores are spare from the start, e.g. the cores granted to a
+  // supervised worker process running a single mesh.
+  explicit ThreadBudget(size_t numWorkers, size_t freeCores = 0)
+      : activeWorkers_(numWorkers),
+        freeCores_(static_cast<ptrdiff_t>(freeCores)) {}
+
+  ThreadBudget(const ThreadBudget &) = delete;
+  ThreadBudget &operator=(const ThreadBudget &) = delete;
+
+  // Number of threads the caller may use for its next kernel, including its
+  // own. Must be paired with release(). A kernel that can not run in parallel
+  // (e.g. CGAL without TBB) passes canRunParallel = false and gets 1.
+  size_t acquire(size_t remainingFiles, bool canRunParallel = true) {
+    if (!canRunParallel) {
+      return 1;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (remainingFiles >= activeWorkers_ || freeCores_ <= 0) {
+      return 1;
+    }
+    size_t freeCores = static_cast<size_t>(freeCores_);
+    size_t extra = std::max<size_t>(1, freeCores / activeWorkers_);
+    extra = std::min(extra, freeCores);
+    freeCores_ -= static_cast<ptrdiff_t>(extra);
+    return 1 + extra;
+  }
+
+  void release(size_t granted) {
+    if (granted <= 1) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    freeCores_ += static_cast<ptrdiff_t>(granted - 1);
+  }
+
+  // Called by a worker once the file queue is empty. Returns whether its
+  // core was given back; the last active worker keeps it.
+  bool retire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (activeWorkers_ > 1) {
+      activeWorkers_ -= 1;
+      freeCores_ += 1;
+      return true;
+    }
+    return false;
+  }
+
+  // Undo a successful retire(), for a worker that finds new work (the
+  // --serve pool). If the core is lent out, the budget stays below zero
+  // until the grant holding it is released.
+  void rejoin() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    activeWorkers_ += 1;
+    freeCores_ -= 1;
+  }
+
+  static std::string modeName(size_t granted) {
+    return granted <= 1 ? std::string("sequential")
+                        : "parallel x" + std::to_string(granted);
+  }
+
+private:
+  std::mutex mutex_;
+  size_t activeWorkers_;
+  ptrdiff_t freeCores_;
+};
+
+// Threads acquired from a ThreadBudget for one kernel call, given back when
+// the grant goes out of scope.
+class ThreadGrant {
+public:
+  ThreadGrant(ThreadBudget &budget, size_t remainingFiles,
+              bool canRunParallel = true)
+      : budget_(budget),
+        granted_(budget.acquire(remainingFiles, canRunParallel)) {}
+  ~ThreadGrant() { budget_.release(granted_); }
+
+  ThreadGrant(const ThreadGrant &) = delete;
+  ThreadGrant &operator=(const ThreadGrant &) = delete;
+
+  size_t threads() const { return granted_; }
+  std::string mode() const { return ThreadBudget::modeName(granted_); }
+
+private:
+  ThreadBudget &budget_;
+  size_t granted_;
+};
+
+// Run kernel(tag) with CGAL::Sequential_tag when one thread is granted, or
+// with CGAL::Parallel_tag inside a TBB arena limited to the granted threads.
+template <typename Kernel>
+auto runWithThreads(size_t granted, Kernel kernel)
+    -> decltype(kernel(CGAL::Sequential_tag())) {
+#ifdef CGAL_LINKED_WITH_TBB
+  if (granted > 1) {
+    tbb::task_arena arena(static_cast<int>(granted));
+    decltype(kernel(CGAL::Sequential_tag())) result;
+    arena.execute([&]() { result = kernel(CGAL::Parallel_tag()); });
+    return result;
+  }
+#endif
+  return kernel(CGAL::Sequential_tag());
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "algorithm"
+#include "iostream"
+#include "string"
+
+#include "args/args.hxx"
+
+#include "metrics/kernels.h"
+#include "metrics/manifest.h"
+#include "metrics/metric_output.h"
+#include "metrics/scheduler.h"
+
+// Command line options shared by the metric tools. Every group registers its
+// flags with the parser when it is constructed, so it is declared in main()
+// next to the tool's own flags and read after ParseCLI().
+
+// Options of every metric tool: the meshes to evaluate, threads, outputs and
+// the welding of the loaded meshes.
+struct CommonArgs {
+  explicit CommonArgs(args::ArgumentParser &parser)
+      : largestFirst(parser, "largest-first",
+                     "Process the largest mesh files first.",
+                     {"largest-first"}),
+        threads(parser, "threads",
+                "Number of worker threads (default: all cores).",
+                {'j', "threads"}, defaultThreadCount()),
+        outputFormat(
+            parser, "output-format",
+            "Where to write the results: text (one file per mesh and metric, "
+            "default), columnar (<mesh_dir>_results.bin) or both.",
+            {"output-format"}, "text"),
+        noCache(parser, "no-cache",
+                "Recompute every mesh instead of reusing the results cached "
+                "in <mesh_dir>_metric_cache.tsv.",
+                {"no-cache"}),
+        manifest(parser, "manifest",
+                 "Evaluate the mesh paths listed in this file, one per line "
+                 "(- reads stdin), instead of a folder. mesh_dir then only "
+                 "names the cache and results files.",
+                 {"manifest"}),
+        shard(parser, "i/N",
+              "Evaluate only shard i of N (0 <= i < N), balanced by file "
+              "size. The cache and results files get a _shard<i>of<N> "
+              "suffix.",
+              {"shard"}),
+        weldTolerance(
+            parser, "tolerance",
+            "Merge the vertices of a loaded mesh closer than this fraction "
+            "of its bounding box half extent (default 0: equal coordinates "
+            "only).",
+            {"weld-tolerance"}, 0.0),
+        meshDir(parser, "mesh_dir", "Directory contains mesh files.") {}
+
+  CommonArgs(const CommonArgs &) = delete;
+  CommonArgs &operator=(const CommonArgs &) = delete;
+
+  size_t numThreads() { return std::max<size_t>(1, args::get(threads)); }
+
+  // Check the output format and collect the meshes of mesh_dir or the
+  // manifest. Prints the error and the usage when they are invalid.
+  bool collect(args::ArgumentParser &parser, MeshList &meshes,
+               OutputFormat &format) {
+    // Make sure a mesh name was given
+    if (!meshDir && !manifest) {
+      std::cerr << "Please specify a mesh file as argument" << std::endl;
+      return false;
+    }
+    if (!parseOutputFormat(args::get(outputFormat), format) ||
+        !collectMeshFiles(args::get(meshDir), args::get(manifest),
+                          args::get(shard), meshes)) {
+      std::cerr << parser;
+      return false;
+    }
+    return true;
+  }
+
+  args::Flag largestFirst;
+  args::ValueFlag<size_t> threads;
+  args::ValueFlag<std::string> outputFormat;
+  args::Flag noCache;
+  args::ValueFlag<std::string> manifest;
+  args::ValueFlag<std::string> shard;
+  args::ValueFlag<double> weldTolerance;
+  args::Positional<std::string> meshDir;
+};
+
+// Options of the tools computing SIR: --sir-engine, --sir-samples and
+// --sir-error.
+struct SelfIntersectionArgs {
+  explicit SelfIntersectionArgs(args::ArgumentParser &parser)
+      : engine(parser, "engine",
+               "Self intersection engine: cgal (default, CGAL's box "
+               "intersection) or bvh (flat BVH broad phase with the same "
+               "predicates).",
+               {"sir-engine"}, "cgal"),
+        samples(parser, "faces",
+                "Estimate SIR from this many sampled faces, with a 95% "
+                "confidence interval, instead of testing every face "
+                "(default 0: exact).",
+                {"sir-samples"}, 0),
+        maxError(parser, "error",
+                 "Estimate SIR from sampled faces, sampling until the 95% "
+                 "confidence interval is within this distance of the "
+                 "estimate.",
+                 {"sir-error"}, 0.0) {}
+
+  SelfIntersectionArgs(const SelfIntersectionArgs &) = delete;
+  SelfIntersectionArgs &operator=(const SelfIntersectionArgs &) = delete;
+
+  // Prints the error and the usage when the options are invalid.
+  bool parse(args::ArgumentParser &parser, SelfIntersectionOptions &options) {
+    if (!parseSelfIntersectionOptions(args::get(engine), args::get(samples),
+                                      args::get(maxError), options)) {
+      std::cerr << parser;
+      return false;
+    }
+    return true;
+  }
+
+  args::ValueFlag<std::string> engine;
+  args::ValueFlag<size_t> samples;
+  args::ValueFlag<double> maxError;
+};
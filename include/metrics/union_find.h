@@ -0,0 +1,223 @@
+#pragma once
+
+#include "algorithm"
+#include "atomic"
+#include "cstdint"
+#include "memory"
+#include "thread"
+#include "vector"
+
+#include "metrics/flat_mesh.h"
+#include "metrics/workspace.h"
+
+// Array based disjoint-set forest with path compression and union by rank.
+class DisjointSet {
+public:
+  explicit DisjointSet(size_t size) { init(size, ownParent_, ownRank_); }
+
+  // Over the given arrays, e.g. those of a Workspace, which keep their
+  // capacity for the next forest.
+  DisjointSet(size_t size, std::vector<uint32_t> &parent,
+              std::vector<uint8_t> &rank) {
+    init(size, parent, rank);
+  }
+
+  DisjointSet(const DisjointSet &) = delete;
+  DisjointSet &operator=(const DisjointSet &) = delete;
+
+  uint32_t find(uint32_t x) {
+    uint32_t root = x;
+    while (parent_[root] != root) {
+      root = parent_[root];
+    }
+    while (parent_[x] != root) {
+      uint32_t next = parent_[x];
+      parent_[x] = root;
+      x = next;
+    }
+    return root;
+  }
+
+  // Returns true when a and b were in different sets.
+  bool unite(uint32_t a, uint32_t b) {
+    a = find(a);
+    b = find(b);
+    if (a == b) {
+      return false;
+    }
+    if (rank_[a] < rank_[b]) {
+      std::swap(a, b);
+    }
+    parent_[b] = a;
+    if (rank_[a] == rank_[b]) {
+      rank_[a] += 1;
+    }
+    return true;
+  }
+
+private:
+  void init(size_t size, std::vector<uint32_t> &parent,
+            std::vector<uint8_t> &rank) {
+    parent.resize(size);
+    for (size_t i = 0; i < size; ++i) {
+      parent[i] = static_cast<uint32_t>(i);
+    }
+    rank.assign(size, 0);
+    parent_ = parent.data();
+    rank_ = rank.data();
+  }
+
+  std::vector<uint32_t> ownParent_;
+  std::vector<uint8_t> ownRank_;
+  uint32_t *parent_ = nullptr;
+  uint8_t *rank_ = nullptr;
+};
+
+// Lock-free disjoint-set forest for concurrent unions. A root is always
+// linked under the smaller root index with a CAS, so no cycle can form;
+// finds compress paths by halving.
+class ConcurrentDisjointSet {
+public:
+  explicit ConcurrentDisjointSet(size_t size)
+      : ConcurrentDisjointSet(size, own_) {}
+
+  // Over the given array, e.g. that of a Workspace.
+  ConcurrentDisjointSet(size_t size, AtomicIndexArray &parent)
+      : parent_(parent.reserve(size)) {
+    for (size_t i = 0; i < size; ++i) {
+      parent_[i].store(static_cast<uint32_t>(i), std::memory_order_relaxed);
+    }
+  }
+
+  ConcurrentDisjointSet(const ConcurrentDisjointSet &) = delete;
+  ConcurrentDisjointSet &operator=(const ConcurrentDisjointSet &) = delete;
+
+  uint32_t find(uint32_t x) {
+    while (true) {
+      uint32_t p = parent_[x].load(std::memory_order_relaxed);
+      if (p == x) {
+        return x;
+      }
+      uint32_t gp = parent_[p].load(std::memory_order_relaxed);
+      if (p != gp) {
+        parent_[x].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+      }
+      x = gp;
+    }
+  }
+
+  void unite(uint32_t a, uint32_t b) {
+    while (true) {
+      a = find(a);
+      b = find(b);
+      if (a == b) {
+        return;
+      }
+      if (a < b) {
+        std::swap(a, b);
+      }
+      uint32_t expected = a;
+      if (parent_[a].compare_exchange_strong(expected, b,
+                                             std::memory_order_relaxed)) {
+        return;
+      }
+    }
+  }
+
+private:
+  AtomicIndexArray own_;
+  std::atomic<uint32_t> *parent_;
+};
+
+struct ComponentStats {
+  size_t count = 0;
+  // Per component sizes, filled only when requested. Sorted by decreasing
+  // face count.
+  std::vector<size_t> faces;
+  std::vector<size_t> vertices;
+};
+
+// Meshes with fewer triangles than this are not worth the thread start-up of
+// the concurrent variant.
+static const size_t kParallelUnionMinTriangles = 1 << 20;
+
+// Connected components of the vertex graph spanned by the triangles. Every
+// vertex counts, so an isolated vertex is a component of its own. The per
+// vertex arrays come from workspace when one is given.
+inline ComponentStats computeComponents(const MeshView &mesh,
+                                        bool perComponent,
+                                        size_t numThreads = 1,
+                                        Workspace *workspace = nullptr) {
+  const size_t numVertices = mesh.numVertices;
+  const size_t numTriangles = mesh.numTriangles;
+  Workspace local;
+  Workspace &ws = workspace != nullptr ? *workspace : local;
+  std::vector<uint32_t> &root = ws.roots;
+  root.resize(numVertices);
+
+  if (numThreads > 1 && numTriangles >= kParallelUnionMinTriangles) {
+    ConcurrentDisjointSet sets(numVertices, ws.atomicParents);
+    std::vector<std::thread> workers;
+    size_t chunk = (numTriangles + numThreads - 1) / numThreads;
+    for (size_t i = 0; i < numThreads; ++i) {
+      size_t begin = std::min(numTriangles, i * chunk);
+      size_t end = std::min(numTriangles, begin + chunk);
+      workers.push_back(std::thread([&mesh, &sets, begin, end]() {
+        for (size_t t = begin; t < end; ++t) {
+          sets.unite(mesh.corner(t, 0), mesh.corner(t, 1));
+          sets.unite(mesh.corner(t, 0), mesh.corner(t, 2));
+        }
+      }));
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+    for (size_t v = 0; v < numVertices; ++v) {
+      root[v] = sets.find(static_cast<uint32_t>(v));
+    }
+  } else {
+    DisjointSet sets(numVertices, ws.parents, ws.ranks);
+    for (size_t t = 0; t < numTriangles; ++t) {
+      sets.unite(mesh.corner(t, 0), mesh.corner(t, 1));
+      sets.unite(mesh.corner(t, 0), mesh.corner(t, 2));
+    }
+    for (size_t v = 0; v < numVertices; ++v) {
+      root[v] = sets.find(static_cast<uint32_t>(v));
+    }
+  }
+
+  ComponentStats stats;
+  // Number the roots 0..count-1.
+  std::vector<uint32_t> &label = ws.labels;
+  label.assign(numVertices, UINT32_MAX);
+  for (size_t v = 0; v < numVertices; ++v) {
+    if (root[v] == v) {
+      label[v] = static_cast<uint32_t>(stats.count++);
+    }
+  }
+  if (!perComponent) {
+    return stats;
+  }
+
+  std::vector<size_t> faces(stats.count, 0);
+  std::vector<size_t> vertices(stats.count, 0);
+  for (size_t v = 0; v < numVertices; ++v) {
+    vertices[label[root[v]]] += 1;
+  }
+  for (size_t t = 0; t < numTriangles; ++t) {
+    faces[label[root[mesh.corner(t, 0)]]] += 1;
+  }
+  std::vector<size_t> order(stats.count);
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (faces[a] != faces[b]) return faces[a] > faces[b];
+    return vertices[a] > vertices[b];
+  });
+  for (size_t i : order) {
+    stats.faces.push_back(faces[i]);
+    stats.vertices.push_back(vertices[i]);
+  }
+  return stats;
+}
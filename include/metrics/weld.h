@@ -0,0 +1,366 @@
+#pragma once
+
+#include "algorithm"
+#include "cmath"
+#include "cstdint"
+#include "cstdio"
+#include "cstring"
+#include "string"
+#include "thread"
+#include "vector"
+
+#include "metrics/edge_count.h"
+#include "metrics/flat_mesh.h"
+#include "metrics/union_find.h"
+#include "metrics/workspace.h"
+
+// Vertex welding of loaded meshes.
+//
+// STL files repeat the corners of every triangle, so SegE and DangEL only see
+// the connectivity once equal corners are merged. Every vertex is hashed to a
+// grid cell, the (cell, vertex) keys are radix sorted like the edge keys of
+// DangEL, and each vertex is united with the vertices of its own and the
+// neighbouring cells that lie within the tolerance. The unions go through the
+// concurrent disjoint set, whose root is the smallest index of a set, so the
+// result does not depend on the thread count.
+//
+// With tolerance 0 the cell is the point itself and only equal coordinates
+// merge, as CGAL's polygon soup repair does. A positive tolerance is relative
+// to the half extent of the bounding box, the scale DangEL divides by.
+// Merging is transitive: a chain of vertices each within the tolerance of
+// the next becomes one vertex, which keeps the coordinates of the smallest
+// index.
+
+struct WeldOptions {
+  // Merge distance relative to the bounding box half extent, 0 merges equal
+  // coordinates only.
+  double tolerance = 0.0;
+  size_t numThreads = 1;
+};
+
+inline WeldOptions makeWeldOptions(double tolerance, size_t numThreads) {
+  WeldOptions options;
+  options.tolerance = tolerance;
+  options.numThreads = numThreads;
+  return options;
+}
+
+// Meshes with fewer vertices than this are welded on one thread.
+static const size_t kParallelWeldMinVertices = 1 << 18;
+// A tolerance giving more cells per axis than this is welded as 0, which
+// also keeps the cell coordinates within int64_t.
+static const double kWeldMaxCellsPerAxis = 1e15;
+
+// Part of the result cache ids of meshes loaded with tolerance, since their
+// metrics differ from the default ones.
+inline std::string weldCacheTag(double tolerance) {
+  if (!(tolerance > 0.0)) {
+    return "";
+  }
+  char tag[48];
+  std::snprintf(tag, sizeof(tag), "@weld=%.9g", tolerance);
+  return tag;
+}
+
+namespace weld_detail {
+
+// splitmix64 finalizer.
+inline uint64_t mixHash(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+inline uint32_t hashTriple(uint64_t a, uint64_t b, uint64_t c) {
+  return static_cast<uint32_t>(mixHash(a ^ mixHash(b ^ mixHash(c))) >> 32);
+}
+
+// Bits of value, with -0.0 as 0.0 so that the two compare and hash equal.
+inline uint64_t coordinateBits(double value) {
+  value += 0.0;
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+inline uint32_t pointHash(const MeshView &mesh, size_t v) {
+  return hashTriple(coordinateBits(mesh.px(v)), coordinateBits(mesh.py(v)),
+                    coordinateBits(mesh.pz(v)));
+}
+
+inline uint32_t cellHash(int64_t cx, int64_t cy, int64_t cz) {
+  return hashTriple(static_cast<uint64_t>(cx), static_cast<uint64_t>(cy),
+                    static_cast<uint64_t>(cz));
+}
+
+inline uint32_t keyHash(uint64_t key) {
+  return static_cast<uint32_t>(key >> 32);
+}
+
+inline uint32_t keyVertex(uint64_t key) {
+  return static_cast<uint32_t>(key & 0xffffffffu);
+}
+
+inline bool samePoint(const MeshView &mesh, uint32_t a, uint32_t b) {
+  return mesh.px(a) == mesh.px(b) && mesh.py(a) == mesh.py(b) &&
+         mesh.pz(a) == mesh.pz(b);
+}
+
+// Run job(begin, end) over n items split into numThreads chunks.
+template <typename Job>
+void runChunks(size_t n, size_t numThreads, const Job &job) {
+  if (numThreads <= 1) {
+    job(0, n);
+    return;
+  }
+  std::vector<std::thread> workers;
+  size_t chunk = (n + numThreads - 1) / numThreads;
+  for (size_t i = 0; i < numThreads; ++i) {
+    size_t begin = std::min(n, i * chunk);
+    size_t end = std::min(n, begin + chunk);
+    workers.push_back(std::thread([&job, begin, end]() { job(begin, end); }));
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+}
+
+// Move a chunk boundary of the sorted keys to the start of a hash run, so a
+// run is handled by one chunk.
+inline size_t runStart(const std::vector<uint64_t> &keys, size_t i) {
+  while (i > 0 && i < keys.size() &&
+         keyHash(keys[i]) == keyHash(keys[i - 1])) {
+    ++i;
+  }
+  return i;
+}
+
+static const uint32_t kEmptyCellSlot = UINT32_MAX;
+
+// Open addressing table from a cell hash to the first of its sorted keys,
+// kept in slots.
+class CellTable {
+public:
+  CellTable(const std::vector<uint64_t> &keys, std::vector<uint32_t> &slots)
+      : keys_(keys), slots_(slots) {
+    size_t runs = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      runs += i == 0 || keyHash(keys[i]) != keyHash(keys[i - 1]);
+    }
+    size_t size = 1;
+    while (size < 2 * runs) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    slots_.assign(size, kEmptyCellSlot);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (i == 0 || keyHash(keys[i]) != keyHash(keys[i - 1])) {
+        size_t slot = keyHash(keys[i]) & mask_;
+        while (slots_[slot] != kEmptyCellSlot) {
+          slot = (slot + 1) & mask_;
+        }
+        slots_[slot] = static_cast<uint32_t>(i);
+      }
+    }
+  }
+
+  // Index of the first key of cell hash, or keys.size() when it is empty.
+  size_t find(uint32_t hash) const {
+    size_t slot = hash & mask_;
+    while (slots_[slot] != kEmptyCellSlot) {
+      if (keyHash(keys_[slots_[slot]]) == hash) {
+        return slots_[slot];
+      }
+      slot = (slot + 1) & mask_;
+    }
+    return keys_.size();
+  }
+
+private:
+  const std::vector<uint64_t> &keys_;
+  std::vector<uint32_t> &slots_;
+  size_t mask_ = 0;
+};
+
+} // namespace weld_detail
+
+// Set representative[v] to the vertex v merges into: the smallest index of
+// its group. Pass the result to compactFlatMesh(). The keys and the forest
+// are kept in workspace when one is given.
+inline void weldVertices(const MeshView &mesh, const WeldOptions &options,
+                         std::vector<uint32_t> &representative,
+                         Workspace *workspace = nullptr) {
+  using namespace weld_detail;
+  const size_t n = mesh.numVertices;
+  representative.resize(n);
+  if (n == 0) {
+    return;
+  }
+  Workspace local;
+  Workspace &ws = workspace != nullptr ? *workspace : local;
+  const size_t numThreads =
+      n >= kParallelWeldMinVertices ? std::max<size_t>(1, options.numThreads)
+                                    : 1;
+
+  BoundingBox box = computeBoundingBox(mesh);
+  const double cell = options.tolerance * box.halfExtent();
+  const bool exact = !(cell > 0.0) || !std::isfinite(cell) ||
+                     2.0 / options.tolerance > kWeldMaxCellsPerAxis;
+  // Grid cells are twice the merge distance wide, so the vertices within it
+  // lie in the cell itself or in the neighbour on the nearer side of each
+  // axis: 8 cells to look at instead of 27.
+  const double side = 2.0 * cell;
+  auto cellOf = [&](double p, int dim) {
+    return static_cast<int64_t>(std::floor((p - box.min[dim]) / side));
+  };
+  auto finite = [&](uint32_t v) {
+    return std::isfinite(mesh.px(v)) && std::isfinite(mesh.py(v)) &&
+           std::isfinite(mesh.pz(v));
+  };
+
+  // (hash, vertex) keys, sorted so that every cell is one run.
+  std::vector<uint64_t> &keys = ws.keys;
+  keys.resize(n);
+  runChunks(n, numThreads, [&](size_t begin, size_t end) {
+    for (size_t v = begin; v < end; ++v) {
+      uint32_t vertex = static_cast<uint32_t>(v);
+      uint32_t hash = exact || !finite(vertex)
+                          ? pointHash(mesh, v)
+                          : cellHash(cellOf(mesh.px(v), 0),
+                                     cellOf(mesh.py(v), 1),
+                                     cellOf(mesh.pz(v), 2));
+      keys[v] = (static_cast<uint64_t>(hash) << 32) | vertex;
+    }
+  });
+  // Only the hash half is sorted on; the vertices of a run stay in index
+  // order.
+  radixSortKeys(keys, ws.sortScratch, numThreads, 4);
+
+  ConcurrentDisjointSet sets(n, ws.atomicParents);
+  if (exact) {
+    // Within a run, unite every vertex with the first one at the same point.
+    // Runs hold one point unless hashes collide.
+    runChunks(n, numThreads, [&](size_t begin, size_t end) {
+      std::vector<uint32_t> points;
+      const size_t last = runStart(keys, end);
+      for (size_t i = runStart(keys, begin); i < last;) {
+        size_t run = i + 1;
+        while (run < n && keyHash(keys[run]) == keyHash(keys[i])) {
+          ++run;
+        }
+        points.clear();
+        for (size_t j = i; j < run; ++j) {
+          uint32_t v = keyVertex(keys[j]);
+          auto same = std::find_if(points.begin(), points.end(),
+                                   [&](uint32_t p) {
+                                     return samePoint(mesh, p, v);
+                                   });
+          if (same == points.end()) {
+            points.push_back(v);
+          } else {
+            sets.unite(*same, v);
+          }
+        }
+        i = run;
+      }
+    });
+  } else {
+    CellTable table(keys, ws.slots);
+    const double limit = cell * cell;
+    // Rounding margin of the side test, a vertex near the middle of its cell
+    // looks at both neighbours.
+    const double margin = 1e-9 * cell;
+    runChunks(n, numThreads, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        uint32_t v = keyVertex(keys[i]);
+        if (!finite(v)) {
+          continue;
+        }
+        const double p[3] = {mesh.px(v), mesh.py(v), mesh.pz(v)};
+        int64_t c[3];
+        int64_t low[3];
+        int64_t high[3];
+        for (int dim = 0; dim < 3; ++dim) {
+          c[dim] = cellOf(p[dim], dim);
+          double offset =
+              p[dim] - box.min[dim] - static_cast<double>(c[dim]) * side;
+          low[dim] = offset <= cell + margin ? -1 : 0;
+          high[dim] = offset >= cell - margin ? 1 : 0;
+        }
+        for (int64_t dx = low[0]; dx <= high[0]; ++dx) {
+          for (int64_t dy = low[1]; dy <= high[1]; ++dy) {
+            for (int64_t dz = low[2]; dz <= high[2]; ++dz) {
+              uint32_t hash = cellHash(c[0] + dx, c[1] + dy, c[2] + dz);
+              for (size_t j = table.find(hash);
+                   j < n && keyHash(keys[j]) == hash; ++j) {
+                uint32_t u = keyVertex(keys[j]);
+                if (u <= v) {
+                  continue;
+                }
+                double ex = mesh.px(u) - p[0];
+                double ey = mesh.py(u) - p[1];
+                double ez = mesh.pz(u) - p[2];
+                if (ex * ex + ey * ey + ez * ez <= limit) {
+                  sets.unite(u, v);
+                }
+              }
+            }
+          }
+        }
+      }
+    });
+  }
+
+  runChunks(n, numThreads, [&](size_t begin, size_t end) {
+    for (size_t v = begin; v < end; ++v) {
+      representative[v] = sets.find(static_cast<uint32_t>(v));
+    }
+  });
+}
+
+// Replace every corner by representative[corner], drop the triangles that
+// became degenerate and the vertices no triangle uses. Vertex order is kept.
+inline void compactFlatMesh(FlatMesh &mesh,
+                            const std::vector<uint32_t> &representative,
+                            Workspace *workspace = nullptr) {
+  const size_t numVertices = mesh.numVertices();
+  Workspace local;
+  Workspace &ws = workspace != nullptr ? *workspace : local;
+  std::vector<uint32_t> &tris = mesh.triangles;
+  std::vector<uint8_t> &used = ws.flags;
+  used.assign(numVertices, 0);
+  size_t kept = 0;
+  for (size_t t = 0; t + 2 < tris.size(); t += 3) {
+    uint32_t a = representative[tris[t]];
+    uint32_t b = representative[tris[t + 1]];
+    uint32_t c = representative[tris[t + 2]];
+    if (a == b || b == c || a == c) {
+      continue;
+    }
+    tris[kept++] = a;
+    tris[kept++] = b;
+    tris[kept++] = c;
+    used[a] = used[b] = used[c] = 1;
+  }
+  tris.resize(kept);
+
+  std::vector<uint32_t> &remap = ws.remap;
+  remap.assign(numVertices, 0);
+  size_t next = 0;
+  for (size_t v = 0; v < numVertices; ++v) {
+    if (used[v]) {
+      remap[v] = static_cast<uint32_t>(next);
+      mesh.x[next] = mesh.x[v];
+      mesh.y[next] = mesh.y[v];
+      mesh.z[next] = mesh.z[v];
+      ++next;
+    }
+  }
+  mesh.resizeVertices(next);
+  for (uint32_t &index : tris) {
+    index = remap[index];
+  }
+}
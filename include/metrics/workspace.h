@@ -0,0 +1,121 @@
+#pragma once
+
+#include "atomic"
+#include "cstdint"
+#include "memory"
+#include "vector"
+
+#include "metrics/flat_mesh.h"
+
+// Memory of the per-mesh work of one worker.
+//
+// Loading a mesh and running the flat kernels on it needs a handful of
+// arrays as long as the mesh: the loaded coordinates and triangles, keys to
+// sort, union-find parents, labels. Allocating them afresh for every mesh
+// makes dozens of workers contend in malloc and fragments the heap over a
+// long run. Instead every worker keeps one Workspace for its whole life and
+// the loader and the kernels take their arrays from it. The arrays keep
+// their capacity from one mesh to the next, so after the first few meshes
+// the hot loop allocates nothing. trim() drops them after an unusually
+// large mesh, which keeps the memory of a worker bounded.
+//
+// The kernels take a Workspace pointer that defaults to null, in which case
+// they use arrays of their own as before. A workspace is used by one mesh
+// at a time: the kernel threads a worker starts share the arrays, but two
+// workers never do.
+
+// A workspace holding more than this after a mesh is released.
+static const size_t kWorkspaceKeepBytes = size_t(256) << 20;
+
+// Reusable array of atomic indices, which std::vector can not resize.
+class AtomicIndexArray {
+public:
+  // At least size entries, uninitialized.
+  std::atomic<uint32_t> *reserve(size_t size) {
+    if (size > capacity_) {
+      data_.reset(new std::atomic<uint32_t>[size]);
+      capacity_ = size;
+    }
+    return data_.get();
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  void release() {
+    data_.reset();
+    capacity_ = 0;
+  }
+
+private:
+  std::unique_ptr<std::atomic<uint32_t>[]> data_;
+  size_t capacity_ = 0;
+};
+
+struct Workspace {
+  // The loaded mesh.
+  FlatMesh mesh;
+  // Edge keys of DangEL, cell keys of the weld, and their radix sort buffer.
+  std::vector<uint64_t> keys;
+  std::vector<uint64_t> sortScratch;
+  // Union-find forests of SegE and of the weld.
+  std::vector<uint32_t> parents;
+  std::vector<uint8_t> ranks;
+  AtomicIndexArray atomicParents;
+  // Per vertex results: component roots and labels, weld representatives.
+  std::vector<uint32_t> roots;
+  std::vector<uint32_t> labels;
+  // Vertex remap and used flags of compactFlatMesh(), cell table slots of
+  // the weld. The soup orientation keeps its traversal stack, oriented
+  // flags and visit marks in them.
+  std::vector<uint32_t> remap;
+  std::vector<uint8_t> flags;
+  std::vector<uint32_t> slots;
+  // Vertex to triangle incidence of the soup orientation (polygon_soup.h)
+  // and the start of every vertex's edges in its sorted edge keys, which
+  // take the keys array.
+  std::vector<uint32_t> incidenceOffsets;
+  std::vector<uint32_t> incidentTriangles;
+  std::vector<uint32_t> edgeOffsets;
+
+  size_t bytes() const {
+    return mesh.x.capacity() * sizeof(double) +
+           mesh.y.capacity() * sizeof(double) +
+           mesh.z.capacity() * sizeof(double) +
+           mesh.triangles.capacity() * sizeof(uint32_t) +
+           (keys.capacity() + sortScratch.capacity()) * sizeof(uint64_t) +
+           (parents.capacity() + roots.capacity() + labels.capacity() +
+            remap.capacity() + slots.capacity() +
+            incidenceOffsets.capacity() + incidentTriangles.capacity() +
+            edgeOffsets.capacity()) *
+               sizeof(uint32_t) +
+           ranks.capacity() + flags.capacity() +
+           atomicParents.capacity() * sizeof(std::atomic<uint32_t>);
+  }
+
+  // Release every array when the workspace holds more than maxBytes. Call
+  // between meshes.
+  void trim(size_t maxBytes = kWorkspaceKeepBytes) {
+    if (bytes() <= maxBytes) {
+      return;
+    }
+    mesh = FlatMesh();
+    releaseVector(keys);
+    releaseVector(sortScratch);
+    releaseVector(parents);
+    releaseVector(ranks);
+    atomicParents.release();
+    releaseVector(roots);
+    releaseVector(labels);
+    releaseVector(remap);
+    releaseVector(flags);
+    releaseVector(slots);
+    releaseVector(incidenceOffsets);
+    releaseVector(incidentTriangles);
+    releaseVector(edgeOffsets);
+  }
+
+private:
+  template <typename T> static void releaseVector(std::vector<T> &vector) {
+    std::vector<T>().swap(vector);
+  }
+};
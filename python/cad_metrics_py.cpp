@@ -0,0 +1,387 @@
+#include "chrono"
+#include "cstdint"
+#include "limits"
+#include "memory"
+#include "stdexcept"
+#include "string"
+#include "vector"
+
+#include "pybind11/numpy.h"
+#include "pybind11/pybind11.h"
+
+#include "metrics/common.h"
+#include "metrics/kernels.h"
+#include "metrics/mesh_loader.h"
+#include "metrics/results_file.h"
+#include "metrics/scheduler.h"
+#include "metrics/thread_budget.h"
+
+namespace py = pybind11;
+
+// Python module cad_metrics: the metric kernels on numpy arrays.
+//
+// A mesh is a (V, 3) float64 vertex array and a (F, 3) uint32 or int32 face
+// array. C contiguous arrays of these types are read in place, other arrays
+// are converted once. The kernels run with the GIL released, and
+// evaluate_batch() spreads a list of meshes over a worker pool the way
+// cad_metrics spreads files.
+
+// A mesh given from Python. Keeps the arrays (or their converted copies)
+// alive while the kernels read them, so it must be created and destroyed
+// with the GIL held.
+class PyMesh {
+public:
+  // With clean, the mesh is copied, welded and oriented like a loaded file
+  // (see cleanFlatMesh()); otherwise the vertices are used as given.
+  PyMesh(py::handle vertices, py::handle faces, bool clean) {
+    vertices_ = VertexArray::ensure(vertices);
+    if (!vertices_ || vertices_.ndim() != 2 || vertices_.shape(1) != 3) {
+      throw py::value_error("vertices must be a (V, 3) float array");
+    }
+    const size_t numVertices = static_cast<size_t>(vertices_.shape(0));
+
+    py::array array = py::array::ensure(faces);
+    if (!array || array.ndim() != 2 || array.shape(1) != 3) {
+      throw py::value_error("faces must be a (F, 3) integer array");
+    }
+    const size_t numCorners = 3 * static_cast<size_t>(array.shape(0));
+    const uint32_t *triangles = nullptr;
+    if (py::isinstance<py::array_t<uint32_t>>(array) ||
+        py::isinstance<py::array_t<int32_t>>(array)) {
+      // Same width as the kernels' indices: negative int32 indices read as
+      // huge uint32 ones and fail the range check below.
+      faces_ = py::array::ensure(array, py::array::c_style);
+      triangles = static_cast<const uint32_t *>(faces_.data());
+    } else if (array.dtype().kind() == 'i' || array.dtype().kind() == 'u') {
+      // Other integer types (numpy's default int64) are narrowed once.
+      auto wide = py::array_t<int64_t, py::array::c_style |
+                                           py::array::forcecast>::ensure(array);
+      const int64_t *data = wide.data();
+      converted_.resize(numCorners);
+      for (size_t i = 0; i < numCorners; ++i) {
+        converted_[i] = data[i] < 0 || static_cast<uint64_t>(data[i]) >=
+                                           numVertices
+                            ? std::numeric_limits<uint32_t>::max()
+                            : static_cast<uint32_t>(data[i]);
+      }
+      triangles = converted_.data();
+    } else {
+      throw py::value_error("faces must be a (F, 3) integer array");
+    }
+    for (size_t i = 0; i < numCorners; ++i) {
+      if (triangles[i] >= numVertices) {
+        throw py::value_error("face index out of range");
+      }
+    }
+
+    const double *points = vertices_.data();
+    if (clean) {
+      for (size_t v = 0; v < numVertices; ++v) {
+        flat_.addVertex(points[3 * v], points[3 * v + 1], points[3 * v + 2]);
+      }
+      flat_.triangles.assign(triangles, triangles + numCorners);
+      if (!cleanFlatMesh(flat_)) {
+        throw py::value_error("faces do not form a polygon mesh");
+      }
+      view_ = flat_.view();
+      return;
+    }
+    view_.x = points;
+    view_.y = points + 1;
+    view_.z = points + 2;
+    view_.stride = 3;
+    view_.triangles = triangles;
+    view_.numVertices = numVertices;
+    view_.numTriangles = numCorners / 3;
+  }
+
+  PyMesh(const PyMesh &) = delete;
+  PyMesh &operator=(const PyMesh &) = delete;
+
+  const MeshView &view() const { return view_; }
+
+private:
+  typedef py::array_t<double, py::array::c_style | py::array::forcecast>
+      VertexArray;
+
+  VertexArray vertices_;
+  py::array faces_;
+  std::vector<uint32_t> converted_;
+  FlatMesh flat_;
+  MeshView view_;
+};
+
+size_t resolveThreads(size_t threads) {
+  return threads == 0 ? defaultThreadCount() : threads;
+}
+
+SelfIntersectionResult
+selfIntersection(const MeshView &mesh, const SelfIntersectionOptions &options,
+                 size_t threads) {
+  Mesh cmesh;
+  if (!buildSurfaceMesh(mesh, cmesh)) {
+    throw std::runtime_error("The mesh is not a triangle mesh");
+  }
+  SelfIntersectionResult result =
+      computeSelfIntersectionRatio(cmesh, options, threads);
+  if (result.faces_num == 0) {
+    throw std::runtime_error("The mesh has no faces");
+  }
+  return result;
+}
+
+double selfIntersectionRatio(const MeshView &mesh,
+                             const SelfIntersectionOptions &options,
+                             size_t threads) {
+  SelfIntersectionResult result = selfIntersection(mesh, options, threads);
+  return static_cast<double>(result.self_intersect_faces_num) /
+         static_cast<double>(result.faces_num);
+}
+
+// Run the selected metrics on mesh into record, with the threads the budget
+// grants while work still has meshes queued and the arrays of the worker's
+// workspace. A failing metric gets kStatusFailed and the others still run.
+template <typename Work>
+void evaluateMesh(const MeshView &mesh, const MetricSelection &selection,
+                  Work &work, ThreadBudget &budget, Workspace &workspace,
+                  MetricRecord &record) {
+  record.faces = mesh.numTriangles;
+  auto run = [&](bool selected, MetricColumn column, bool canRunParallel,
+                 auto kernel) {
+    if (!selected) {
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    try {
+      ThreadGrant grant(budget, work.remaining(), canRunParallel);
+      record.value[column] = kernel(grant.threads());
+      record.status[column] = kStatusOk;
+    } catch (const std::exception &) {
+      record.status[column] = kStatusFailed;
+    }
+    record.seconds[column] = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+  };
+  run(selection.segment, kSegmentColumn, true, [&](size_t threads) {
+    return static_cast<double>(
+        computeSegmentNumber(mesh, threads, &workspace));
+  });
+  run(selection.dangling, kDanglingColumn, true, [&](size_t threads) {
+    return computeDanglingEdgeLength(mesh, threads, &workspace);
+  });
+  run(selection.flux, kFluxColumn, true, [&](size_t threads) {
+    return computeFluxEnclosureError(mesh, threads);
+  });
+  run(selection.self_intersection, kSelfIntersectionColumn,
+      selfIntersectionRunsParallel(selection.self_intersection_options),
+      [&](size_t threads) {
+        return selfIntersectionRatio(
+            mesh, selection.self_intersection_options, threads);
+      });
+}
+
+// A single mesh: nothing else is queued, every thread goes to its kernels.
+struct SingleMesh {
+  size_t remaining() const { return 0; }
+};
+
+SelfIntersectionOptions sirOptionsOf(const std::string &name) {
+  SelfIntersectionOptions options;
+  if (!parseSelfIntersectionEngine(name, options.engine)) {
+    throw py::value_error("unknown sir_engine '" + name +
+                          "', expected cgal or bvh");
+  }
+  return options;
+}
+
+MetricSelection selectionOf(const std::string &metrics,
+                            const std::string &sirEngine) {
+  MetricSelection selection;
+  if (!parseMetricSelection(metrics, selection)) {
+    throw py::value_error("unknown metric in '" + metrics +
+                          "', expected segment, dangling, flux, self or all");
+  }
+  selection.self_intersection_options = sirOptionsOf(sirEngine);
+  return selection;
+}
+
+// {column name: value} of the selected metrics, None for failed ones.
+py::dict recordToDict(const MetricRecord &record) {
+  py::dict result;
+  for (int column = 0; column < kNumMetricColumns; ++column) {
+    uint8_t status = record.status[column];
+    if (status == kStatusNotRun) {
+      continue;
+    }
+    py::object value = py::none();
+    if (metricStatusHasValue(status)) {
+      value = column == kSegmentColumn
+                  ? py::object(py::int_(
+                        static_cast<int64_t>(record.value[column])))
+                  : py::object(py::float_(record.value[column]));
+    }
+    result[kMetricColumnNames[column]] = value;
+  }
+  return result;
+}
+
+py::dict evaluate(py::handle vertices, py::handle faces,
+                  const std::string &metrics, size_t threads, bool clean,
+                  const std::string &sirEngine) {
+  MetricSelection selection = selectionOf(metrics, sirEngine);
+  PyMesh mesh(vertices, faces, clean);
+  MetricRecord record;
+  {
+    py::gil_scoped_release release;
+    size_t numThreads = resolveThreads(threads);
+    ThreadBudget budget(1, numThreads - 1);
+    SingleMesh work;
+    Workspace workspace;
+    evaluateMesh(mesh.view(), selection, work, budget, workspace, record);
+  }
+  return recordToDict(record);
+}
+
+py::list evaluateBatch(py::sequence meshes, const std::string &metrics,
+                       size_t threads, bool clean,
+                       const std::string &sirEngine) {
+  MetricSelection selection = selectionOf(metrics, sirEngine);
+  std::vector<std::unique_ptr<PyMesh>> views;
+  views.reserve(meshes.size());
+  for (py::handle item : meshes) {
+    if (!py::isinstance<py::sequence>(item) || py::len(item) != 2) {
+      throw py::value_error("meshes must be (vertices, faces) pairs");
+    }
+    py::sequence pair = py::reinterpret_borrow<py::sequence>(item);
+    views.emplace_back(new PyMesh(pair[0], pair[1], clean));
+  }
+
+  std::vector<MetricRecord> records(views.size());
+  {
+    py::gil_scoped_release release;
+    size_t numThreads = resolveThreads(threads);
+    size_t numWorkers = std::max<size_t>(
+        1, std::min<size_t>(numThreads, views.size()));
+    // The scheduler only hands out indices, the names are not read.
+    std::vector<std::string> names(views.size());
+    FileScheduler scheduler(names, false);
+    ThreadBudget budget(numWorkers, numThreads - numWorkers);
+    runWorkers(numWorkers, [&](size_t) {
+      Workspace workspace;
+      size_t index;
+      while (scheduler.next(index)) {
+        evaluateMesh(views[index]->view(), selection, scheduler, budget,
+                     workspace, records[index]);
+        workspace.trim();
+      }
+      budget.retire();
+    });
+  }
+
+  py::list results;
+  for (const MetricRecord &record : records) {
+    results.append(recordToDict(record));
+  }
+  return results;
+}
+
+// One metric of one mesh, raising RuntimeError when it can not be computed.
+template <typename Kernel>
+auto runKernel(py::handle vertices, py::handle faces, size_t threads,
+               bool clean, Kernel kernel)
+    -> decltype(kernel(MeshView(), size_t())) {
+  PyMesh mesh(vertices, faces, clean);
+  py::gil_scoped_release release;
+  return kernel(mesh.view(), resolveThreads(threads));
+}
+
+PYBIND11_MODULE(cad_metrics, m) {
+  m.doc() = "CAD-MLLM mesh metrics (SegE, DangEL, FluxEE, SIR) on numpy "
+            "arrays";
+
+  m.def(
+      "segment_number",
+      [](py::handle vertices, py::handle faces, size_t threads, bool clean) {
+        return runKernel(vertices, faces, threads, clean,
+                         [](const MeshView &mesh, size_t numThreads) {
+                           return computeSegmentNumber(mesh, numThreads);
+                         });
+      },
+      "SegE: number of connected components.", py::arg("vertices"),
+      py::arg("faces"), py::arg("threads") = 0, py::arg("clean") = false);
+  m.def(
+      "dangling_edge_length",
+      [](py::handle vertices, py::handle faces, size_t threads, bool clean) {
+        return runKernel(vertices, faces, threads, clean,
+                         [](const MeshView &mesh, size_t numThreads) {
+                           return computeDanglingEdgeLength(mesh, numThreads);
+                         });
+      },
+      "DangEL: boundary edge length over the bounding box half extent.",
+      py::arg("vertices"), py::arg("faces"), py::arg("threads") = 0,
+      py::arg("clean") = false);
+  m.def(
+      "flux_enclosure_error",
+      [](py::handle vertices, py::handle faces, size_t threads, bool clean) {
+        return runKernel(vertices, faces, threads, clean,
+                         [](const MeshView &mesh, size_t numThreads) {
+                           return computeFluxEnclosureError(mesh, numThreads);
+                         });
+      },
+      "FluxEE: flux of (1, 1, 1) through the surface.", py::arg("vertices"),
+      py::arg("faces"), py::arg("threads") = 0, py::arg("clean") = false);
+  m.def(
+      "self_intersection_ratio",
+      [](py::handle vertices, py::handle faces, size_t threads, bool clean,
+         const std::string &sirEngine) {
+        SelfIntersectionOptions options = sirOptionsOf(sirEngine);
+        return runKernel(vertices, faces, threads, clean,
+                         [options](const MeshView &mesh, size_t numThreads) {
+                           return selfIntersectionRatio(mesh, options,
+                                                        numThreads);
+                         });
+      },
+      "SIR: fraction of faces intersecting another face.",
+      py::arg("vertices"), py::arg("faces"), py::arg("threads") = 0,
+      py::arg("clean") = false, py::arg("sir_engine") = "cgal");
+  m.def(
+      "self_intersection_estimate",
+      [](py::handle vertices, py::handle faces, size_t samples,
+         double error, size_t threads, bool clean) {
+        SelfIntersectionOptions options;
+        if (!parseSelfIntersectionOptions("bvh", samples, error, options) ||
+            !options.sampled()) {
+          throw py::value_error("expected samples > 0 or 0 < error < 1");
+        }
+        SelfIntersectionResult result = runKernel(
+            vertices, faces, threads, clean,
+            [&options](const MeshView &mesh, size_t numThreads) {
+              return selfIntersection(mesh, options, numThreads);
+            });
+        py::dict estimate;
+        estimate["ratio"] =
+            static_cast<double>(result.self_intersect_faces_num) /
+            static_cast<double>(result.faces_num);
+        estimate["low"] = result.ratio_low;
+        estimate["high"] = result.ratio_high;
+        estimate["samples"] = result.sampled_faces_num;
+        return estimate;
+      },
+      "SIR estimated from sampled faces: {ratio, low, high, samples} with "
+      "the 95% confidence interval [low, high]. error > 0 samples until the "
+      "interval is within error of the ratio.",
+      py::arg("vertices"), py::arg("faces"), py::arg("samples") = 1024,
+      py::arg("error") = 0.0, py::arg("threads") = 0,
+      py::arg("clean") = false);
+  m.def("evaluate", &evaluate,
+        "Selected metrics of one mesh as {name: value}, None for failed "
+        "metrics.",
+        py::arg("vertices"), py::arg("faces"), py::arg("metrics") = "all",
+        py::arg("threads") = 0, py::arg("clean") = false,
+        py::arg("sir_engine") = "cgal");
+  m.def("evaluate_batch", &evaluateBatch,
+        "evaluate() over a list of (vertices, faces) pairs, in parallel.",
+        py::arg("meshes"), py::arg("metrics") = "all", py::arg("threads") = 0,
+        py::arg("clean") = false, py::arg("sir_engine") = "cgal");
+}
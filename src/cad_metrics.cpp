@@ -0,0 +1,731 @@
+#include "unordered_map"
+
+#include "metrics/common.h"
+#include "metrics/eval_server.h"
+#include "metrics/kernels.h"
+#include "metrics/manifest.h"
+#include "metrics/metric_output.h"
+#include "metrics/profiler.h"
+#include "metrics/result_cache.h"
+#include "metrics/results_file.h"
+#include "metrics/run_journal.h"
+#include "metrics/scheduler.h"
+#include "metrics/supervisor.h"
+#include "metrics/thread_budget.h"
+#include "metrics/tool_args.h"
+
+#include "args/args.hxx"
+
+// Run the metrics flagged in run on inputFilename in a worker process under
+// the supervisor's limits. The worker gets the cores a kernel would get here.
+void superviseMeshMetrics(const std::string &inputFilename,
+                          FileScheduler &scheduler, ThreadBudget &budget,
+                          MetricOutput &output,
+                          const MetricSelection &selection,
+                          const bool (&run)[kNumMetricColumns],
+                          const Supervisor &supervisor) {
+  static const char *const names[kNumMetricColumns] = {"segment", "dangling",
+                                                       "flux", "self"};
+  std::string metrics;
+  for (int column = 0; column < kNumMetricColumns; ++column) {
+    if (run[column]) {
+      metrics += (metrics.empty() ? "" : ",") + std::string(names[column]);
+    }
+  }
+  ThreadGrant grant(budget, scheduler.remaining());
+  std::vector<std::string> args = {"--worker-file", inputFilename, "-m",
+                                   metrics, "-j",
+                                   std::to_string(grant.threads())};
+  if (selection.segment_stats) {
+    args.push_back("--segment-stats");
+  }
+  if (selection.boundary_edges) {
+    args.push_back("--boundary-edges");
+  }
+  const SelfIntersectionOptions &sir = selection.self_intersection_options;
+  if (sir.engine == SelfIntersectionEngine::Bvh) {
+    args.push_back("--sir-engine");
+    args.push_back("bvh");
+  }
+  if (sir.samples > 0) {
+    args.push_back("--sir-samples");
+    args.push_back(std::to_string(sir.samples));
+  }
+  if (sir.maxError > 0.0) {
+    char maxError[32];
+    std::snprintf(maxError, sizeof(maxError), "%.17g", sir.maxError);
+    args.push_back("--sir-error");
+    args.push_back(maxError);
+  }
+  if (selection.weld_tolerance > 0.0) {
+    char tolerance[32];
+    std::snprintf(tolerance, sizeof(tolerance), "%.17g",
+                  selection.weld_tolerance);
+    args.push_back("--weld-tolerance");
+    args.push_back(tolerance);
+  }
+  if (selection.stream) {
+    args.push_back("--stream");
+    args.push_back("--stream-memory");
+    args.push_back(std::to_string(selection.stream_options.memoryBytes >> 20));
+    if (!selection.stream_options.tmpDir.empty()) {
+      args.push_back("--stream-tmp");
+      args.push_back(selection.stream_options.tmpDir);
+    }
+  }
+  supervisor.run(inputFilename, args, output, run);
+}
+
+// Run the metrics flagged in run on the loaded mesh. work is what hands out
+// the meshes (the FileScheduler, or the request queue of --serve); the
+// number of meshes it still holds decides the thread grants. The flat
+// kernels work in the worker's workspace.
+template <typename Work>
+void computeLoadedMeshMetrics(const std::string &inputFilename,
+                              const FlatMesh &mesh,
+                              const bool (&run)[kNumMetricColumns],
+                              Work &work, ThreadBudget &budget,
+                              MetricOutput &output,
+                              const MetricSelection &selection,
+                              Workspace &workspace, ProfileLog *profile) {
+  output.setFaces(mesh.numTriangles());
+
+  // Each metric is guarded separately so one failure does not hide the
+  // others.
+  if (run[kSegmentColumn]) {
+    CGAL::Real_timer timer;
+    timer.start();
+    try {
+      ComponentStats stats;
+      {
+        StageTimer stage(profile, kStageSegment, inputFilename);
+        stage.setCounts(mesh.numTriangles(), mesh.numVertices());
+        ThreadGrant grant(budget, work.remaining());
+        stats = computeComponents(mesh.view(), selection.segment_stats,
+                                  grant.threads(), &workspace);
+      }
+      // The extra list first: once the metric is written it is journaled
+      // as complete.
+      if (selection.segment_stats) {
+        output.writeText(kSegmentStatsSuffix, formatSegmentStats(stats),
+                         "Segment statistics");
+      }
+      output.write(kSegmentColumn, std::to_string(stats.count),
+                   timer.time());
+    } catch (const std::exception &err) {
+      std::cerr << "Error: " << err.what() << std::endl;
+      std::cout << "Failed computing segment number." << std::endl;
+      output.fail(kSegmentColumn, kStatusFailed, timer.time());
+    }
+  }
+
+  if (run[kDanglingColumn]) {
+    CGAL::Real_timer timer;
+    timer.start();
+    try {
+      DanglingEdgeResult result;
+      {
+        StageTimer stage(profile, kStageDangling, inputFilename);
+        stage.setCounts(mesh.numTriangles(), mesh.numVertices());
+        ThreadGrant grant(budget, work.remaining());
+        result = computeDanglingEdges(mesh.view(), selection.boundary_edges,
+                                      grant.threads(), &workspace);
+      }
+      if (selection.boundary_edges) {
+        output.writeText(kBoundaryEdgesSuffix, formatBoundaryEdges(result),
+                         "Boundary edges");
+      }
+      std::ostringstream content;
+      content << result.normalizedLength();
+      output.write(kDanglingColumn, content.str(), timer.time());
+    } catch (const std::exception &err) {
+      std::cerr << "Error: " << err.what() << std::endl;
+      std::cout << "Failed computing dangling edge length." << std::endl;
+      output.fail(kDanglingColumn, kStatusFailed, timer.time());
+    }
+  }
+
+  if (run[kFluxColumn]) {
+    CGAL::Real_timer timer;
+    timer.start();
+    try {
+      double flux;
+      {
+        StageTimer stage(profile, kStageFlux, inputFilename);
+        stage.setCounts(mesh.numTriangles(), mesh.numVertices());
+        ThreadGrant grant(budget, work.remaining());
+        flux = computeFluxEnclosureError(mesh.view(), grant.threads());
+      }
+      std::ostringstream content;
+      content << std::fixed << flux;
+      output.write(kFluxColumn, content.str(), timer.time());
+    } catch (const std::exception &err) {
+      std::cerr << "Error: " << err.what() << std::endl;
+      std::cout << "Failed computing flux enclosure error." << std::endl;
+      output.fail(kFluxColumn, kStatusFailed, timer.time());
+    }
+  }
+
+  if (run[kSelfIntersectionColumn]) {
+    CGAL::Real_timer timer;
+    timer.start();
+    try {
+      // The halfedge mesh is only built for the SIR predicates.
+      Mesh cmesh;
+      {
+        StageTimer stage(profile, kStageBuild, inputFilename);
+        if (!buildSurfaceMesh(mesh.view(), cmesh)) {
+          throw std::runtime_error("Invalid data.");
+        }
+        stage.setCounts(cmesh.num_faces(), cmesh.num_vertices());
+      }
+      SelfIntersectionResult result;
+      {
+        StageTimer stage(profile, kStageSelfIntersection, inputFilename);
+        ThreadGrant grant(
+            budget, work.remaining(),
+            selfIntersectionRunsParallel(selection.self_intersection_options));
+        std::cout << "Self intersection of " << inputFilename << " runs "
+                  << grant.mode() << std::endl;
+        result = computeSelfIntersectionRatio(
+            cmesh, selection.self_intersection_options, grant.threads());
+        stage.setCounts(cmesh.num_faces(), cmesh.num_vertices());
+        stage.setPairs(result.intersecting_pairs_num);
+      }
+      output.write(kSelfIntersectionColumn, formatSelfIntersection(result),
+                   timer.time());
+    } catch (const std::exception &err) {
+      std::cerr << "Error: " << err.what() << std::endl;
+      std::cout << "Failed computing self intersection." << std::endl;
+      output.fail(kSelfIntersectionColumn, kStatusFailed, timer.time());
+    }
+  }
+}
+
+// Run the metrics flagged in run on the file in bounded memory (--stream),
+// without loading the mesh. The parsing of main() keeps SIR and the segment
+// statistics out of run.
+void computeStreamedMeshMetrics(const std::string &inputFilename,
+                                const bool (&run)[kNumMetricColumns],
+                                MetricOutput &output,
+                                const MetricSelection &selection,
+                                ProfileLog *profile) {
+  CGAL::Real_timer timer;
+  timer.start();
+  StreamedMetrics metrics;
+  bool streamed = false;
+  try {
+    StageTimer stage(profile, kStageStream, inputFilename);
+    streamed = streamMeshMetrics(inputFilename, selection.stream_options,
+                                 run[kSegmentColumn], run[kDanglingColumn],
+                                 selection.boundary_edges, metrics);
+    stage.setCounts(metrics.numTriangles, metrics.numVertices);
+  } catch (const std::exception &err) {
+    std::cerr << "Error: " << err.what() << std::endl;
+    std::cout << "Failed streaming " << inputFilename << "." << std::endl;
+    for (int column = 0; column < kNumMetricColumns; ++column) {
+      if (run[column]) {
+        output.fail(static_cast<MetricColumn>(column), kStatusFailed,
+                    timer.time());
+      }
+    }
+    return;
+  }
+  if (!streamed) {
+    for (int column = 0; column < kNumMetricColumns; ++column) {
+      if (run[column]) {
+        output.fail(static_cast<MetricColumn>(column), kStatusLoadFailed);
+      }
+    }
+    return;
+  }
+  output.setFaces(metrics.numTriangles);
+
+  if (run[kSegmentColumn]) {
+    output.write(kSegmentColumn, std::to_string(metrics.segments),
+                 timer.time());
+  }
+  if (run[kDanglingColumn]) {
+    if (metrics.numVertices == 0) {
+      // As computeDanglingEdges() on an empty mesh.
+      std::cerr << "Error: normalized scale less than 0." << std::endl;
+      std::cout << "Failed computing dangling edge length." << std::endl;
+      output.fail(kDanglingColumn, kStatusFailed, timer.time());
+    } else {
+      if (selection.boundary_edges) {
+        output.writeText(kBoundaryEdgesSuffix,
+                         formatBoundaryEdges(metrics.dangling),
+                         "Boundary edges");
+      }
+      std::ostringstream content;
+      content << metrics.dangling.normalizedLength();
+      output.write(kDanglingColumn, content.str(), timer.time());
+    }
+  }
+  if (run[kFluxColumn]) {
+    std::ostringstream content;
+    content << std::fixed << std::abs(metrics.flux);
+    output.write(kFluxColumn, content.str(), timer.time());
+  }
+}
+
+// Load the mesh once and run every selected metric kernel on it. The outputs
+// go to the same folders as the per-metric tools. With a supervisor the
+// kernels run in a worker process instead.
+void computeMeshMetrics(const std::string &inputFilename,
+                        FileScheduler &scheduler, ThreadBudget &budget,
+                        MetricOutput &output, const MetricSelection &selection,
+                        const Supervisor *supervisor, Workspace &workspace,
+                        ProfileLog *profile) {
+  output.begin(inputFilename);
+
+  // Metrics finished by the resumed run are replayed from the journal and
+  // metrics whose result is cached for this mesh content are restored, the
+  // mesh is only loaded for the others. The optional per-segment and
+  // per-edge lists are not cached.
+  bool runSegment = selection.segment && !output.replay(kSegmentColumn) &&
+                    (selection.segment_stats ||
+                     !output.restore(kSegmentColumn));
+  bool runDangling =
+      selection.dangling && !output.replay(kDanglingColumn) &&
+      (selection.boundary_edges || !output.restore(kDanglingColumn));
+  bool runFlux = selection.flux && !output.replay(kFluxColumn) &&
+                 !output.restore(kFluxColumn);
+  bool runSelfIntersection = selection.self_intersection &&
+                             !output.replay(kSelfIntersectionColumn) &&
+                             !output.restore(kSelfIntersectionColumn);
+  if (!runSegment && !runDangling && !runFlux && !runSelfIntersection) {
+    return;
+  }
+  const bool run[kNumMetricColumns] = {runSegment, runDangling, runFlux,
+                                       runSelfIntersection};
+  if (supervisor != nullptr) {
+    superviseMeshMetrics(inputFilename, scheduler, budget, output, selection,
+                         run, *supervisor);
+    return;
+  }
+  if (selection.stream) {
+    computeStreamedMeshMetrics(inputFilename, run, output, selection,
+                               profile);
+    return;
+  }
+
+  FlatMesh &mesh = workspace.mesh;
+  bool loaded;
+  {
+    StageTimer stage(profile, kStageLoad, inputFilename);
+    ThreadGrant grant(budget, scheduler.remaining());
+    loaded = loadFlatMesh(
+        inputFilename, mesh,
+        makeWeldOptions(selection.weld_tolerance, grant.threads()),
+        &workspace);
+    stage.setCounts(mesh.numTriangles(), mesh.numVertices());
+  }
+  if (!loaded) {
+    for (int column = 0; column < kNumMetricColumns; ++column) {
+      if (run[column]) {
+        output.fail(static_cast<MetricColumn>(column), kStatusLoadFailed);
+      }
+    }
+    return;
+  }
+  computeLoadedMeshMetrics(inputFilename, mesh, run, scheduler, budget,
+                           output, selection, workspace, profile);
+}
+
+// SegE of the ground truth mesh paired with a recon mesh. The ground truth
+// does not change between checkpoints, so after the first run its segment
+// number comes from the ground truth folder's result cache. With a
+// supervisor it runs in a worker process under the same limits as the recon
+// mesh.
+void computeGtSegment(const std::string &gtFilename, FileScheduler &scheduler,
+                      ThreadBudget &budget, MetricOutput &gtOutput,
+                      const MetricSelection &selection,
+                      const Supervisor *supervisor, Workspace &workspace,
+                      ProfileLog *profile) {
+  gtOutput.begin(gtFilename);
+  if (gtOutput.replay(kSegmentColumn) || gtOutput.restore(kSegmentColumn)) {
+    return;
+  }
+  const bool run[kNumMetricColumns] = {true, false, false, false};
+  if (supervisor != nullptr) {
+    // Only the segment number of the ground truth is written.
+    MetricSelection gtSelection = selection;
+    gtSelection.segment_stats = false;
+    superviseMeshMetrics(gtFilename, scheduler, budget, gtOutput,
+                         gtSelection, run, *supervisor);
+    return;
+  }
+  if (selection.stream) {
+    computeStreamedMeshMetrics(gtFilename, run, gtOutput, selection, profile);
+    return;
+  }
+
+  FlatMesh &mesh = workspace.mesh;
+  bool loaded;
+  {
+    StageTimer stage(profile, kStageLoad, gtFilename);
+    ThreadGrant grant(budget, scheduler.remaining());
+    loaded = loadFlatMesh(
+        gtFilename, mesh,
+        makeWeldOptions(selection.weld_tolerance, grant.threads()),
+        &workspace);
+    stage.setCounts(mesh.numTriangles(), mesh.numVertices());
+  }
+  if (!loaded) {
+    gtOutput.fail(kSegmentColumn, kStatusLoadFailed);
+    return;
+  }
+  gtOutput.setFaces(mesh.numTriangles());
+
+  CGAL::Real_timer timer;
+  timer.start();
+  try {
+    int segments;
+    {
+      StageTimer stage(profile, kStageSegment, gtFilename);
+      stage.setCounts(mesh.numTriangles(), mesh.numVertices());
+      ThreadGrant grant(budget, scheduler.remaining());
+      segments =
+          computeSegmentNumber(mesh.view(), grant.threads(), &workspace);
+    }
+    gtOutput.write(kSegmentColumn, std::to_string(segments), timer.time());
+  } catch (const std::exception &err) {
+    std::cerr << "Error: " << err.what() << std::endl;
+    std::cout << "Failed computing ground truth segment number." << std::endl;
+    gtOutput.fail(kSegmentColumn, kStatusFailed, timer.time());
+  }
+}
+
+// Ground truth mesh of every recon mesh, matched by mesh id (file name up to
+// the first dot), or "" when the ground truth folder has none.
+std::vector<std::string>
+pairGroundTruth(const std::vector<std::string> &reconFiles,
+                const std::string &gtDirname) {
+  std::unordered_map<std::string, std::string> gtById;
+  for (const std::string &gtFile : list_mesh_files(gtDirname)) {
+    gtById[meshIdOf(gtFile)] = gtFile;
+  }
+  std::vector<std::string> gtFiles(reconFiles.size());
+  size_t unpaired = 0;
+  for (size_t i = 0; i < reconFiles.size(); ++i) {
+    auto found = gtById.find(meshIdOf(reconFiles[i]));
+    if (found == gtById.end()) {
+      unpaired += 1;
+    } else {
+      gtFiles[i] = found->second;
+    }
+  }
+  if (unpaired > 0) {
+    std::cout << unpaired << " of " << reconFiles.size()
+              << " meshes have no ground truth in " << gtDirname << std::endl;
+  }
+  return gtFiles;
+}
+
+// Work through the meshes; in paired mode (gtOutput set) a recon mesh and
+// its ground truth are one unit of work. One workspace serves all meshes of
+// the worker.
+void computeAllMetrics(std::vector<std::string> &stlFiles,
+                       const std::vector<std::string> &gtFiles,
+                       FileScheduler &scheduler, ThreadBudget &budget,
+                       MetricOutput &output, MetricOutput *gtOutput,
+                       const MetricSelection &selection,
+                       const Supervisor *supervisor, ProfileLog *profile) {
+
+  Workspace workspace;
+  size_t iter;
+  while (scheduler.next(iter)) {
+    computeMeshMetrics(stlFiles[iter], scheduler, budget, output, selection,
+                       supervisor, workspace, profile);
+    if (gtOutput != nullptr && selection.segment && !gtFiles[iter].empty()) {
+      computeGtSegment(gtFiles[iter], scheduler, budget, *gtOutput, selection,
+                       supervisor, workspace, profile);
+    }
+    workspace.trim();
+  }
+  output.finish();
+  if (gtOutput != nullptr) {
+    gtOutput->finish();
+  }
+  budget.retire();
+}
+
+// Worker process of a supervised run (--worker-file): compute the selected
+// metrics of one mesh and report them on kWorkerReportFd.
+int runMetricWorker(const std::string &inputFilename,
+                    const MetricSelection &selection, size_t numThreads) {
+  exitWorkerOnOutOfMemory();
+  std::FILE *report = fdopen(kWorkerReportFd, "w");
+  if (report == nullptr) {
+    std::cerr << "Error: No report pipe, --worker-file is only used by "
+                 "--timeout and --memory-limit"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::vector<std::string> files(1, inputFilename);
+  FileScheduler scheduler(files, false);
+  size_t iter;
+  scheduler.next(iter);
+  // The only worker, with every granted core spare for its kernels.
+  ThreadBudget budget(1, numThreads - 1);
+  ResultCache cache("");
+  ResultsFile resultsFile("");
+  {
+    MetricOutput output(resultsFile, cache, OutputFormat::Text);
+    output.setReportStream(report);
+    Workspace workspace;
+    computeMeshMetrics(inputFilename, scheduler, budget, output, selection,
+                       nullptr, workspace, nullptr);
+  }
+  std::fclose(report);
+  return EXIT_SUCCESS;
+}
+
+// The --serve daemon: evaluate the meshes sent over socketPath on a pool of
+// numThreads workers until stopped. Nothing is written to disk, the results
+// go back to the clients.
+int serveMetrics(const std::string &socketPath, MetricSelection selection,
+                 size_t numThreads) {
+  // The per-segment and per-edge lists are only written as files.
+  selection.segment_stats = selection.boundary_edges = false;
+  const bool run[kNumMetricColumns] = {selection.segment, selection.dangling,
+                                       selection.flux,
+                                       selection.self_intersection};
+  ThreadBudget budget(numThreads);
+  ResultCache cache("");
+  ResultsFile resultsFile("");
+  std::vector<std::unique_ptr<MetricOutput>> outputs;
+  std::vector<Workspace> workspaces(numThreads);
+  for (size_t worker = 0; worker < numThreads; ++worker) {
+    outputs.emplace_back(
+        new MetricOutput(resultsFile, cache, OutputFormat::Columnar));
+  }
+
+  EvalServer server(
+      socketPath, numThreads, budget,
+      [&](const EvalRequest &request, EvalServer &server, size_t worker,
+          MetricRecord &record) {
+        MetricOutput &output = *outputs[worker];
+        Workspace &workspace = workspaces[worker];
+        std::string name = request.name();
+        output.begin(name);
+        FlatMesh &mesh = workspace.mesh;
+        bool loaded;
+        {
+          ThreadGrant grant(budget, server.remaining());
+          loaded = request.load(
+              mesh, makeWeldOptions(selection.weld_tolerance, grant.threads()),
+              &workspace);
+        }
+        if (loaded) {
+          computeLoadedMeshMetrics(name, mesh, run, server, budget, output,
+                                   selection, workspace, nullptr);
+        } else {
+          for (int column = 0; column < kNumMetricColumns; ++column) {
+            if (run[column]) {
+              output.fail(static_cast<MetricColumn>(column),
+                          kStatusLoadFailed);
+            }
+          }
+        }
+        record = output.record();
+        workspace.trim();
+      });
+  return server.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv) {
+
+  // Configure the argument parser
+  args::ArgumentParser parser("CAD metrics (SegE, DangEL, FluxEE, SIR)");
+  args::ValueFlag<std::string> metricsFlag(
+      parser, "metrics",
+      "Comma separated metrics to compute: segment, dangling, flux, self or "
+      "all (default).",
+      {'m', "metrics"}, "all");
+  CommonArgs common(parser);
+  SelfIntersectionArgs sir(parser);
+  args::Flag segmentStats(
+      parser, "segment-stats",
+      "Also write the face and vertex count of every segment to "
+      "<mesh_dir>_segment_stats.",
+      {"segment-stats"});
+  args::Flag boundaryEdges(
+      parser, "boundary-edges",
+      "Also write the vertex pairs of the dangling edges to "
+      "<mesh_dir>_boundary_edges.",
+      {"boundary-edges"});
+  args::ValueFlag<std::string> gtDirFlag(
+      parser, "gt_dir",
+      "Ground truth folder. Each mesh is evaluated together with the ground "
+      "truth mesh of the same name, whose segment number goes to "
+      "<gt_dir>_segment_num.",
+      {"gt"});
+  args::ValueFlag<std::string> profileFlag(
+      parser, "profile",
+      "Write the time, face and vertex counts and peak RSS growth of every "
+      "stage of every mesh to this file (CSV when it ends in .csv, JSON "
+      "otherwise).",
+      {"profile"});
+  args::Flag resume(parser, "resume",
+                    "Continue an interrupted run: replay the metrics recorded "
+                    "in <mesh_dir>_journal.tsv and compute only the others.",
+                    {"resume"});
+  args::ValueFlag<double> timeoutFlag(
+      parser, "seconds",
+      "Run the metrics of every mesh in a worker process and kill it when a "
+      "metric takes longer than this. The metrics left are recorded as "
+      "timeout.",
+      {"timeout"}, 0.0);
+  args::ValueFlag<size_t> memoryLimitFlag(
+      parser, "MiB",
+      "Run the metrics of every mesh in a worker process and kill it when its "
+      "resident memory grows beyond this. The metrics left are recorded as "
+      "out_of_memory.",
+      {"memory-limit"}, 0);
+  args::ValueFlag<std::string> workerFileFlag(
+      parser, "mesh_file",
+      "Internal: run as the worker process of --timeout or --memory-limit "
+      "on this mesh.",
+      {"worker-file"});
+  args::ValueFlag<std::string> serveFlag(
+      parser, "socket",
+      "Run as a daemon evaluating the meshes sent to this Unix domain "
+      "socket, with -j workers (protocol in include/metrics/eval_server.h).",
+      {"serve"});
+  args::Flag streamFlag(
+      parser, "stream",
+      "Compute SegE, DangEL and FluxEE of binary STL and PLY files out of "
+      "core, in bounded memory, without loading the meshes. Not with SIR, "
+      "--segment-stats or --weld-tolerance.",
+      {"stream"});
+  args::ValueFlag<size_t> streamMemoryFlag(
+      parser, "MiB",
+      "Memory of the sort buffers of --stream, per worker (default 1024).",
+      {"stream-memory"}, kDefaultStreamMemoryMb);
+  args::ValueFlag<std::string> streamTmpFlag(
+      parser, "dir",
+      "Folder of the temporary files of --stream (default: $TMPDIR or "
+      "/tmp).",
+      {"stream-tmp"});
+
+  // Parse args
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (args::Help &h) {
+    std::cout << parser;
+    return 0;
+  } catch (args::ParseError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return 1;
+  }
+
+  MetricSelection selection;
+  if (!parseMetricSelection(args::get(metricsFlag), selection)) {
+    std::cerr << parser;
+    return EXIT_FAILURE;
+  }
+  selection.segment_stats = args::get(segmentStats);
+  selection.boundary_edges = args::get(boundaryEdges);
+  selection.weld_tolerance = args::get(common.weldTolerance);
+  if (!sir.parse(parser, selection.self_intersection_options)) {
+    return EXIT_FAILURE;
+  }
+  selection.stream = args::get(streamFlag);
+  selection.stream_options =
+      makeStreamOptions(args::get(streamMemoryFlag), args::get(streamTmpFlag));
+  if (selection.stream &&
+      (selection.self_intersection || selection.segment_stats ||
+       selection.weld_tolerance > 0.0 || serveFlag)) {
+    std::cerr << "Error: --stream computes segment, dangling and flux of mesh "
+                 "files, without --segment-stats, --weld-tolerance or --serve"
+              << std::endl;
+    std::cerr << parser;
+    return EXIT_FAILURE;
+  }
+  size_t numThreads = common.numThreads();
+  if (workerFileFlag) {
+    return runMetricWorker(args::get(workerFileFlag), selection, numThreads);
+  }
+  if (serveFlag) {
+    return serveMetrics(args::get(serveFlag), selection, numThreads);
+  }
+
+  MeshList meshes;
+  OutputFormat format;
+  if (!common.collect(parser, meshes, format)) {
+    return EXIT_FAILURE;
+  }
+  std::vector<std::string> &stlFiles = meshes.files;
+
+  FileScheduler scheduler(stlFiles, args::get(common.largestFirst));
+  ThreadBudget budget(numThreads);
+  ResultCache cache(
+      metricCachePath(meshes.runBase, !args::get(common.noCache)));
+  ResultsFile resultsFile(resultsFilePath(meshes.runBase, format));
+  RunJournal journal(runJournalPath(meshes.runBase), args::get(resume));
+  if (journal.resumed() > 0) {
+    std::cout << "Resuming: " << journal.resumed()
+              << " metrics recorded in the journal" << std::endl;
+  }
+
+  // Paired mode keeps the ground truth results in their own folder, cache and
+  // results file, as if the ground truth folder had been evaluated alone. A
+  // shard keeps shard-local ground truth files as well.
+  bool paired = static_cast<bool>(gtDirFlag);
+  std::string gtDirname = args::get(gtDirFlag);
+  std::vector<std::string> gtFiles;
+  if (paired) {
+    gtFiles = pairGroundTruth(stlFiles, gtDirname);
+    while (gtDirname.size() > 1 && gtDirname.back() == '/') {
+      gtDirname.pop_back();
+    }
+  }
+  std::string gtRunBase = gtDirname + meshes.shardSuffix;
+  ResultCache gtCache(
+      metricCachePath(gtRunBase, paired && !args::get(common.noCache)));
+  ResultsFile gtResultsFile(
+      paired ? resultsFilePath(gtRunBase, format) : std::string());
+  RunJournal gtJournal(paired ? runJournalPath(gtRunBase) : std::string(),
+                       args::get(resume));
+  Profiler profiler(numThreads, static_cast<bool>(profileFlag));
+  bool supervised =
+      args::get(timeoutFlag) > 0.0 || args::get(memoryLimitFlag) > 0;
+  Supervisor supervisor(args::get(timeoutFlag), args::get(memoryLimitFlag));
+  runWorkers(numThreads, [&](size_t worker) {
+    MetricOutput output(resultsFile, cache, format);
+    MetricOutput gtOutput(gtResultsFile, gtCache, format);
+    output.setProfile(profiler.log(worker));
+    gtOutput.setProfile(profiler.log(worker));
+    output.setJournal(&journal);
+    gtOutput.setJournal(&gtJournal);
+    // Streamed values are cached apart, see streaming.h.
+    std::string cacheTag = weldCacheTag(selection.weld_tolerance) +
+                           (selection.stream ? kStreamCacheTag : "");
+    output.setCacheTag(cacheTag);
+    gtOutput.setCacheTag(cacheTag);
+    output.setCacheTag(
+        kSelfIntersectionColumn,
+        selfIntersectionCacheTag(selection.self_intersection_options));
+    gtOutput.setCacheTag(
+        kSelfIntersectionColumn,
+        selfIntersectionCacheTag(selection.self_intersection_options));
+    output.setJournalTag(
+        kSelfIntersectionColumn,
+        selfIntersectionJournalTag(selection.self_intersection_options));
+    gtOutput.setJournalTag(
+        kSelfIntersectionColumn,
+        selfIntersectionJournalTag(selection.self_intersection_options));
+    computeAllMetrics(stlFiles, gtFiles, scheduler, budget, output,
+                      paired ? &gtOutput : nullptr, selection,
+                      supervised ? &supervisor : nullptr,
+                      profiler.log(worker));
+  });
+  if (profileFlag) {
+    profiler.write(args::get(profileFlag));
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,330 @@
+#include "algorithm"
+#include "array"
+#include "cmath"
+#include "cstdio"
+#include "cstdlib"
+#include "fstream"
+#include "mutex"
+#include "sstream"
+#include "unordered_map"
+
+#include "metrics/compensated_sum.h"
+#include "metrics/json.h"
+#include "metrics/paths.h"
+#include "metrics/results_file.h"
+#include "metrics/scheduler.h"
+
+#include "args/args.hxx"
+
+// Collects the metric outputs of an evaluation folder (recon/ and gt/ run
+// through cad_metrics) and writes <folder>/results.json.
+
+// Values of one metric, by mesh id.
+struct MetricColumnValues {
+  std::unordered_map<std::string, double> values;
+  // Outputs that could not be parsed or metrics that failed.
+  size_t failed = 0;
+  // Results file only: metrics stopped by --timeout or --memory-limit.
+  size_t timeout = 0;
+  size_t outOfMemory = 0;
+};
+
+// Read the one-file-per-mesh outputs in dirPath.
+MetricColumnValues readTextColumn(const std::string &dirPath,
+                                  MetricColumn column, size_t numThreads) {
+  MetricColumnValues result;
+  std::vector<std::string> files = list_directory(dirPath);
+  FileScheduler scheduler(files, false);
+  std::mutex mutex;
+  runWorkers(numThreads, [&](size_t) {
+    std::vector<std::pair<std::string, double>> values;
+    size_t failed = 0;
+    size_t iter;
+    while (scheduler.next(iter)) {
+      // Skips the temporary files of an interrupted write as well.
+      if (!hasExtension(files[iter], ".txt")) {
+        continue;
+      }
+      std::ifstream inFile(dirPath + "/" + files[iter]);
+      std::string content((std::istreambuf_iterator<char>(inFile)),
+                          std::istreambuf_iterator<char>());
+      double value;
+      if (inFile.is_open() && parseMetricValue(column, content, value)) {
+        values.emplace_back(meshIdOf(files[iter]), value);
+      } else {
+        failed += 1;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &entry : values) {
+      result.values[entry.first] = entry.second;
+    }
+    result.failed += failed;
+  });
+  return result;
+}
+
+// Read every metric column of a results file. A mesh has several rows when
+// it was evaluated again or by several per-metric tools; each metric is
+// taken from the last row that ran it.
+bool readColumnarResults(const std::string &path,
+                         MetricColumnValues (&columns)[kNumMetricColumns]) {
+  std::vector<MetricRecord> records;
+  if (!readResultsFile(path, records)) {
+    return false;
+  }
+  const size_t none = records.size();
+  std::unordered_map<std::string, std::array<size_t, kNumMetricColumns>>
+      latest;
+  for (size_t i = 0; i < records.size(); ++i) {
+    std::array<size_t, kNumMetricColumns> unset;
+    unset.fill(none);
+    std::array<size_t, kNumMetricColumns> &rows =
+        latest.emplace(records[i].meshId, unset).first->second;
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      if (records[i].status[c] != kStatusNotRun) {
+        rows[c] = i;
+      }
+    }
+  }
+  for (const auto &entry : latest) {
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      if (entry.second[c] == none) {
+        continue;
+      }
+      const MetricRecord &record = records[entry.second[c]];
+      if (metricStatusHasValue(record.status[c])) {
+        columns[c].values[record.meshId] = record.value[c];
+      } else if (record.status[c] == kStatusTimeout) {
+        columns[c].timeout += 1;
+      } else if (record.status[c] == kStatusOutOfMemory) {
+        columns[c].outOfMemory += 1;
+      } else {
+        columns[c].failed += 1;
+      }
+    }
+  }
+  return true;
+}
+
+// <evalDir>/<name>_results.bin and the results files of the shards of a
+// sharded run, <name>_shard<i>of<N>_results.bin, in path order.
+std::vector<std::string> resultsFilesOf(const std::string &evalDir,
+                                        const std::string &name) {
+  std::vector<std::string> paths;
+  std::string prefix = name + "_shard";
+  for (const std::string &file : list_directory(evalDir)) {
+    if (file == name + kResultsFileSuffix ||
+        (file.compare(0, prefix.size(), prefix) == 0 &&
+         hasExtension(file, kResultsFileSuffix))) {
+      paths.push_back(evalDir + "/" + file);
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+  return paths;
+}
+
+struct MetricSummary {
+  std::vector<double> values;
+  size_t nanCount = 0;
+  size_t failedCount = 0;
+  size_t timeoutCount = 0;
+  size_t outOfMemoryCount = 0;
+  // SegE only: recon meshes without a GT segment number.
+  size_t missingGtCount = 0;
+
+  void add(double value) {
+    if (std::isnan(value)) {
+      nanCount += 1;
+    } else {
+      values.push_back(value);
+    }
+  }
+};
+
+// Percentile with linear interpolation between the closest ranks, as numpy
+// computes it. values must be sorted and not empty.
+double percentile(const std::vector<double> &values, double q) {
+  double rank = q / 100.0 * static_cast<double>(values.size() - 1);
+  size_t lower = static_cast<size_t>(std::floor(rank));
+  size_t upper = std::min(lower + 1, values.size() - 1);
+  double fraction = rank - static_cast<double>(lower);
+  return values[lower] + fraction * (values[upper] - values[lower]);
+}
+
+void writeSummary(std::ostream &out, const std::string &name,
+                  MetricSummary &summary, bool withMissingGt) {
+  std::vector<double> &values = summary.values;
+  std::sort(values.begin(), values.end());
+  CompensatedSum sum;
+  for (double value : values) {
+    sum.add(value);
+  }
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  bool empty = values.empty();
+
+  out << "        \"" << name << "\": {\n";
+  out << "            \"count\": " << values.size() << ",\n";
+  out << "            \"nan\": " << summary.nanCount << ",\n";
+  out << "            \"failed\": " << summary.failedCount << ",\n";
+  out << "            \"timeout\": " << summary.timeoutCount << ",\n";
+  out << "            \"out_of_memory\": " << summary.outOfMemoryCount
+      << ",\n";
+  if (withMissingGt) {
+    out << "            \"missing_gt\": " << summary.missingGtCount << ",\n";
+  }
+  const char *names[] = {"mean", "min", "p50", "p90", "p95", "p99", "max"};
+  double stats[] = {
+      empty ? nan : sum.value() / values.size(),
+      empty ? nan : values.front(),
+      empty ? nan : percentile(values, 50.0),
+      empty ? nan : percentile(values, 90.0),
+      empty ? nan : percentile(values, 95.0),
+      empty ? nan : percentile(values, 99.0),
+      empty ? nan : values.back()};
+  for (int i = 0; i < 7; ++i) {
+    out << "            \"" << names[i] << "\": ";
+    out << jsonNumber(stats[i]);
+    out << (i + 1 < 7 ? ",\n" : "\n");
+  }
+  out << "        }";
+}
+
+double summaryMean(const MetricSummary &summary) {
+  if (summary.values.empty()) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  CompensatedSum sum;
+  for (double value : summary.values) {
+    sum.add(value);
+  }
+  return sum.value() / summary.values.size();
+}
+
+int main(int argc, char **argv) {
+
+  // Configure the argument parser
+  args::ArgumentParser parser("Merge the metric results into results.json");
+  args::ValueFlag<std::string> inputFormat(
+      parser, "input-format",
+      "Read the per-mesh text outputs (text), the results files "
+      "recon_results.bin and gt_results.bin or those of their shards "
+      "(columnar), or the results files when they exist (auto, default).",
+      {"input-format"}, "auto");
+  args::ValueFlag<size_t> threadsFlag(
+      parser, "threads", "Number of reader threads (default: all cores).",
+      {'j', "threads"}, defaultThreadCount());
+  args::Positional<std::string> inputDirname(
+      parser, "eval_dir", "Evaluation folder containing recon/ and gt/.");
+
+  // Parse args
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (args::Help &h) {
+    std::cout << parser;
+    return 0;
+  } catch (args::ParseError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return 1;
+  }
+
+  if (!inputDirname) {
+    std::cerr << "Please specify the evaluation folder as argument"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string evalDir = args::get(inputDirname);
+  size_t numThreads = std::max<size_t>(1, args::get(threadsFlag));
+  std::string format = args::get(inputFormat);
+  std::vector<std::string> reconResults = resultsFilesOf(evalDir, "recon");
+  std::vector<std::string> gtResults = resultsFilesOf(evalDir, "gt");
+  if (format == "auto") {
+    format = reconResults.empty() ? "text" : "columnar";
+  }
+
+  MetricColumnValues recon[kNumMetricColumns];
+  MetricColumnValues gt[kNumMetricColumns];
+  if (format == "columnar") {
+    if (reconResults.empty()) {
+      std::cerr << "Error: No recon results file in " << evalDir << std::endl;
+      return EXIT_FAILURE;
+    }
+    // The shards evaluate disjoint meshes, their rows are simply combined.
+    for (const std::string &path : reconResults) {
+      if (!readColumnarResults(path, recon)) {
+        return EXIT_FAILURE;
+      }
+    }
+    for (const std::string &path : gtResults) {
+      readColumnarResults(path, gt);
+    }
+  } else if (format == "text") {
+    const char *suffixes[kNumMetricColumns] = {
+        kSegmentNumSuffix, kDanglingEdgeSuffix, kFluxEnclosureSuffix,
+        kSelfIntersectionSuffix};
+    for (int c = 0; c < kNumMetricColumns; ++c) {
+      recon[c] = readTextColumn(evalDir + "/recon" + suffixes[c],
+                                static_cast<MetricColumn>(c), numThreads);
+    }
+    gt[kSegmentColumn] = readTextColumn(evalDir + "/gt" + kSegmentNumSuffix,
+                                        kSegmentColumn, numThreads);
+  } else {
+    std::cerr << "Unknown input format: " << format << std::endl;
+    std::cerr << parser;
+    return EXIT_FAILURE;
+  }
+
+  // SegE: |recon - GT| segment number, joined by mesh id.
+  MetricSummary summaries[kNumMetricColumns];
+  const std::unordered_map<std::string, double> &gtSegments =
+      gt[kSegmentColumn].values;
+  for (const auto &entry : recon[kSegmentColumn].values) {
+    auto found = gtSegments.find(entry.first);
+    if (found == gtSegments.end()) {
+      summaries[kSegmentColumn].missingGtCount += 1;
+      continue;
+    }
+    summaries[kSegmentColumn].add(std::abs(entry.second - found->second));
+  }
+  for (int c = kDanglingColumn; c < kNumMetricColumns; ++c) {
+    for (const auto &entry : recon[c].values) {
+      summaries[c].add(entry.second);
+    }
+  }
+  for (int c = 0; c < kNumMetricColumns; ++c) {
+    summaries[c].failedCount = recon[c].failed;
+    summaries[c].timeoutCount = recon[c].timeout;
+    summaries[c].outOfMemoryCount = recon[c].outOfMemory;
+    std::cout << kMetricColumnNames[c] << ": " << summaries[c].values.size()
+              << std::endl;
+  }
+
+  // The top level keys are the ones scripts/merge_results.py wrote.
+  const char *resultNames[kNumMetricColumns] = {
+      "segment_num_error", "dangling_edge_length",
+      "flux_enclosure_error", "self_intersection_percentage"};
+  std::ostringstream json;
+  json << "{\n";
+  for (int c = 0; c < kNumMetricColumns; ++c) {
+    json << "    \"" << resultNames[c] << "\": ";
+    json << jsonNumber(summaryMean(summaries[c]));
+    json << ",\n";
+  }
+  json << "    \"statistics\": {\n";
+  for (int c = 0; c < kNumMetricColumns; ++c) {
+    writeSummary(json, resultNames[c], summaries[c], c == kSegmentColumn);
+    json << (c + 1 < kNumMetricColumns ? ",\n" : "\n");
+  }
+  json << "    }\n}\n";
+
+  std::string outputFilename = evalDir + "/results.json";
+  std::ofstream outFile(outputFilename);
+  if (!outFile.is_open()) {
+    std::cerr << "Error: Could not open " << outputFilename << std::endl;
+    return EXIT_FAILURE;
+  }
+  outFile << json.str();
+  std::cout << "Results saved to: " << outputFilename << std::endl;
+  return EXIT_SUCCESS;
+}